@@ -0,0 +1,284 @@
+/*
+** $Id: StringEscape.hpp $
+** Vectorized escaping of JSON strings.
+** See Copyright Notice in lua_rapidjsonlib.h
+*/
+#ifndef __STRINGESCAPE_HPP__
+#define __STRINGESCAPE_HPP__
+
+#include <cstring>
+
+#include <rapidjson/rapidjson.h>
+#include <rapidjson/encodings.h>
+#include <rapidjson/stream.h>
+
+#if defined(__AVX2__)
+  #include <immintrin.h>
+  #define LUA_RAPIDJSON_ESCAPE_AVX2
+#elif defined(RAPIDJSON_SSE42) || defined(RAPIDJSON_SSE2)
+  #include <emmintrin.h>
+  #define LUA_RAPIDJSON_ESCAPE_SSE2
+#elif defined(RAPIDJSON_NEON) || defined(__ARM_NEON)
+  #include <arm_neon.h>
+  #define LUA_RAPIDJSON_ESCAPE_NEON
+#endif
+
+#if defined(_MSC_VER)
+  #include <intrin.h>
+#endif
+
+/* Strings shorter than this many bytes are left to rapidjson::Writer */
+#if !defined(LUA_RAPIDJSON_ESCAPE_MIN)
+  #define LUA_RAPIDJSON_ESCAPE_MIN 16
+#endif
+
+/* Blocks with at least this many bytes to escape are expanded bytewise */
+#if !defined(LUA_RAPIDJSON_ESCAPE_DENSE)
+  #define LUA_RAPIDJSON_ESCAPE_DENSE 4
+#endif
+
+/*
+** Writer::ScanWriteUnescapedString
+**
+** rapidjson::Writer::WriteString reserves six output bytes per input byte and
+** calls ScanWriteUnescapedString to copy the bytes that need no escaping; the
+** bytes that do are then escaped one at a time. rapidjson only specializes it
+** (with SSE2/SSE4.2/NEON) for Writer<StringBuffer>, i.e., the default allocator
+** and flags, so it is specialized for the output buffers of this library with
+** ScanWriteEscaped, which escapes the whole string:
+**
+**  1. 32 (AVX2) or 16 (SSE2, NEON) bytes are loaded and stored as-is, then
+**     compared against '"', '\\', and control characters. Blocks without any
+**     are done; there is no other branch.
+**  2. Otherwise, the escape sequence of the first such character is written
+**     and the scan continues just past it.
+**  3. Blocks with LUA_RAPIDJSON_ESCAPE_DENSE or more, i.e., escape-dense
+**     strings, are instead expanded from the first through EscapeTable: an
+**     unconditional eight-byte copy of each byte's (padded) sequence and an
+**     advance by its length.
+**
+** Without vector extensions, blocks are eight bytes compared as a uint64_t
+** (SWAR) on little-endian targets.
+*/
+RAPIDJSON_NAMESPACE_BEGIN
+namespace extend {
+  /// <summary>
+  /// The JSON escape sequence of each byte, e.g., \n for '\n' and \u001F for
+  /// 0x1F, as rapidjson::Writer writes them; other bytes are copied as-is.
+  /// Padded to eight bytes so each sequence is written with a single copy.
+  /// </summary>
+  struct EscapeTable {
+    unsigned char length[256];
+    char sequence[256][8];
+
+    EscapeTable() {
+      static const char hex[] = "0123456789ABCDEF";
+      std::memset(sequence, 0, sizeof(sequence));
+      for (int c = 0; c < 256; ++c) {
+        char *s = sequence[c];
+        char named = 0;
+        switch (c) {
+          case '"': named = '"'; break;
+          case '\\': named = '\\'; break;
+          case '\b': named = 'b'; break;
+          case '\f': named = 'f'; break;
+          case '\n': named = 'n'; break;
+          case '\r': named = 'r'; break;
+          case '\t': named = 't'; break;
+          default: break;
+        }
+
+        if (named != 0) {
+          s[0] = '\\';
+          s[1] = named;
+          length[c] = 2;
+        }
+        else if (c < 0x20) {
+          std::memcpy(s, "\\u00", 4);
+          s[4] = hex[c >> 4];
+          s[5] = hex[c & 0xF];
+          length[c] = 6;
+        }
+        else {
+          s[0] = static_cast<char>(c);
+          length[c] = 1;
+        }
+      }
+    }
+  };
+
+  static inline const EscapeTable &GetEscapeTable() {
+    static const EscapeTable table;
+    return table;
+  }
+
+  static inline unsigned EscapeTrailingZeros(uint64_t mask) {
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long offset = 0;
+    _BitScanForward64(&offset, mask);
+    return static_cast<unsigned>(offset);
+#elif defined(_MSC_VER)
+    unsigned long offset = 0;
+    if (static_cast<uint32_t>(mask) != 0)
+      _BitScanForward(&offset, static_cast<uint32_t>(mask));
+    else {
+      _BitScanForward(&offset, static_cast<uint32_t>(mask >> 32));
+      offset += 32;
+    }
+    return static_cast<unsigned>(offset);
+#else
+    return static_cast<unsigned>(__builtin_ctzll(mask));
+#endif
+  }
+
+  /// <summary>
+  /// Expand "count" bytes through the EscapeTable; "dst" must have room for
+  /// seven bytes more than the expansion.
+  /// </summary>
+  static inline char *EscapeExpand(const EscapeTable &table, const char *src, size_t count, char *dst) {
+    for (size_t i = 0; i < count; ++i) {
+      const unsigned char c = static_cast<unsigned char>(src[i]);
+      std::memcpy(dst, table.sequence[c], 8);
+      dst += table.length[c];
+    }
+    return dst;
+  }
+
+  /// <summary>
+  /// Return true if "mask" has at least LUA_RAPIDJSON_ESCAPE_DENSE bits set.
+  /// </summary>
+  static inline bool EscapeDense(uint64_t mask) {
+    for (int i = 1; i < LUA_RAPIDJSON_ESCAPE_DENSE; ++i)
+      mask &= mask - 1;  // Clear the lowest bit
+    return mask != 0;
+  }
+
+  /// <summary>
+  /// Finish a block of "block" bytes, already stored as-is, given the position
+  /// of its first byte to escape and whether the block is escape-dense.
+  /// </summary>
+  static inline void EscapeBlock(const EscapeTable &table, size_t block, unsigned first, bool dense, const char *&src, char *&dst) {
+    if (dense) {
+      dst = EscapeExpand(table, src + first, block - first, dst + first);
+      src += block;
+    }
+    else {
+      const unsigned char c = static_cast<unsigned char>(src[first]);
+      std::memcpy(dst + first, table.sequence[c], 8);
+      dst += first + table.length[c];
+      src += first + 1;
+    }
+  }
+
+  /// <summary>
+  /// Escape "len" bytes of "src" into "dst" (without quotes), returning the end
+  /// of the output; "dst" must hold at least len * 6 + 8 bytes.
+  /// </summary>
+  static inline char *EscapeString(const char *src, size_t len, char *dst) {
+    const EscapeTable &table = GetEscapeTable();
+    const char *const end = src + len;
+
+#if defined(LUA_RAPIDJSON_ESCAPE_AVX2)
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i control = _mm256_set1_epi8(0x1F);
+    while (end - src >= 32) {
+      const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src));
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst), v);
+
+      const __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)),
+        _mm256_cmpeq_epi8(_mm256_min_epu8(v, control), v));  // v <= 0x1F
+      const uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(m));
+      if (RAPIDJSON_LIKELY(mask == 0)) {
+        src += 32;
+        dst += 32;
+      }
+      else
+        EscapeBlock(table, 32, EscapeTrailingZeros(mask), EscapeDense(mask), src, dst);
+    }
+#elif defined(LUA_RAPIDJSON_ESCAPE_SSE2)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1F);
+    while (end - src >= 16) {
+      const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), v);
+
+      const __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+        _mm_cmpeq_epi8(_mm_min_epu8(v, control), v));  // v <= 0x1F
+      const uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(m));
+      if (RAPIDJSON_LIKELY(mask == 0)) {
+        src += 16;
+        dst += 16;
+      }
+      else
+        EscapeBlock(table, 16, EscapeTrailingZeros(mask), EscapeDense(mask), src, dst);
+    }
+#elif defined(LUA_RAPIDJSON_ESCAPE_NEON)
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    const uint8x16_t control = vdupq_n_u8(0x1F);
+    while (end - src >= 16) {
+      const uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t *>(src));
+      vst1q_u8(reinterpret_cast<uint8_t *>(dst), v);
+
+      const uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, backslash)), vcleq_u8(v, control));
+      /* Narrow each byte to a nibble of a 64-bit mask; one bit per byte is kept */
+      const uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0) & 0x8888888888888888ull;
+      if (RAPIDJSON_LIKELY(mask == 0)) {
+        src += 16;
+        dst += 16;
+      }
+      else
+        EscapeBlock(table, 16, EscapeTrailingZeros(mask) >> 2, EscapeDense(mask), src, dst);
+    }
+#elif RAPIDJSON_ENDIAN == RAPIDJSON_LITTLEENDIAN
+    /*
+    ** SWAR: the high bit of each byte of "mask" is set if the byte is '"', '\\',
+    ** or below 0x20. Bytes above a match may also be flagged (by the borrow),
+    ** so only the first is exact; "single" is then exact as well.
+    */
+    const uint64_t ones = 0x0101010101010101ull;
+    const uint64_t highs = 0x8080808080808080ull;
+    while (end - src >= 8) {
+      uint64_t w = 0;
+      std::memcpy(&w, src, sizeof(w));
+      std::memcpy(dst, &w, sizeof(w));
+
+      const uint64_t q = w ^ (ones * '"');
+      const uint64_t b = w ^ (ones * '\\');
+      const uint64_t mask = (((q - ones) & ~q) | ((b - ones) & ~b) | ((w - ones * 0x20) & ~w)) & highs;
+      if (RAPIDJSON_LIKELY(mask == 0)) {
+        src += 8;
+        dst += 8;
+      }
+      else
+        EscapeBlock(table, 8, EscapeTrailingZeros(mask) >> 3, EscapeDense(mask), src, dst);
+    }
+#endif
+    return EscapeExpand(table, src, static_cast<size_t>(end - src), dst);
+  }
+
+  /// <summary>
+  /// Writer::ScanWriteUnescapedString for GenericStringBuffer outputs: escape
+  /// the remainder of the string directly into the buffer, returning false
+  /// once nothing remains. Short strings, and writers that validate the
+  /// encoding, are left to the Writer.
+  /// </summary>
+  template<typename Buffer>
+  static inline bool ScanWriteEscaped(Buffer &os, RAPIDJSON_NAMESPACE::GenericStringStream<UTF8<> > &is, size_t length, bool validate) {
+    if (validate || length < LUA_RAPIDJSON_ESCAPE_MIN)
+      return RAPIDJSON_LIKELY(is.Tell() < length);
+
+    const size_t remaining = length - is.Tell();
+    const size_t capacity = remaining * 6 + 8;  // WriteString has reserved length * 6 + 2
+    char *begin = os.Push(capacity);
+    const char *end = EscapeString(is.src_, remaining, begin);
+    os.Pop(capacity - static_cast<size_t>(end - begin));
+    is.src_ += remaining;
+    return false;
+  }
+}
+RAPIDJSON_NAMESPACE_END
+
+#endif
@@ -6,6 +6,7 @@
 #ifndef __STRINGSTREAM_HPP__
 #define __STRINGSTREAM_HPP__
 
+#include <cstring>
 #include <string>
 #if defined(LUA_INCLUDE_HPP)
   #include <lua.hpp>
@@ -159,6 +160,66 @@ public:
   }
 };
 
+/// <summary>
+/// Bump allocator over caller-provided (e.g., on-stack) storage. The most
+/// recently allocated block is resized in place and "Free" is a no-op: nothing
+/// needs to be released if a Lua error unwinds the owner. Exhausted is thrown,
+/// rather than falling back to the heap, once the storage is exhausted.
+/// </summary>
+class FixedAllocator {
+public:
+  static const bool kNeedFree = false;
+
+  class Exhausted : public std::exception {
+  public:
+    const char *what() const noexcept override {
+      return "fixed allocator exhausted";
+    }
+  };
+
+  FixedAllocator() : top_(RAPIDJSON_NULLPTR), end_(RAPIDJSON_NULLPTR) { }
+  FixedAllocator(void *buffer, size_t size) {
+    const uintptr_t addr = reinterpret_cast<uintptr_t>(buffer);
+    const uintptr_t aligned = RAPIDJSON_ALIGN(addr);
+    top_ = reinterpret_cast<char *>(aligned);
+    end_ = reinterpret_cast<char *>(addr + size);
+    if (end_ < top_)
+      end_ = top_;
+  }
+
+  void *Realloc(void *originalPtr, size_t originalSize, size_t newSize) {
+    char *ptr = reinterpret_cast<char *>(originalPtr);
+    newSize = RAPIDJSON_ALIGN(newSize);
+    if (ptr != RAPIDJSON_NULLPTR && ptr + RAPIDJSON_ALIGN(originalSize) == top_) {  // Most recent block
+      if (newSize > static_cast<size_t>(end_ - ptr))
+        throw Exhausted();
+      top_ = ptr + newSize;
+      return ptr;
+    }
+
+    if (newSize > static_cast<size_t>(end_ - top_))
+      throw Exhausted();
+
+    char *result = top_;
+    top_ += newSize;
+    if (ptr != RAPIDJSON_NULLPTR)
+      std::memcpy(result, ptr, (originalSize < newSize) ? originalSize : newSize);
+    return result;
+  }
+
+  RAPIDJSON_FORCEINLINE void *Malloc(size_t size) {
+    return Realloc(RAPIDJSON_NULLPTR, 0, size);
+  }
+
+  static RAPIDJSON_FORCEINLINE void Free(void *ptr) {
+    (void)(ptr);
+  }
+
+private:
+  char *top_;  // Beginning of the unallocated storage
+  char *end_;
+};
+
 /// <summary>
 /// lua_checkstack returned false.
 /// </summary>
@@ -170,6 +231,19 @@ public:
   }
 };
 
+/// <summary>
+/// A tentative encoding (see encode_tiny) cannot complete without calling a
+/// Lua function or exceeding its fixed-size output; the value is encoded again
+/// by the general path.
+/// </summary>
+class LuaRestartException : public std::exception {
+public:
+  LuaRestartException() { }
+  const char *what() const noexcept override {
+    return "Encoding restarted";
+  }
+};
+
 /// <summary>
 /// A JSON encoding/decoding error.
 /// </summary>
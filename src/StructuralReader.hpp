@@ -0,0 +1,760 @@
+/*
+** $Id: StructuralReader.hpp $
+** Two-stage (structural index) JSON reader.
+** See Copyright Notice in lua_rapidjsonlib.h
+*/
+#ifndef __STRUCTURALREADER_HPP__
+#define __STRUCTURALREADER_HPP__
+
+#include <cstring>
+#include <cstdlib>
+#include <clocale>
+#include <limits>
+
+#include <rapidjson/rapidjson.h>
+#include <rapidjson/reader.h>
+#include <rapidjson/internal/stack.h>
+#include <rapidjson/error/error.h>
+
+/*
+** Maximum nesting depth of the containers parsed by a StructuralReader; stage
+** two recurses once per level. Deeper documents are rejected by stage one.
+*/
+#if !defined(LUA_RAPIDJSON_STRUCTURAL_DEPTH)
+  #define LUA_RAPIDJSON_STRUCTURAL_DEPTH 1024
+#endif
+
+#if defined(RAPIDJSON_SSE2) || defined(RAPIDJSON_SSE42)
+  #include <emmintrin.h>
+  #define LUA_RAPIDJSON_STRUCTURAL_SSE2
+#endif
+
+/*
+** StructuralReader
+**
+** An alternative to GenericReader that parses a complete, in-memory document
+** in two stages:
+**
+**  1. Indexing: the input is scanned (sixteen bytes at a time when SSE2 is
+**     available) for the offsets of all structural characters, strings, and
+**     scalars. String contents and whitespace runs are skipped in blocks.
+**     The exact number of children of each array/object is also recorded.
+**
+**  2. Parsing: the index is walked to drive the handler. Strings without
+**     escape sequences are passed directly from the source, and containers
+**     are announced with their child count, i.e., Handler::StartObject(n) and
+**     Handler::StartArray(n), allowing tables to be presized.
+**
+** The reader implements the kParseStopWhenDoneFlag semantics of GenericReader:
+** only the root value is indexed/parsed and the returned position is the
+** offset just past it. kParseTrailingCommasFlag and kParseNanAndInfFlag are
+** supported; other flags (e.g., comments) are not. Documents nested deeper than
+** LUA_RAPIDJSON_STRUCTURAL_DEPTH fail with kParseErrorTermination before the
+** handler is called (see IsTooDeep).
+*/
+RAPIDJSON_NAMESPACE_BEGIN
+namespace extend {
+  template<typename Allocator = CrtAllocator>
+  class StructuralReader {
+private:
+    static const size_t kEscaped = static_cast<size_t>(1) << (sizeof(size_t) * 8 - 1);  // String end flag: slow path
+    static const size_t kObject = 1;  // Stage one: open container is an object
+
+    internal::Stack<Allocator> index_;  // Stage one: offsets of each token (size_t)
+    internal::Stack<Allocator> counts_;  // Stage one: child count of each container, in order of opening (SizeType)
+    internal::Stack<Allocator> open_;  // Stage one: (slot << 1 | kObject) of each open container (size_t)
+    internal::Stack<Allocator> buffer_;  // Stage two: unescaped strings and number literals
+    ParseResult parseResult_;
+
+    const char *json_;  // Document being parsed
+    size_t length_;  // Length of the document
+    const size_t *tokens_;  // Stage two: token index
+    size_t count_;  // Number of tokens
+    size_t cursor_;  // Next token
+    size_t container_;  // Next container (counts_ slot)
+    size_t end_;  // Offset just past the most recently parsed value
+    size_t too_deep_;  // Stage one: offset of the container exceeding the depth limit; zero otherwise
+
+    RAPIDJSON_FORCEINLINE bool HasParseError() const { return parseResult_.IsError(); }
+    RAPIDJSON_FORCEINLINE void SetParseError(ParseErrorCode code, size_t offset) { parseResult_ = ParseResult(code, offset); }
+
+    static RAPIDJSON_FORCEINLINE bool IsWhitespace(char c) {
+      return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+    }
+
+    static RAPIDJSON_FORCEINLINE bool IsDelimiter(char c) {
+      return IsWhitespace(c) || c == ',' || c == ':' || c == '[' || c == ']' || c == '{' || c == '}' || c == '"';
+    }
+
+    static RAPIDJSON_FORCEINLINE bool IsDigit(char c) {
+      return c >= '0' && c <= '9';
+    }
+
+#if defined(LUA_RAPIDJSON_STRUCTURAL_SSE2)
+    static RAPIDJSON_FORCEINLINE unsigned TrailingZeros(unsigned mask) {
+  #if defined(_MSC_VER)
+      unsigned long offset = 0;
+      _BitScanForward(&offset, mask);
+      return static_cast<unsigned>(offset);
+  #else
+      return static_cast<unsigned>(__builtin_ctz(mask));
+  #endif
+    }
+#endif
+
+    /// <summary>
+    /// Return the offset of the first non-whitespace character at or after "i".
+    /// </summary>
+    size_t SkipWhitespace(size_t i) const {
+#if defined(LUA_RAPIDJSON_STRUCTURAL_SSE2)
+      const __m128i s = _mm_set1_epi8(' '), n = _mm_set1_epi8('\n');
+      const __m128i r = _mm_set1_epi8('\r'), t = _mm_set1_epi8('\t');
+      while (i + 16 <= length_) {
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(json_ + i));
+        __m128i x = _mm_or_si128(_mm_cmpeq_epi8(b, s), _mm_cmpeq_epi8(b, n));
+        x = _mm_or_si128(x, _mm_or_si128(_mm_cmpeq_epi8(b, r), _mm_cmpeq_epi8(b, t)));
+
+        const unsigned mask = static_cast<unsigned>(~_mm_movemask_epi8(x)) & 0xFFFFu;
+        if (mask != 0)
+          return i + TrailingZeros(mask);
+        i += 16;
+      }
+#endif
+      while (i < length_ && IsWhitespace(json_[i]))
+        ++i;
+      return i;
+    }
+
+    /// <summary>
+    /// Return the offset of the quotation mark that terminates the string whose
+    /// contents begin at "i" (length_ if the string is unterminated). "escaped"
+    /// is set if the contents require unescaping or validation.
+    /// </summary>
+    size_t ScanString(size_t i, bool &escaped) const {
+#if defined(LUA_RAPIDJSON_STRUCTURAL_SSE2)
+      const __m128i q = _mm_set1_epi8('"'), bs = _mm_set1_epi8('\\'), ctrl = _mm_set1_epi8(0x1F);
+      while (i + 16 <= length_) {
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(json_ + i));
+        const __m128i c = _mm_cmpeq_epi8(_mm_max_epu8(b, ctrl), ctrl);  // b <= 0x1F
+        const __m128i x = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(b, q), _mm_cmpeq_epi8(b, bs)), c);
+
+        const unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(x));
+        if (mask == 0) {
+          i += 16;
+          continue;
+        }
+
+        i += TrailingZeros(mask);
+        if (json_[i] == '"')
+          return i;
+
+        escaped = true;
+        i += (json_[i] == '\\') ? 2 : 1;
+      }
+#endif
+      while (i < length_) {
+        const char c = json_[i];
+        if (c == '"')
+          return i;
+        else if (c == '\\') {
+          escaped = true;
+          i += 2;
+        }
+        else {
+          if (static_cast<unsigned char>(c) < 0x20)
+            escaped = true;
+          ++i;
+        }
+      }
+      return length_;
+    }
+
+    /// <summary>
+    /// Account for a value within the innermost array, if any.
+    /// </summary>
+    RAPIDJSON_FORCEINLINE void CountValue() {
+      if (!open_.Empty()) {
+        const size_t top = *open_.template Top<size_t>();
+        if (!(top & kObject))
+          counts_.template Bottom<SizeType>()[top >> 1]++;
+      }
+    }
+
+    /// <summary>
+    /// Stage one: index all tokens of the root value.
+    /// </summary>
+    void Index() {
+      bool expect_key = false;
+      size_t i = 0;
+
+      index_.Clear();
+      counts_.Clear();
+      open_.Clear();
+      index_.template Reserve<size_t>(16 + (length_ >> 3));
+      for (;;) {
+        if ((i = SkipWhitespace(i)) >= length_)
+          return;
+
+        const char c = json_[i];
+        switch (c) {
+          case '{':
+          case '[': {
+            CountValue();
+            *index_.template Push<size_t>() = i++;
+            *open_.template Push<size_t>() = (counts_.GetSize() / sizeof(SizeType)) << 1 | (c == '{' ? kObject : 0);
+            *counts_.template Push<SizeType>() = 0;
+            if (RAPIDJSON_UNLIKELY(open_.GetSize() > LUA_RAPIDJSON_STRUCTURAL_DEPTH * sizeof(size_t))) {
+              too_deep_ = i;  // Past the container, so never zero
+              return;
+            }
+            expect_key = (c == '{');
+            break;
+          }
+          case '}':
+          case ']': {
+            *index_.template Push<size_t>() = i++;
+            if (open_.Empty())
+              return;
+
+            open_.template Pop<size_t>(1);
+            expect_key = false;
+            if (open_.Empty())  // Root value completed
+              return;
+            break;
+          }
+          case ',': {
+            *index_.template Push<size_t>() = i++;
+            expect_key = !open_.Empty() && (*open_.template Top<size_t>() & kObject);
+            break;
+          }
+          case ':': {
+            *index_.template Push<size_t>() = i++;
+            expect_key = false;
+            break;
+          }
+          case '"': {
+            if (expect_key)
+              counts_.template Bottom<SizeType>()[*open_.template Top<size_t>() >> 1]++;
+            else
+              CountValue();
+
+            bool escaped = false;
+            const size_t end = ScanString(i + 1, escaped);
+            *index_.template Push<size_t>() = i;
+            *index_.template Push<size_t>() = end | (escaped ? kEscaped : 0);
+            expect_key = false;
+            if (open_.Empty() || end == length_)
+              return;
+            i = end + 1;
+            break;
+          }
+          default: {  // Scalar
+            CountValue();
+            *index_.template Push<size_t>() = i++;
+            while (i < length_ && !IsDelimiter(json_[i]))
+              ++i;
+            if (open_.Empty())
+              return;
+            break;
+          }
+        }
+      }
+    }
+
+    RAPIDJSON_FORCEINLINE bool HasToken() const { return cursor_ < count_; }
+    RAPIDJSON_FORCEINLINE size_t PeekOffset() const { return HasToken() ? tokens_[cursor_] : length_; }
+    RAPIDJSON_FORCEINLINE char PeekChar() const { return HasToken() ? json_[tokens_[cursor_]] : '\0'; }
+
+    template<unsigned parseFlags, typename Handler>
+    void ParseObject(Handler &handler) {
+      const SizeType capacity = counts_.template Bottom<SizeType>()[container_++];
+      cursor_++;  // '{'
+      if (!handler.StartObject(capacity)) {
+        SetParseError(kParseErrorTermination, PeekOffset());
+        return;
+      }
+
+      SizeType memberCount = 0;
+      if (PeekChar() == '}') {
+        end_ = tokens_[cursor_++] + 1;
+        if (!handler.EndObject(memberCount))
+          SetParseError(kParseErrorTermination, end_);
+        return;
+      }
+
+      for (;;) {
+        if (PeekChar() != '"') {
+          SetParseError(kParseErrorObjectMissName, PeekOffset());
+          return;
+        }
+
+        ParseString(handler, true);
+        if (HasParseError())
+          return;
+
+        if (PeekChar() != ':') {
+          SetParseError(kParseErrorObjectMissColon, PeekOffset());
+          return;
+        }
+
+        cursor_++;
+        ParseValue<parseFlags>(handler, kParseErrorObjectMissCommaOrCurlyBracket);
+        if (HasParseError())
+          return;
+
+        ++memberCount;
+        switch (PeekChar()) {
+          case ',':
+            cursor_++;
+            if ((parseFlags & kParseTrailingCommasFlag) && PeekChar() == '}')
+              break;
+            continue;
+          case '}':
+            break;
+          default:
+            SetParseError(kParseErrorObjectMissCommaOrCurlyBracket, PeekOffset());
+            return;
+        }
+
+        end_ = tokens_[cursor_++] + 1;
+        if (!handler.EndObject(memberCount))
+          SetParseError(kParseErrorTermination, end_);
+        return;
+      }
+    }
+
+    template<unsigned parseFlags, typename Handler>
+    void ParseArray(Handler &handler) {
+      const SizeType capacity = counts_.template Bottom<SizeType>()[container_++];
+      cursor_++;  // '['
+      if (!handler.StartArray(capacity)) {
+        SetParseError(kParseErrorTermination, PeekOffset());
+        return;
+      }
+
+      SizeType elementCount = 0;
+      if (PeekChar() == ']') {
+        end_ = tokens_[cursor_++] + 1;
+        if (!handler.EndArray(elementCount))
+          SetParseError(kParseErrorTermination, end_);
+        return;
+      }
+
+      for (;;) {
+        ParseValue<parseFlags>(handler, kParseErrorArrayMissCommaOrSquareBracket);
+        if (HasParseError())
+          return;
+
+        ++elementCount;
+        switch (PeekChar()) {
+          case ',':
+            cursor_++;
+            if ((parseFlags & kParseTrailingCommasFlag) && PeekChar() == ']')
+              break;
+            continue;
+          case ']':
+            break;
+          default:
+            SetParseError(kParseErrorArrayMissCommaOrSquareBracket, PeekOffset());
+            return;
+        }
+
+        end_ = tokens_[cursor_++] + 1;
+        if (!handler.EndArray(elementCount))
+          SetParseError(kParseErrorTermination, end_);
+        return;
+      }
+    }
+
+    /// <summary>
+    /// Append the UTF-8 encoding of "codepoint" to the string buffer.
+    /// </summary>
+    void EncodeUTF8(unsigned codepoint) {
+      if (codepoint <= 0x7F)
+        *buffer_.template Push<char>() = static_cast<char>(codepoint);
+      else if (codepoint <= 0x7FF) {
+        char *p = buffer_.template Push<char>(2);
+        p[0] = static_cast<char>(0xC0 | ((codepoint >> 6) & 0xFF));
+        p[1] = static_cast<char>(0x80 | (codepoint & 0x3F));
+      }
+      else if (codepoint <= 0xFFFF) {
+        char *p = buffer_.template Push<char>(3);
+        p[0] = static_cast<char>(0xE0 | ((codepoint >> 12) & 0xFF));
+        p[1] = static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F));
+        p[2] = static_cast<char>(0x80 | (codepoint & 0x3F));
+      }
+      else {
+        char *p = buffer_.template Push<char>(4);
+        p[0] = static_cast<char>(0xF0 | ((codepoint >> 18) & 0xFF));
+        p[1] = static_cast<char>(0x80 | ((codepoint >> 12) & 0x3F));
+        p[2] = static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F));
+        p[3] = static_cast<char>(0x80 | (codepoint & 0x3F));
+      }
+    }
+
+    /// <summary>
+    /// Parse the four hexadecimal digits at offset "i"; returning false on error.
+    /// </summary>
+    bool ParseHex4(size_t i, size_t end, unsigned &codepoint) const {
+      if (i + 4 > end)
+        return false;
+
+      codepoint = 0;
+      for (size_t j = i; j < i + 4; ++j) {
+        const char c = json_[j];
+        codepoint <<= 4;
+        if (c >= '0' && c <= '9') codepoint |= static_cast<unsigned>(c - '0');
+        else if (c >= 'A' && c <= 'F') codepoint |= static_cast<unsigned>(c - 'A' + 10);
+        else if (c >= 'a' && c <= 'f') codepoint |= static_cast<unsigned>(c - 'a' + 10);
+        else return false;
+      }
+      return true;
+    }
+
+    /// <summary>
+    /// Unescape the string contents within [i, end) into the string buffer.
+    /// </summary>
+    void Unescape(size_t i, size_t end) {
+      static const char escapes[] = {  // Indexed by the character following '\\'
+        '"', '"', '/', '/', '\\', '\\', 'b', '\b', 'f', '\f', 'n', '\n', 'r', '\r', 't', '\t'
+      };
+
+      buffer_.Clear();
+      while (i < end) {
+        const char c = json_[i];
+        if (c != '\\') {
+          if (static_cast<unsigned char>(c) < 0x20) {
+            SetParseError(c == '\0' ? kParseErrorStringMissQuotationMark : kParseErrorStringInvalidEncoding, i);
+            return;
+          }
+
+          *buffer_.template Push<char>() = c;
+          ++i;
+          continue;
+        }
+
+        const char e = (i + 1 < end) ? json_[i + 1] : '\0';
+        if (e == 'u') {
+          unsigned codepoint = 0;
+          if (!ParseHex4(i + 2, end, codepoint)) {
+            SetParseError(kParseErrorStringUnicodeEscapeInvalidHex, i + 2);
+            return;
+          }
+          i += 6;
+
+          if (codepoint >= 0xD800 && codepoint <= 0xDBFF) {  // Surrogate pair
+            unsigned low = 0;
+            if (i + 1 >= end || json_[i] != '\\' || json_[i + 1] != 'u' || !ParseHex4(i + 2, end, low) || low < 0xDC00 || low > 0xDFFF) {
+              SetParseError(kParseErrorStringUnicodeSurrogateInvalid, i);
+              return;
+            }
+
+            codepoint = (((codepoint - 0xD800) << 10) | (low - 0xDC00)) + 0x10000;
+            i += 6;
+          }
+          else if (codepoint >= 0xDC00 && codepoint <= 0xDFFF) {
+            SetParseError(kParseErrorStringUnicodeSurrogateInvalid, i - 6);
+            return;
+          }
+          EncodeUTF8(codepoint);
+          continue;
+        }
+
+        bool valid = false;
+        for (size_t j = 0; j < sizeof(escapes); j += 2) {
+          if (escapes[j] == e) {
+            *buffer_.template Push<char>() = escapes[j + 1];
+            valid = true;
+            break;
+          }
+        }
+
+        if (!valid) {
+          SetParseError(kParseErrorStringEscapeInvalid, i);
+          return;
+        }
+        i += 2;
+      }
+    }
+
+    template<typename Handler>
+    void ParseString(Handler &handler, bool isKey) {
+      const size_t begin = tokens_[cursor_] + 1;
+      const size_t end = tokens_[cursor_ + 1] & ~kEscaped;
+      const bool escaped = (tokens_[cursor_ + 1] & kEscaped) != 0;
+      cursor_ += 2;
+
+      if (end >= length_) {
+        SetParseError(kParseErrorStringMissQuotationMark, length_);
+        return;
+      }
+
+      const char *str = json_ + begin;
+      SizeType length = static_cast<SizeType>(end - begin);
+      if (escaped) {
+        Unescape(begin, end);
+        if (HasParseError())
+          return;
+
+        str = buffer_.template Bottom<char>();
+        length = static_cast<SizeType>(buffer_.GetSize());
+      }
+
+      end_ = end + 1;
+      if (!(isKey ? handler.Key(str, length, false) : handler.String(str, length, false)))
+        SetParseError(kParseErrorTermination, begin - 1);
+    }
+
+    /// <summary>
+    /// Convert a validated number literal that cannot be represented exactly
+    /// with the fast path. The literal is copied so the decimal point can be
+    /// localized (as lua_str2number does).
+    /// </summary>
+    double ParseDoubleSlow(size_t begin, size_t end) {
+      const char point = localeconv()->decimal_point[0];
+
+      buffer_.Clear();
+      char *p = buffer_.template Push<char>(end - begin + 1);
+      for (size_t i = begin; i < end; ++i)
+        p[i - begin] = (json_[i] == '.') ? point : json_[i];
+      p[end - begin] = '\0';
+      return std::strtod(buffer_.template Bottom<char>(), RAPIDJSON_NULLPTR);
+    }
+
+    template<unsigned parseFlags, typename Handler>
+    void ParseNumber(Handler &handler, size_t begin, size_t &i) {
+      static const double pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+      };
+
+      bool minus = false;
+      if (i < length_ && json_[i] == '-') {
+        minus = true;
+        ++i;
+      }
+
+      if ((parseFlags & kParseNanAndInfFlag) && i < length_ && (json_[i] == 'I' || json_[i] == 'N')) {
+        size_t n = 0;
+        double d = 0.0;
+        if (json_[i] == 'N') {  // Signed only, as "NaN" itself is a literal
+          n = (i + 3 <= length_ && std::memcmp(json_ + i, "NaN", 3) == 0) ? 3 : 0;
+          d = std::numeric_limits<double>::quiet_NaN();
+        }
+        else {
+          n = (i + 8 <= length_ && std::memcmp(json_ + i, "Infinity", 8) == 0) ? 8
+            : (i + 3 <= length_ && std::memcmp(json_ + i, "Inf", 3) == 0) ? 3 : 0;
+          d = std::numeric_limits<double>::infinity();
+        }
+        if (n == 0) {
+          SetParseError(kParseErrorValueInvalid, begin);
+          return;
+        }
+
+        i += n;
+        if (!handler.Double(minus ? -d : d))
+          SetParseError(kParseErrorTermination, begin);
+        return;
+      }
+
+      if (i >= length_ || !IsDigit(json_[i])) {
+        SetParseError(kParseErrorValueInvalid, begin);
+        return;
+      }
+
+      uint64_t significand = 0;  // Significant digits (when exact)
+      int digits = 0;  // Number of significant digits
+      int exponent = 0;  // Base 10 exponent of the significand
+      bool integral = true;
+      if (json_[i] == '0')
+        ++i;
+      else {
+        for (; i < length_ && IsDigit(json_[i]); ++i) {
+          if (digits < 19)
+            significand = significand * 10 + static_cast<unsigned>(json_[i] - '0');
+          else
+            exponent++;  // Truncated; "exact" is cleared below.
+          digits++;
+        }
+      }
+
+      bool exact = digits <= 19;
+      if (i < length_ && json_[i] == '.') {
+        integral = false;
+        if (++i >= length_ || !IsDigit(json_[i])) {
+          SetParseError(kParseErrorNumberMissFraction, i);
+          return;
+        }
+
+        for (; i < length_ && IsDigit(json_[i]); ++i) {
+          if (significand == 0 && json_[i] == '0')  // Leading zeros are not significant
+            exponent--;
+          else if (digits < 19) {
+            significand = significand * 10 + static_cast<unsigned>(json_[i] - '0');
+            exponent--;
+            digits++;
+          }
+          else
+            exact = false;
+        }
+      }
+
+      if (i < length_ && (json_[i] == 'e' || json_[i] == 'E')) {
+        integral = false;
+        bool expMinus = false;
+        if (++i < length_ && (json_[i] == '+' || json_[i] == '-'))
+          expMinus = json_[i++] == '-';
+
+        if (i >= length_ || !IsDigit(json_[i])) {
+          SetParseError(kParseErrorNumberMissExponent, i);
+          return;
+        }
+
+        int exp = 0;
+        for (; i < length_ && IsDigit(json_[i]); ++i) {
+          if (exp < 100000)
+            exp = exp * 10 + (json_[i] - '0');
+        }
+        exponent += expMinus ? -exp : exp;
+      }
+
+      bool result = true;
+      if (integral && digits <= 19 && exact) {
+        if (!minus)
+          result = (significand <= 0xFFFFFFFFu) ? handler.Uint(static_cast<unsigned>(significand)) : handler.Uint64(significand);
+        else if (significand <= 0x80000000u)
+          result = handler.Int(static_cast<int>(-static_cast<int64_t>(significand)));
+        else if (significand <= 0x8000000000000000ULL)
+          result = handler.Int64(static_cast<int64_t>(~significand + 1));
+        else
+          result = handler.Double(-static_cast<double>(significand));
+      }
+      else {
+        double d = 0.0;
+        if (significand == 0)
+          d = 0.0;
+        else if (exact && significand <= (static_cast<uint64_t>(1) << 53) && exponent >= -22 && exponent <= 22)
+          d = (exponent < 0) ? (static_cast<double>(significand) / pow10[-exponent]) : (static_cast<double>(significand) * pow10[exponent]);
+        else {
+          d = ParseDoubleSlow(minus ? begin + 1 : begin, i);
+          if (d == std::numeric_limits<double>::infinity()) {
+            SetParseError(kParseErrorNumberTooBig, begin);
+            return;
+          }
+        }
+        result = handler.Double(minus ? -d : d);
+      }
+
+      if (!result)
+        SetParseError(kParseErrorTermination, begin);
+    }
+
+    /// <summary>
+    /// Parse a literal or number. Any characters of the scalar token that were
+    /// not consumed are an error ("trailing") unless the scalar is the root.
+    /// </summary>
+    template<unsigned parseFlags, typename Handler>
+    void ParseScalar(Handler &handler, ParseErrorCode trailing) {
+      const size_t begin = tokens_[cursor_++];
+      size_t i = begin;
+
+      bool result = true;
+      switch (json_[begin]) {
+        case 'n':
+        case 't':
+        case 'f':
+        case 'N': {
+          const char *literal = json_[begin] == 'n' ? "null" : json_[begin] == 't' ? "true" : json_[begin] == 'f' ? "false" : "NaN";
+          const size_t n = std::strlen(literal);
+          if ((json_[begin] == 'N' && !(parseFlags & kParseNanAndInfFlag)) || begin + n > length_ || std::memcmp(json_ + begin, literal, n) != 0) {
+            SetParseError(kParseErrorValueInvalid, begin);
+            return;
+          }
+
+          i += n;
+          switch (json_[begin]) {
+            case 'n': result = handler.Null(); break;
+            case 't': result = handler.Bool(true); break;
+            case 'f': result = handler.Bool(false); break;
+            default: result = handler.Double(std::numeric_limits<double>::quiet_NaN()); break;
+          }
+          if (!result) {
+            SetParseError(kParseErrorTermination, begin);
+            return;
+          }
+          break;
+        }
+        default: {
+          ParseNumber<parseFlags>(handler, begin, i);
+          if (HasParseError())
+            return;
+          break;
+        }
+      }
+
+      end_ = i;
+      if (trailing != kParseErrorNone && i < length_ && !IsDelimiter(json_[i]))
+        SetParseError(trailing, i);
+    }
+
+    template<unsigned parseFlags, typename Handler>
+    void ParseValue(Handler &handler, ParseErrorCode trailing) {
+      switch (PeekChar()) {
+        case '{': ParseObject<parseFlags>(handler); break;
+        case '[': ParseArray<parseFlags>(handler); break;
+        case '"': ParseString(handler, false); break;
+        case '\0':
+        case ',':
+        case ':':
+        case ']':
+        case '}':
+          SetParseError(kParseErrorValueInvalid, PeekOffset());
+          break;
+        default:
+          ParseScalar<parseFlags>(handler, trailing);
+          break;
+      }
+    }
+
+public:
+    StructuralReader(Allocator *allocator = RAPIDJSON_NULLPTR)
+      : index_(allocator, 0), counts_(allocator, 0), open_(allocator, 0), buffer_(allocator, 0), parseResult_(),
+        json_(RAPIDJSON_NULLPTR), length_(0), tokens_(RAPIDJSON_NULLPTR), count_(0), cursor_(0), container_(0), end_(0), too_deep_(0) {
+    }
+
+    /// <summary>
+    /// Return true if the last Parse failed as the document is nested deeper
+    /// than LUA_RAPIDJSON_STRUCTURAL_DEPTH; the handler was not called.
+    /// </summary>
+    bool IsTooDeep() const { return too_deep_ != 0; }
+
+    /// <summary>
+    /// Parse the root value of "json"; "position" is set to the offset just
+    /// past it (see kParseStopWhenDoneFlag).
+    /// </summary>
+    template<unsigned parseFlags, typename Handler>
+    ParseResult Parse(const char *json, size_t length, Handler &handler, size_t &position) {
+      parseResult_ = ParseResult();
+      json_ = json;
+      length_ = length;
+      end_ = too_deep_ = 0;
+
+      Index();  // Stage one
+      tokens_ = index_.template Bottom<size_t>();
+      count_ = index_.GetSize() / sizeof(size_t);
+      cursor_ = container_ = 0;
+      if (too_deep_ != 0)
+        SetParseError(kParseErrorTermination, too_deep_ - 1);
+      else if (count_ == 0)
+        SetParseError(kParseErrorDocumentEmpty, length_);
+      else
+        ParseValue<parseFlags>(handler, kParseErrorNone);  // Stage two
+
+      position = HasParseError() ? parseResult_.Offset() : end_;
+      return parseResult_;
+    }
+  };
+}
+RAPIDJSON_NAMESPACE_END
+
+#endif
@@ -0,0 +1,244 @@
+/*
+** $Id: ZlibStream.hpp $
+** zlib (gzip/deflate) stream adapters.
+** See Copyright Notice in lua_rapidjsonlib.h
+*/
+#ifndef __ZLIBSTREAM_HPP__
+#define __ZLIBSTREAM_HPP__
+#if defined(LUA_RAPIDJSON_ZLIB)
+
+#include <climits>
+#include <cstdio>
+#include <zlib.h>
+
+#include <rapidjson/rapidjson.h>
+#include <rapidjson/stream.h>
+
+/* Size of the compressed and decompressed chunks buffered by each stream */
+#if !defined(LUA_RAPIDJSON_ZLIB_CHUNK)
+  #define LUA_RAPIDJSON_ZLIB_CHUNK (1 << 14)
+#endif
+
+RAPIDJSON_NAMESPACE_BEGIN
+namespace extend {
+  /// <summary>
+  /// Return true if the contents begin with a gzip header or a zlib header of
+  /// the default (32K) window size. Neither can begin a valid JSON document:
+  /// 0x1F is a control character and 0x78 is 'x'. Other zlib window sizes are
+  /// not detected, as their headers may be digits, e.g., "80".
+  /// </summary>
+  static inline bool IsCompressed(const char *src, size_t len) {
+    if (len < 2)
+      return false;
+
+    const unsigned char b0 = static_cast<unsigned char>(src[0]);
+    const unsigned char b1 = static_cast<unsigned char>(src[1]);
+    if (b0 == 0x1F && b1 == 0x8B)  // gzip
+      return true;
+    return b0 == 0x78 && ((b0 << 8) | b1) % 31 == 0;  // zlib
+  }
+
+  /// <summary>
+  /// Read-only input stream that inflates gzip or zlib compressed contents,
+  /// from memory or a file, one LUA_RAPIDJSON_ZLIB_CHUNK at a time.
+  /// </summary>
+  class InflateStream {
+  public:
+    typedef char Ch;
+
+    InflateStream(const char *src, size_t len)
+      : file_(RAPIDJSON_NULLPTR), src_(src), src_len_(len), current_(out_), last_(out_), count_(0), status_(Z_OK) {
+      Initialize();
+      Read();
+    }
+
+    InflateStream(std::FILE *file)
+      : file_(file), src_(RAPIDJSON_NULLPTR), src_len_(0), current_(out_), last_(out_), count_(0), status_(Z_OK) {
+      Initialize();
+      Read();
+    }
+
+    ~InflateStream() {
+      inflateEnd(&stream_);
+    }
+
+    Ch Peek() const { return (current_ < last_) ? *current_ : '\0'; }
+    Ch Take() {
+      if (current_ >= last_)
+        return '\0';
+
+      const Ch c = *current_++;
+      if (current_ == last_)
+        Read();
+      return c;
+    }
+    size_t Tell() const { return count_ + static_cast<size_t>(current_ - out_); }
+
+    /// <summary>
+    /// Return true if the compressed data is malformed, truncated, or could not
+    /// be read; the stream then ends prematurely.
+    /// </summary>
+    bool HasError() const { return status_ != Z_OK && status_ != Z_STREAM_END; }
+
+    Ch *PutBegin() { RAPIDJSON_ASSERT(false); return 0; }
+    void Put(Ch) { RAPIDJSON_ASSERT(false); }
+    void Flush() { RAPIDJSON_ASSERT(false); }
+    size_t PutEnd(Ch *) { RAPIDJSON_ASSERT(false); return 0; }
+
+  private:
+    void Initialize() {
+      stream_.zalloc = Z_NULL;
+      stream_.zfree = Z_NULL;
+      stream_.opaque = Z_NULL;
+      stream_.next_in = Z_NULL;
+      stream_.avail_in = 0;
+      if ((status_ = inflateInit2(&stream_, 15 + 32)) != Z_OK)  // Detect gzip or zlib headers
+        status_ = Z_MEM_ERROR;
+    }
+
+    /// <summary>
+    /// Inflate the next chunk; an empty chunk denotes the end of the stream.
+    /// </summary>
+    void Read() {
+      count_ += static_cast<size_t>(last_ - out_);
+      current_ = last_ = out_;
+      while (status_ == Z_OK && last_ == out_) {
+        if (stream_.avail_in == 0 && src_len_ > 0) {
+          const size_t len = (src_len_ > UINT_MAX) ? UINT_MAX : src_len_;  // avail_in is a uInt
+          stream_.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(src_));
+          stream_.avail_in = static_cast<uInt>(len);
+          src_ += len;
+          src_len_ -= len;
+        }
+        else if (stream_.avail_in == 0 && file_ != RAPIDJSON_NULLPTR) {
+          stream_.next_in = reinterpret_cast<Bytef *>(in_);
+          stream_.avail_in = static_cast<uInt>(std::fread(in_, 1, sizeof(in_), file_));
+          if (stream_.avail_in == 0 && std::ferror(file_)) {
+            status_ = Z_ERRNO;
+            break;
+          }
+        }
+
+        const bool eof = stream_.avail_in == 0;
+        stream_.next_out = reinterpret_cast<Bytef *>(out_);
+        stream_.avail_out = static_cast<uInt>(sizeof(out_));
+        const int status = inflate(&stream_, Z_NO_FLUSH);
+        last_ = out_ + (sizeof(out_) - stream_.avail_out);
+        if (status != Z_BUF_ERROR)
+          status_ = status;
+        else if (eof && last_ == out_)
+          status_ = Z_BUF_ERROR;  // Truncated
+      }
+    }
+
+    std::FILE *file_;  // Compressed file; NULL when inflating from memory
+    const char *src_;  // Compressed contents not yet passed to inflate
+    size_t src_len_;
+    z_stream stream_;
+    Ch *current_;
+    Ch *last_;
+    size_t count_;  // Number of characters before out_
+    int status_;
+    Ch out_[LUA_RAPIDJSON_ZLIB_CHUNK];
+    Ch in_[LUA_RAPIDJSON_ZLIB_CHUNK];
+  };
+
+  /// <summary>
+  /// Output stream that compresses into gzip (or zlib) format, passing each
+  /// compressed LUA_RAPIDJSON_ZLIB_CHUNK to "sink(const char *, size_t)".
+  /// </summary>
+  template<typename Sink>
+  class DeflateStream {
+  public:
+    typedef char Ch;
+
+    DeflateStream(Sink &sink, bool gzip = true, int level = Z_DEFAULT_COMPRESSION)
+      : sink_(sink), current_(in_), status_(Z_OK) {
+      stream_.zalloc = Z_NULL;
+      stream_.zfree = Z_NULL;
+      stream_.opaque = Z_NULL;
+      if (deflateInit2(&stream_, level, Z_DEFLATED, gzip ? (15 + 16) : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        status_ = Z_MEM_ERROR;
+    }
+
+    ~DeflateStream() {
+      if (status_ != Z_MEM_ERROR)
+        deflateEnd(&stream_);
+    }
+
+    void Put(Ch c) {
+      if (current_ == in_ + sizeof(in_))
+        Compress(Z_NO_FLUSH);
+      *current_++ = c;
+    }
+
+    /// <summary>
+    /// Compress a contiguous block; equivalent to calling Put for each character.
+    /// </summary>
+    void Write(const Ch *src, size_t len) {
+      Compress(Z_NO_FLUSH);
+      while (len > 0 && status_ == Z_OK) {
+        const size_t n = (len > UINT_MAX) ? UINT_MAX : len;  // avail_in is a uInt
+        stream_.next_in = reinterpret_cast<Bytef *>(const_cast<Ch *>(src));
+        stream_.avail_in = static_cast<uInt>(n);
+        Deflate(Z_NO_FLUSH);
+        src += n;
+        len -= n;
+      }
+    }
+
+    void Flush() { }  // Compressed chunks are emitted when full.
+
+    /// <summary>
+    /// Write all pending data and the stream trailer; returning false on error.
+    /// </summary>
+    bool Finish() {
+      Compress(Z_FINISH);
+      return status_ == Z_STREAM_END;
+    }
+
+    Ch Peek() const { RAPIDJSON_ASSERT(false); return 0; }
+    Ch Take() { RAPIDJSON_ASSERT(false); return 0; }
+    size_t Tell() const { RAPIDJSON_ASSERT(false); return 0; }
+    Ch *PutBegin() { RAPIDJSON_ASSERT(false); return 0; }
+    size_t PutEnd(Ch *) { RAPIDJSON_ASSERT(false); return 0; }
+
+  private:
+    void Compress(int flush) {
+      stream_.next_in = reinterpret_cast<Bytef *>(in_);
+      stream_.avail_in = static_cast<uInt>(current_ - in_);
+      current_ = in_;
+      Deflate(flush);
+    }
+
+    void Deflate(int flush) {
+      while (status_ == Z_OK) {
+        stream_.next_out = reinterpret_cast<Bytef *>(out_);
+        stream_.avail_out = static_cast<uInt>(sizeof(out_));
+
+        const int status = deflate(&stream_, flush);
+        if (status == Z_STREAM_ERROR)
+          status_ = status;
+        else if (status == Z_STREAM_END)
+          status_ = Z_STREAM_END;
+
+        const size_t len = sizeof(out_) - stream_.avail_out;
+        if (len > 0)
+          sink_(out_, len);
+        if (stream_.avail_out != 0 && stream_.avail_in == 0 && flush != Z_FINISH)
+          break;
+      }
+    }
+
+    Sink &sink_;
+    z_stream stream_;
+    Ch *current_;
+    int status_;
+    Ch in_[LUA_RAPIDJSON_ZLIB_CHUNK];
+    Ch out_[LUA_RAPIDJSON_ZLIB_CHUNK];
+  };
+}
+RAPIDJSON_NAMESPACE_END
+
+#endif
+#endif
@@ -8,12 +8,17 @@
 
 #include <vector>
 #include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
 
 #include <rapidjson/internal/stack.h>
 #include <rapidjson/rapidjson.h>
 #include <rapidjson/encodedstream.h>
 #include <rapidjson/error/en.h>
 #include <rapidjson/error/error.h>
+#include <rapidjson/filereadstream.h>
+#include <rapidjson/filewritestream.h>
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
 #include <rapidjson/prettywriter.h>
@@ -21,7 +26,10 @@
 #include <rapidjson/reader.h>
 
 #include "lua_rapidjson.hpp"
+#include "StringEscape.hpp"
 #include "StringStream.hpp"
+#include "StructuralReader.hpp"
+#include "ZlibStream.hpp"
 
 #include "lua_rapidjsonlib.h"
 
@@ -29,6 +37,9 @@
 #define LUA_RAPIDJSON_REG "lua_rapidjson"
 #define LUA_RAPIDJSON_ENCODER LUA_RAPIDJSON_REG "_encoder"
 #define LUA_RAPIDJSON_DECODER LUA_RAPIDJSON_REG "_decoder"
+#define LUA_RAPIDJSON_QUERY LUA_RAPIDJSON_REG "_query"
+#define LUA_RAPIDJSON_CACHE LUA_RAPIDJSON_REG "_cache"
+#define LUA_RAPIDJSON_OUTPUT LUA_RAPIDJSON_REG "_output"
 
 /*
 ** If LUA_COMPILED_AS_HPP is enabled (... and LUA_USE_LONGJMP_HPP is not), it is
@@ -53,6 +64,12 @@ typedef lua_Integer json_regType;  // Registry Table KeyType
 #define LUA_RAPIDJSON_REG_INDENT_AMT 4
 #define LUA_RAPIDJSON_REG_MAXDEC 5
 #define LUA_RAPIDJSON_REG_PRESET 6
+#define LUA_RAPIDJSON_REG_COLUMNAR 7
+#define LUA_RAPIDJSON_REG_CACHE_ENTRIES 8
+#define LUA_RAPIDJSON_REG_CACHE_BYTES 9
+#define LUA_RAPIDJSON_REG_FIXED 10
+#define LUA_RAPIDJSON_REG_CONFIG 11  // JsonConfig snapshot of the above
+#define LUA_RAPIDJSON_REG_OUTPUT 12  // EncoderOutput
 
 #define json_conf_getfield(L, I, K) lua_rawgeti((L), (I), (K))
 #define json_conf_setfield(L, I, K) lua_rawseti((L), (I), (K))
@@ -65,7 +82,7 @@ static int lua_rapidjson_getsubtable (lua_State *L, int idx, const char *key) {
   else {
     lua_pop(L, 1);  // remove previous result
     idx = lua_absindex(L, idx);
-    lua_createtable(L, LUA_RAPIDJSON_REG_PRESET + 1, 0);
+    lua_createtable(L, LUA_RAPIDJSON_REG_OUTPUT + 1, 0);
     lua_pushvalue(L, -1);  // copy to be left at top
     lua_setfield(L, idx, key);  // assign new table to field
     return 0;  // false, because did not find table there
@@ -116,6 +133,32 @@ static int luaL_optcheckoption (lua_State *L, int arg, const char *def, const ch
   return ldef;
 }
 
+/*
+** Return the file of a file name (opened with "mode", "owns_file" set) or an
+** open file handle at the given index; raising an error otherwise.
+*/
+static std::FILE *json_checkfile (lua_State *L, int idx, const char *mode, bool &owns_file) {
+  std::FILE *file = RAPIDJSON_NULLPTR;
+  owns_file = false;
+  if (lua_type(L, idx) == LUA_TSTRING) {
+    const char *filename = lua_tostring(L, idx);
+    if ((file = std::fopen(filename, mode)) == RAPIDJSON_NULLPTR)
+      luaL_error(L, "cannot open %s: %s", filename, std::strerror(errno));
+    owns_file = true;
+  }
+  else {
+#if LUA_VERSION_NUM == 501
+    file = *reinterpret_cast<std::FILE **>(luaL_checkudata(L, idx, LUA_FILEHANDLE));
+#else
+    luaL_Stream *stream = reinterpret_cast<luaL_Stream *>(luaL_checkudata(L, idx, LUA_FILEHANDLE));
+    file = (stream->closef == RAPIDJSON_NULLPTR) ? RAPIDJSON_NULLPTR : stream->f;
+#endif
+    if (file == RAPIDJSON_NULLPTR)
+      luaL_error(L, "attempt to use a closed file");
+  }
+  return file;
+}
+
 /*
 ** {==================================================================
 ** API Functions
@@ -149,7 +192,7 @@ bool has_json_type (lua_State *L, int idx, bool *is_array) {
   return result;
 }
 
-bool table_is_json_array (lua_State *L, int idx, lua_Integer flags, size_t *array_length) {
+bool table_is_json_array (lua_State *L, int idx, lua_Integer flags, size_t *array_length, int jsontype) {
   const int stacktop = lua_gettop(L);
   const int i_idx = json_rel_index(idx, 1);
 
@@ -161,7 +204,45 @@ bool table_is_json_array (lua_State *L, int idx, lua_Integer flags, size_t *arra
   size_t arraylen = 0;  // Supplied table.pack 'n' value
 
   json_checkstack(L, 3);
-  has_type = has_json_type(L, idx, &is_array);
+  if (jsontype == JSON_META_UNKNOWN)
+    has_type = has_json_type(L, idx, &is_array);
+  else {
+    has_type = (jsontype & JSON_META_TYPE) != 0;
+    is_array = (jsontype & JSON_META_ARRAY) != 0;
+  }
+
+#if LUA_VERSION_NUM >= 502
+  const lua_Integer border = static_cast<lua_Integer>(lua_rawlen(L, idx));
+#else
+  const lua_Integer border = static_cast<lua_Integer>(lua_objlen(L, idx));
+#endif
+
+  /* JSON_TRUST_JSONTYPE: a decoded (or json.array/json.object) table keeps its classification */
+  if (has_type && (flags & JSON_TRUST_JSONTYPE)) {
+    *array_length = is_array ? static_cast<size_t>(border) : 0;
+    return is_array;
+  }
+
+#if !defined(LUA_RAPIDJSON_COMPAT)
+  /*
+  ** Border probe: the key that follows "border" in traversal order, e.g., the
+  ** first string key of a mixed table (stored after its array part), rejects
+  ** the table without first traversing every array element if it is not a
+  ** positive integer; or, without JSON_ARRAY_WITH_HOLES, if it exceeds the
+  ** border (t[border + 1] is nil: a hole). A sequence still requires the full
+  ** scan: holes and keys stored before "border" cannot be ruled out otherwise.
+  */
+  if (border > 0) {
+    lua_pushinteger(L, border);  // [..., border]
+    if (lua_next(L, i_idx)) {  // [..., key, value]
+      lua_Integer n = 0;
+      const bool integer = json_isinteger(L, -2) && (n = lua_tointeger(L, -2), (n >= 1 && static_cast<size_t>(n) <= JSON_MAX_LUAINDEX));
+      lua_settop(L, stacktop);
+      if (!integer || (n > border && !(flags & JSON_ARRAY_WITH_HOLES)))
+        return false;
+    }
+  }
+#endif
 
   lua_pushnil(L);  // [..., key]
   while (lua_next(L, i_idx)) {  // [..., key, value]
@@ -230,6 +311,18 @@ bool table_is_json_array (lua_State *L, int idx, lua_Integer flags, size_t *arra
 */
 #define JSON_DECODE_EXTENDED 0x1
 
+/*
+** kParseDefaultFlags + kParseTrailingCommasFlag + kParseNanAndInfFlag, parsed
+** by extend::StructuralReader: the document is indexed before it is decoded
+** and tables are presized to their element counts.
+*/
+#define JSON_DECODE_STRUCTURAL 0x2
+
+/* Encoder output compression formats (see LUA_RAPIDJSON_STATE_COMPRESS) */
+#define JSON_COMPRESS_NONE 0
+#define JSON_COMPRESS_GZIP 1
+#define JSON_COMPRESS_ZLIB 2
+
 /* PrettyWriter indentation characters */
 static const char pretty_indent[] = { ' ', '\t', '\n', '\r' };
 
@@ -249,13 +342,25 @@ static const char *const option_keys[] = {
   "single_line",
   "empty_table_as_array",
   "with_hole",
+  "trust_jsontype",
+  "typed_arrays",
+  "columnar",
+  "hash_cons",
+  "dedup_strings",
+  "preserve_order",
+  "parse_cache",
+  "parse_cache_bytes",
   "decoder_preset",
   "max_depth",
   "indent_char",
   "indent_count", "level",  /* state.level in dkjson */
   "decimal_count",
+  "fixed_decimals",
   LUA_RAPIDJSON_STATE_KEYORDER,
   LUA_RAPIDJSON_STATE_EXCEPTION,
+  LUA_RAPIDJSON_STATE_COMPRESS,
+  LUA_RAPIDJSON_STATE_CHUNK,
+  LUA_RAPIDJSON_STATE_THREADS,
   RAPIDJSON_NULLPTR
 };
 
@@ -275,26 +380,107 @@ static const lua_Integer option_keys_num[] = {
   JSON_ARRAY_SINGLE_LINE,
   JSON_ARRAY_EMPTY,
   JSON_ARRAY_WITH_HOLES,
+  JSON_TRUST_JSONTYPE,
+  JSON_TYPED_ARRAYS,
+  JSON_COLUMNAR,
+  JSON_HASH_CONS,
+  JSON_DEDUP_STRINGS,
+  JSON_PRESERVE_ORDER,
+  JSON_DECODER_CACHE,
+  JSON_DECODER_CACHE_BYTES,
   JSON_DECODER_PRESET,
   JSON_ENCODER_MAX_DEPTH,
   JSON_ENCODER_INDENT,
   JSON_ENCODER_INDENT_AMT, JSON_ENCODER_INDENT_AMT,
   JSON_ENCODER_DECIMALS,
+  JSON_ENCODER_FIXED,
   JSON_TABLE_KEY_ORDER,
   JSON_ENCODER_HANDLER,
+  JSON_ENCODER_COMPRESS,
+  JSON_ENCODER_CHUNK,
+  JSON_ENCODER_THREADS,
 };
 
 /* Decoder PrettyWriter/Writer preset configurations */
 static const char *const decode_presets[] = {
-  "default", "extended", RAPIDJSON_NULLPTR
+  "default", "extended", "structural", RAPIDJSON_NULLPTR
 };
 
 /* decode_presets -> integer codes */
 static const lua_Integer decode_presets_num[] = {
   JSON_DECODE_DEFAULT,
   JSON_DECODE_EXTENDED,
+  JSON_DECODE_STRUCTURAL,
+};
+
+/// <summary>
+/// Snapshot of the numeric options of the registry subtable. The snapshot is
+/// an upvalue of json.encode/json.decode, refreshed by json.setoption, so each
+/// call reads its configuration without any registry or table lookups.
+/// </summary>
+struct JsonConfig {
+  lua_Integer flags;
+  lua_Integer parsemode;
+  lua_Integer indent;
+  lua_Integer indent_amt;
+  lua_Integer depth;
+  lua_Integer decimals;
+  lua_Integer fixed;
+  lua_Integer cache_entries;
+  lua_Integer cache_bytes;
+
+  /// <summary>
+  /// Read the configuration from the registry subtable at the given index.
+  /// </summary>
+  void Read(lua_State *L, int idx) {
+    flags = geti(L, idx, LUA_RAPIDJSON_REG_FLAGS, JSON_DEFAULT);
+    parsemode = geti(L, idx, LUA_RAPIDJSON_REG_PRESET, JSON_DECODE_DEFAULT);
+    indent = geti(L, idx, LUA_RAPIDJSON_REG_INDENT, 0);
+    indent_amt = geti(L, idx, LUA_RAPIDJSON_REG_INDENT_AMT, (indent == 0) ? 4 : 0);
+    depth = geti(L, idx, LUA_RAPIDJSON_REG_DEPTH, LUA_RAPIDJSON_DEFAULT_DEPTH);
+    decimals = geti(L, idx, LUA_RAPIDJSON_REG_MAXDEC, LUA_NUMBER_FMT_LEN);
+    fixed = geti(L, idx, LUA_RAPIDJSON_REG_FIXED, 0);
+    cache_entries = geti(L, idx, LUA_RAPIDJSON_REG_CACHE_ENTRIES, 0);
+    cache_bytes = geti(L, idx, LUA_RAPIDJSON_REG_CACHE_BYTES, LUA_RAPIDJSON_CACHE_BYTES);
+  }
 };
 
+/*
+** Push the configuration snapshot stored in the registry subtable; creating it
+** if it does not exist (e.g., once per lua_State).
+*/
+static JsonConfig *json_pushconfig (lua_State *L) {
+  lua_rapidjson_getsubtable(L, LUA_REGISTRYINDEX, LUA_RAPIDJSON_REG);  // [..., reg]
+  json_conf_getfield(L, -1, LUA_RAPIDJSON_REG_CONFIG);  // [..., reg, config]
+
+  JsonConfig *config = reinterpret_cast<JsonConfig *>(lua_touserdata(L, -1));
+  if (config == RAPIDJSON_NULLPTR) {
+    lua_pop(L, 1);  // [..., reg]
+    config = reinterpret_cast<JsonConfig *>(json_newuserdata(L, sizeof(JsonConfig)));  // [..., reg, config]
+    config->Read(L, -2);
+    lua_pushvalue(L, -1);  // [..., reg, config, config]
+    json_conf_setfield(L, -3, LUA_RAPIDJSON_REG_CONFIG);  // [..., reg, config]
+  }
+  lua_remove(L, -2);  // [..., config]
+  return config;
+}
+
+/*
+** Return the configuration snapshot of the running json.encode/json.decode
+** closure. Functions called without the upvalue (e.g., directly through the C
+** API) read the registry into "local".
+*/
+static RAPIDJSON_FORCEINLINE const JsonConfig &json_getconfig (lua_State *L, JsonConfig &local) {
+  const JsonConfig *config = reinterpret_cast<const JsonConfig *>(lua_touserdata(L, lua_upvalueindex(1)));
+  if (config == RAPIDJSON_NULLPTR) {
+    lua_rapidjson_getsubtable(L, LUA_REGISTRYINDEX, LUA_RAPIDJSON_REG);
+    local.Read(L, -1);
+    lua_pop(L, 1);
+    config = &local;
+  }
+  return *config;
+}
+
 static inline void create_shared_meta (lua_State *L, const char *meta, const char *type) {
   luaL_newmetatable(L, meta);
   lua_pushstring(L, type);
@@ -323,25 +509,133 @@ static int make_table_type (lua_State *L, int idx, const char *meta, const char
   return 1;
 }
 
+/// <summary>
+/// Output buffer shared by the json.encode calls of a lua_State (an upvalue of
+/// json.encode) so its capacity is reused: in steady state an encoding needs
+/// no reallocations. Capacity is reserved from a moving average of recent
+/// output sizes and released once it greatly exceeds that average, e.g., after
+/// a single large output. Nested calls (e.g., json.encode within __tojson) use
+/// a buffer of their own while it is busy. The cache of encoded object keys is
+/// likewise shared by json.encode, json.dump and json.encode_to.
+/// </summary>
+struct EncoderOutput {
+  using Buffer = GenericStringBuffer<UTF8<>, RAPIDJSON_ALLOCATOR>;
+
+  RAPIDJSON_ALLOCATOR allocator;
+  Buffer buffer;
+  size_t average;  // Moving average of recent output sizes
+  bool busy;  // Buffer is being written by an active encoder
+  LuaSAX::KeyCache keys;  // Encoded object keys, shared by the encoder using the buffer
+
+  EncoderOutput(const RAPIDJSON_ALLOCATOR &_allocator)
+    : allocator(_allocator), buffer(&allocator, 0), average(0), busy(false) {
+  }
+
+  /// <summary>
+  /// Return the cleared buffer reserved for an output of the expected size, or
+  /// NULL if the buffer is in use.
+  /// </summary>
+  Buffer *Acquire() {
+    if (busy)
+      return RAPIDJSON_NULLPTR;
+
+    busy = true;
+    buffer.Clear();
+    buffer.Reserve(average + (average >> 2));
+    return &buffer;
+  }
+
+  /// <summary>
+  /// Account for an output of "size" bytes.
+  /// </summary>
+  void Update(size_t size) {
+    average = (average == 0) ? size : (average - (average >> 3) + (size >> 3));
+  }
+
+  /// <summary>
+  /// Return the buffer, releasing its capacity if it greatly exceeds the moving
+  /// average, rather than holding it until the next json.encode call.
+  /// </summary>
+  void Release() {
+    busy = false;
+    buffer.Clear();
+
+    const size_t capacity = buffer.stack_.GetCapacity();
+    if (capacity > LUA_RAPIDJSON_OUTPUT_MIN && (capacity / LUA_RAPIDJSON_OUTPUT_SLACK) > average)
+      buffer.stack_.ShrinkToFit();  // Release idle capacity
+  }
+
+  static int __gc(lua_State *L) {
+    EncoderOutput *output = reinterpret_cast<EncoderOutput *>(luaL_checkudata(L, 1, LUA_RAPIDJSON_OUTPUT));
+    output->~EncoderOutput();
+    return 0;
+  }
+};
+
+/*
+** Escape strings written to GenericStringBuffer outputs with the kernels of
+** StringEscape.hpp. Writer<StringBuffer> (the default allocator and flags) is
+** specialized by rapidjson itself when built with SSE2, SSE4.2, or NEON.
+*/
+#define LUA_RAPIDJSON_ESCAPED_WRITER(OS, SA, F)                                                  \
+  template<>                                                                                     \
+  inline bool Writer<OS, LUA_RAPIDJSON_SOURCE, LUA_RAPIDJSON_TARGET, SA, F>::ScanWriteUnescapedString( \
+    GenericStringStream<LUA_RAPIDJSON_SOURCE> &is, size_t length) {                              \
+    return extend::ScanWriteEscaped(*os_, is, length, ((F) & kWriteValidateEncodingFlag) != 0);   \
+  }
+
+RAPIDJSON_NAMESPACE_BEGIN
+LUA_RAPIDJSON_ESCAPED_WRITER(EncoderOutput::Buffer, RAPIDJSON_ALLOCATOR, kWriteDefaultFlags | kWriteNanAndInfFlag)
+#if defined(LUA_RAPIDJSON_ALLOCATOR)
+LUA_RAPIDJSON_ESCAPED_WRITER(EncoderOutput::Buffer, RAPIDJSON_ALLOCATOR, kWriteDefaultFlags)
+LUA_RAPIDJSON_ESCAPED_WRITER(GenericStringBuffer<LUA_RAPIDJSON_TARGET>, CrtAllocator, kWriteNanAndInfFlag)  // LuaSAX memo
+#endif
+#if !defined(RAPIDJSON_SSE2) && !defined(RAPIDJSON_SSE42) && !defined(RAPIDJSON_NEON)
+LUA_RAPIDJSON_ESCAPED_WRITER(StringBuffer, CrtAllocator, kWriteDefaultFlags)
+#endif
+RAPIDJSON_NAMESPACE_END
+
+/*
+** Push the EncoderOutput stored in the registry subtable; creating it if it
+** does not exist.
+*/
+static void json_pushoutput (lua_State *L) {
+  lua_rapidjson_getsubtable(L, LUA_REGISTRYINDEX, LUA_RAPIDJSON_REG);  // [..., reg]
+  json_conf_getfield(L, -1, LUA_RAPIDJSON_REG_OUTPUT);  // [..., reg, output]
+  if (lua_touserdata(L, -1) == RAPIDJSON_NULLPTR) {
+    lua_pop(L, 1);  // [..., reg]
+
+    RAPIDJSON_ALLOCATOR_INIT(L, _allocator);
+    void *output = json_newuserdata(L, sizeof(EncoderOutput));  // [..., reg, output]
+    ::new(output) EncoderOutput(_allocator);
+    luaL_getmetatable(L, LUA_RAPIDJSON_OUTPUT);  // [..., reg, output, metatable]
+    lua_setmetatable(L, -2);  // [..., reg, output]
+
+    lua_pushvalue(L, -1);  // [..., reg, output, output]
+    json_conf_setfield(L, -3, LUA_RAPIDJSON_REG_OUTPUT);  // [..., reg, output]
+  }
+  lua_remove(L, -2);  // [..., output]
+}
+
 /// <summary>
 /// Helper for anchoring a rapidjson::Writer (via userdata) on the Lua stack.
 /// Ensuring all intermediate data allocated by rapidjson can be deallocated on
 /// error.
 /// </summary>
 struct EncoderData {
-  using Buffer = GenericStringBuffer<UTF8<>, RAPIDJSON_ALLOCATOR>;
+  using Buffer = EncoderOutput::Buffer;
 
-  template<unsigned writeFlags = kWriteDefaultFlags>
-  using Basic = Writer<Buffer, LUA_RAPIDJSON_SOURCE, LUA_RAPIDJSON_TARGET, RAPIDJSON_ALLOCATOR, writeFlags>;
+  template<unsigned writeFlags = kWriteDefaultFlags, typename OS = Buffer>
+  using Basic = Writer<OS, LUA_RAPIDJSON_SOURCE, LUA_RAPIDJSON_TARGET, RAPIDJSON_ALLOCATOR, writeFlags>;
 
-  template<unsigned writeFlags = kWriteDefaultFlags>
-  using Pretty = PrettyWriter<Buffer, LUA_RAPIDJSON_SOURCE, LUA_RAPIDJSON_TARGET, RAPIDJSON_ALLOCATOR, writeFlags>;
+  template<unsigned writeFlags = kWriteDefaultFlags, typename OS = Buffer>
+  using Pretty = PrettyWriter<OS, LUA_RAPIDJSON_SOURCE, LUA_RAPIDJSON_TARGET, RAPIDJSON_ALLOCATOR, writeFlags>;
 
-  template<unsigned writeFlags = kWriteDefaultFlags>
-  using BasicInf = Basic<writeFlags | kWriteNanAndInfFlag>;
+  template<unsigned writeFlags = kWriteDefaultFlags, typename OS = Buffer>
+  using BasicInf = Basic<writeFlags | kWriteNanAndInfFlag, OS>;
 
-  template<unsigned writeFlags = kWriteDefaultFlags>
-  using PrettyInf = Pretty<writeFlags | kWriteNanAndInfFlag>;
+  template<unsigned writeFlags = kWriteDefaultFlags, typename OS = Buffer>
+  using PrettyInf = Pretty<writeFlags | kWriteNanAndInfFlag, OS>;
 
   bool init;  // Has been constructed in-place
   lua_Integer flags;  // Encoding flags
@@ -350,15 +644,29 @@ struct EncoderData {
   lua_Integer parsemode;  // Parsing PrettyWriter/Writer mode (preset configuration)
   int depth;  // Maximum nested-table/recursive depth
   int decimals;  // Writer::kDefaultMaxDecimalPlaces;
+  int fixed;  // Fixed number of decimal places for doubles; zero otherwise
+  int compress;  // Output compression format
+  size_t chunk;  // json.encode_to: bytes passed to each sink call
+  unsigned threads;  // json.encode: threads writing the output
+  std::FILE *file;  // json.dump: file being written
+  bool owns_file;  // json.dump: file is closed on cleanup
 
   RAPIDJSON_ALLOCATOR *allocator = RAPIDJSON_NULLPTR;
-  Buffer _buffer;  // Output buffer.
+  Buffer _buffer;  // Output buffer when the shared buffer is unavailable.
+  Buffer *buffer;  // Active output buffer
+  EncoderOutput *output = RAPIDJSON_NULLPTR;  // Owner of the shared output buffer in use
   std::vector<LuaSAX::Key> _order;  // Pre-specified key order for tables.
+  const LuaSAX::KeyOrder *compiled_order = RAPIDJSON_NULLPTR;  // Pre-specified json.keyorder; replaces _order
   void *writer_ud = RAPIDJSON_NULLPTR;  // Allocated encoder instance
 
   EncoderData(RAPIDJSON_ALLOCATOR *allocator_)
     : init(true), flags(JSON_DEFAULT), indent(0), indent_amt(4), parsemode(JSON_DECODE_DEFAULT),
-      depth(LUA_RAPIDJSON_DEFAULT_DEPTH), decimals(LUA_NUMBER_FMT_LEN), allocator(allocator_), _buffer(allocator_)  {
+      depth(LUA_RAPIDJSON_DEFAULT_DEPTH), decimals(LUA_NUMBER_FMT_LEN), fixed(0), compress(JSON_COMPRESS_NONE), chunk(LUA_RAPIDJSON_SINK_CHUNK), threads(1), file(RAPIDJSON_NULLPTR), owns_file(false), allocator(allocator_), _buffer(allocator_), buffer(&_buffer)  {
+  }
+
+  ~EncoderData() {
+    Release();
+    Close();
   }
 
   /// <summary>
@@ -366,15 +674,53 @@ struct EncoderData {
   /// </summary>
   RAPIDJSON_FORCEINLINE void Preinitialize() {
     init = false;
+    file = RAPIDJSON_NULLPTR;
+    owns_file = false;
     writer_ud = RAPIDJSON_NULLPTR;
     allocator = RAPIDJSON_NULLPTR;
+    output = RAPIDJSON_NULLPTR;
   }
 
   /// <summary>
-  /// Initialize the Encoder in-place.
+  /// Initialize the Encoder in-place; preserving the file.
   /// </summary>
   RAPIDJSON_FORCEINLINE void InitializeInPlace(RAPIDJSON_ALLOCATOR *_allocator) {
+    std::FILE *_file = file;
+    const bool _owns_file = owns_file;
+
     ::new(this) EncoderData(_allocator);
+    file = _file;
+    owns_file = _owns_file;
+  }
+
+  void Close() {
+    if (file != RAPIDJSON_NULLPTR && owns_file)
+      std::fclose(file);
+    file = RAPIDJSON_NULLPTR;
+    owns_file = false;
+  }
+
+  /// <summary>
+  /// Write to the shared output buffer of "_output" unless it is in use (or
+  /// NULL); otherwise to the private buffer.
+  /// </summary>
+  void Acquire(EncoderOutput *_output) {
+    Buffer *shared = (_output != RAPIDJSON_NULLPTR) ? _output->Acquire() : RAPIDJSON_NULLPTR;
+    if (shared != RAPIDJSON_NULLPTR) {
+      output = _output;
+      buffer = shared;
+    }
+  }
+
+  /// <summary>
+  /// Return the shared output buffer, if any, to its owner.
+  /// </summary>
+  void Release() {
+    if (output != RAPIDJSON_NULLPTR) {
+      output->Release();
+      output = RAPIDJSON_NULLPTR;
+    }
+    buffer = &_buffer;
   }
 
   /// <summary>
@@ -400,11 +746,13 @@ struct EncoderData {
   }
 
   /// <summary>
-  /// Encode the object at the given "idx"
+  /// Write the object at the given "idx" to the output stream "os"
   /// </summary>
-  template<class Writer>
-  int Encode(lua_State *L, int idx, int error_handler_idx = 0, int userdata_idx = 0) {
-    LuaSAX::Encoder sax(flags, depth, error_handler_idx, _order);
+  template<class Writer, typename OS>
+  void Write(lua_State *L, int idx, OS &os, int error_handler_idx) {
+    const LuaSAX::KeyOrder order = (compiled_order != RAPIDJSON_NULLPTR) ? *compiled_order : LuaSAX::KeyOrder(_order);
+    LuaSAX::Encoder sax(flags, depth, error_handler_idx, order, (output != RAPIDJSON_NULLPTR) ? &output->keys : RAPIDJSON_NULLPTR);
+    sax.SetFixedDecimals(fixed);
 
 #if defined(LUA_RAPIDJSON_ANCHOR)
     /*
@@ -428,22 +776,90 @@ struct EncoderData {
       throw LuaException("writer allocation failed");
     }
 
-    ::new(wptr) Writer(_buffer, allocator);
+    ::new(wptr) Writer(os, allocator);
     writer_ud = reinterpret_cast<void *>(wptr);
 
     Writer &writer = *wptr;
 #else
     /* Writer only needs to reside on the stack; unwinds on error. */
-    Writer writer(_buffer, allocator);
+    Writer writer(os, allocator);
 #endif
 
     Initialize(writer);
 
     /* Encode the object at the first index on the stack  */
     sax.encodeValue(L, writer, idx);
+  }
+
+  /// <summary>
+  /// Write the object at the given "idx" to "os" with the writer matching the
+  /// pretty-print and NaN/Inf flags.
+  /// </summary>
+  template<typename OS>
+  void WriteTo(lua_State *L, int idx, OS &os, int error_handler_idx) {
+    if (flags & JSON_PRETTY_PRINT) {
+      if (flags & JSON_NAN_AND_INF)
+        Write<EncoderData::PrettyInf<kWriteDefaultFlags, OS>>(L, idx, os, error_handler_idx);
+      else
+        Write<EncoderData::Pretty<kWriteDefaultFlags, OS>>(L, idx, os, error_handler_idx);
+    }
+    else {
+      if (flags & JSON_NAN_AND_INF)
+        Write<EncoderData::BasicInf<kWriteDefaultFlags, OS>>(L, idx, os, error_handler_idx);
+      else
+        Write<EncoderData::Basic<kWriteDefaultFlags, OS>>(L, idx, os, error_handler_idx);
+    }
+  }
+
+#if defined(LUA_RAPIDJSON_THREADS)
+  /// <summary>
+  /// Write the object at the given "idx" to the output buffer with up to
+  /// "threads" threads: the object is recorded into a LuaSAX::Snapshot, which
+  /// is then formatted in parallel.
+  /// </summary>
+  void WriteParallel(lua_State *L, int idx, int error_handler_idx) {
+    const LuaSAX::KeyOrder order = (compiled_order != RAPIDJSON_NULLPTR) ? *compiled_order : LuaSAX::KeyOrder(_order);
+    LuaSAX::Encoder sax(flags, depth, error_handler_idx, order, (output != RAPIDJSON_NULLPTR) ? &output->keys : RAPIDJSON_NULLPTR);
+    sax.SetFixedDecimals(fixed);
+
+    idx = json_abs_index(L, idx);
+    json_checkstack(L, 1);
+    lua_newtable(L);  // [..., anchors]
+
+    LuaSAX::Snapshot snapshot(L, lua_gettop(L), (flags & JSON_NAN_AND_INF) != 0);
+    snapshot.SetMaxDecimalPlaces(decimals);
+    sax.encodeValue(L, snapshot, idx);
+    snapshot.Format(sax, *buffer, threads);
+    lua_pop(L, 1);  // [...]
+  }
+#endif
+
+  /// <summary>
+  /// Encode the object at the given "idx". Without any JSON_HOT_FLAGS (beyond
+  /// the LUA_RAPIDJSON_BIT32 default), the object is written with a
+  /// LuaSAX::FlagWriter that fixes them at compile time; otherwise they are
+  /// tested per value.
+  /// </summary>
+  template<class Writer>
+  int Encode(lua_State *L, int idx, int error_handler_idx = 0, int userdata_idx = 0) {
+#if defined(LUA_RAPIDJSON_THREADS)
+    if (threads > 1 && !(flags & JSON_PRETTY_PRINT))
+      WriteParallel(L, idx, error_handler_idx);
+    else
+#endif
+    if ((flags & JSON_HOT_FLAGS) == JSON_DEFAULT_BIT32)
+      Write<LuaSAX::FlagWriter<Writer, JSON_DEFAULT_BIT32>>(L, idx, *buffer, error_handler_idx);
+    else
+      Write<Writer>(L, idx, *buffer, error_handler_idx);
 
     /* Push encoded contents onto the Lua stack */
-    lua_pushlstring(L, _buffer.GetString(), _buffer.GetSize());
+    if (compress != JSON_COMPRESS_NONE)
+      PushCompressed(L);
+    else
+      lua_pushlstring(L, buffer->GetString(), buffer->GetSize());
+
+    if (output != RAPIDJSON_NULLPTR)
+      output->Update(buffer->GetSize());
 
     /* Cleanup userdata allocations instead of waiting for GC cycle. */
 #if defined(LUA_RAPIDJSON_ANCHOR)
@@ -455,8 +871,173 @@ struct EncoderData {
     return 1;
   }
 
+  /// <summary>
+  /// Encode the object at the given "idx" into "file", flushing the output in
+  /// LUA_RAPIDJSON_FILE_BUFFER sized chunks (or compressed chunks) as it is
+  /// produced rather than materializing it in memory.
+  /// </summary>
+  int Dump(lua_State *L, int idx, int error_handler_idx = 0, int userdata_idx = 0) {
+    bool failed = false;
+    if (compress != JSON_COMPRESS_NONE) {
+#if defined(LUA_RAPIDJSON_ZLIB)
+      FileSink sink = { file };
+      extend::DeflateStream<FileSink> os(sink, compress == JSON_COMPRESS_GZIP);
+      WriteTo(L, idx, os, error_handler_idx);
+      failed = !os.Finish();
+#else
+      throw LuaException("compression requires LUA_RAPIDJSON_ZLIB");
+#endif
+    }
+    else {
+      char chunk[LUA_RAPIDJSON_FILE_BUFFER];
+      FileWriteStream os(file, chunk, sizeof(chunk));
+      WriteTo(L, idx, os, error_handler_idx);
+      os.Flush();
+    }
+
+    if (failed || std::fflush(file) != 0 || std::ferror(file))
+      throw LuaException("cannot write file");
+
+    lua_pushboolean(L, 1);
+
+    /* Cleanup userdata allocations (and close the file) instead of waiting for GC cycle. */
+#if defined(LUA_RAPIDJSON_ANCHOR)
+    if (userdata_idx > 0)
+      CleanupUserdata(L, userdata_idx);
+#else
+    JSON_UNUSED(userdata_idx);
+#endif
+    return 1;
+  }
+
+  /// <summary>
+  /// Pass a chunk of output to the Lua function at "sink_idx". Errors raised
+  /// by the function are rethrown by json_call, unwinding the encoder.
+  /// </summary>
+  static void CallSink(lua_State *L, int sink_idx, const char *s, size_t len) {
+    json_checkstack(L, 2);
+    lua_pushvalue(L, sink_idx);  // [..., sink]
+    lua_pushlstring(L, s, len);  // [..., sink, chunk]
+    json_call(L, 1, 0);  // [...]
+  }
+
+  /// <summary>
+  /// Output stream that accumulates into an output buffer and passes it to the
+  /// sink function each time it reaches "chunk" bytes.
+  /// </summary>
+  struct SinkStream {
+    typedef char Ch;
+
+    lua_State *L;
+    int sink_idx;
+    Buffer &buffer;
+    size_t chunk;
+
+    void Put(Ch c) {
+      buffer.Put(c);
+      if (buffer.GetSize() >= chunk)
+        Flush();
+    }
+
+    void Flush() {
+      if (buffer.GetSize() > 0) {
+        CallSink(L, sink_idx, buffer.GetString(), buffer.GetSize());
+        buffer.Clear();
+      }
+    }
+
+    Ch Peek() const { RAPIDJSON_ASSERT(false); return 0; }
+    Ch Take() { RAPIDJSON_ASSERT(false); return 0; }
+    size_t Tell() const { RAPIDJSON_ASSERT(false); return 0; }
+    Ch *PutBegin() { RAPIDJSON_ASSERT(false); return 0; }
+    size_t PutEnd(Ch *) { RAPIDJSON_ASSERT(false); return 0; }
+  };
+
+  /// <summary>
+  /// Encode the object at the given "idx", passing the output to the Lua
+  /// function at "sink_idx" in "chunk" sized pieces (or compressed chunks) as
+  /// it is produced rather than materializing it in memory.
+  /// </summary>
+  int EncodeTo(lua_State *L, int idx, int sink_idx, int error_handler_idx = 0, int userdata_idx = 0) {
+    if (compress != JSON_COMPRESS_NONE) {
+#if defined(LUA_RAPIDJSON_ZLIB)
+      LuaSink sink = { L, sink_idx };
+      extend::DeflateStream<LuaSink> os(sink, compress == JSON_COMPRESS_GZIP);
+      WriteTo(L, idx, os, error_handler_idx);
+      if (!os.Finish())
+        throw LuaException("compression failed");
+#else
+      throw LuaException("compression requires LUA_RAPIDJSON_ZLIB");
+#endif
+    }
+    else {
+      SinkStream os = { L, sink_idx, *buffer, chunk };
+      WriteTo(L, idx, os, error_handler_idx);
+      os.Flush();
+    }
+
+    /* Cleanup userdata allocations instead of waiting for GC cycle. */
+#if defined(LUA_RAPIDJSON_ANCHOR)
+    if (userdata_idx > 0)
+      CleanupUserdata(L, userdata_idx);
+#else
+    JSON_UNUSED(userdata_idx);
+#endif
+    return 0;
+  }
+
+#if defined(LUA_RAPIDJSON_ZLIB)
+  /// <summary>
+  /// extend::DeflateStream sink that appends to a luaL_Buffer.
+  /// </summary>
+  struct BufferSink {
+    luaL_Buffer *b;
+    void operator()(const char *s, size_t len) { luaL_addlstring(b, s, len); }
+  };
+
+  /// <summary>
+  /// extend::DeflateStream sink that writes to a file.
+  /// </summary>
+  struct FileSink {
+    std::FILE *file;
+    void operator()(const char *s, size_t len) { std::fwrite(s, 1, len, file); }
+  };
+
+  /// <summary>
+  /// extend::DeflateStream sink that passes each compressed chunk to a Lua function.
+  /// </summary>
+  struct LuaSink {
+    lua_State *L;
+    int sink_idx;
+    void operator()(const char *s, size_t len) { CallSink(L, sink_idx, s, len); }
+  };
+#endif
+
+  /// <summary>
+  /// Push the encoded contents, compressed chunk by chunk from the output
+  /// buffer, onto the Lua stack.
+  /// </summary>
+  void PushCompressed(lua_State *L) {
+#if defined(LUA_RAPIDJSON_ZLIB)
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+
+    BufferSink sink = { &b };
+    extend::DeflateStream<BufferSink> stream(sink, compress == JSON_COMPRESS_GZIP);
+    stream.Write(buffer->GetString(), buffer->GetSize());
+    if (!stream.Finish())
+      throw LuaException("compression failed");
+    luaL_pushresult(&b);
+#else
+    JSON_UNUSED(L);
+    throw LuaException("compression requires LUA_RAPIDJSON_ZLIB");
+#endif
+  }
+
   void CleanupUserdata(lua_State *L, int userdata_idx) {
+    Close();
     if (init) {
+      Release();
       _order.~vector();
       _buffer.~GenericStringBuffer();
       if (writer_ud != RAPIDJSON_NULLPTR) {
@@ -523,13 +1104,19 @@ struct DecoderData {
   bool init;  // Has been constructed in-place
   lua_Integer flags;  // Decoding flags
   lua_Integer parsemode;  // Decoding configuration
+  const char *columnar;  // JSON pointer to the array decoded as columns
+  size_t columnar_len;
+  std::FILE *file;  // json.load: file being decoded
+  bool owns_file;  // json.load: file is closed on cleanup
 
   RAPIDJSON_ALLOCATOR *allocator;
   internal::Stack<RAPIDJSON_ALLOCATOR> stack;
+  internal::Stack<RAPIDJSON_ALLOCATOR> scratch;  // Typed array element buffer
   GenericReader<LUA_RAPIDJSON_SOURCE, LUA_RAPIDJSON_TARGET, RAPIDJSON_ALLOCATOR> reader;
+  extend::StructuralReader<RAPIDJSON_ALLOCATOR> structural;  // JSON_DECODE_STRUCTURAL
 
   DecoderData(RAPIDJSON_ALLOCATOR *_allocator)
-    : init(true), flags(JSON_DEFAULT), parsemode(JSON_DECODE_DEFAULT), allocator(_allocator), stack(_allocator, 0), reader(allocator) {
+    : init(true), flags(JSON_DEFAULT), parsemode(JSON_DECODE_DEFAULT), columnar(RAPIDJSON_NULLPTR), columnar_len(0), file(RAPIDJSON_NULLPTR), owns_file(false), allocator(_allocator), stack(_allocator, 0), scratch(_allocator, 0), reader(allocator), structural(allocator) {
   }
 
   /// <summary>
@@ -537,14 +1124,32 @@ struct DecoderData {
   /// </summary>
   RAPIDJSON_FORCEINLINE void Preinitialize() {
     init = false;
+    file = RAPIDJSON_NULLPTR;
+    owns_file = false;
     allocator = RAPIDJSON_NULLPTR;
   }
 
   /// <summary>
-  /// Initialize the Decoder in-place.
+  /// Initialize the Decoder in-place; preserving the file.
   /// </summary>
   RAPIDJSON_FORCEINLINE void InitializeInPlace(RAPIDJSON_ALLOCATOR *_allocator) {
+    std::FILE *_file = file;
+    const bool _owns_file = owns_file;
+
     ::new(this) DecoderData(_allocator);
+    file = _file;
+    owns_file = _owns_file;
+  }
+
+  ~DecoderData() {
+    Close();
+  }
+
+  void Close() {
+    if (file != RAPIDJSON_NULLPTR && owns_file)
+      std::fclose(file);
+    file = RAPIDJSON_NULLPTR;
+    owns_file = false;
   }
 
   /// <summary>
@@ -553,14 +1158,50 @@ struct DecoderData {
   /// <param name="nullarg">Stack index of object that represents "null"</param>
   /// <param name="objectarg">Stack index of "object" metatable</param>
   /// <param name="arrayarg">Stack index of "array" metatable</param>
+  /// <param name="internarg">Stack index of the hash-consing table</param>
+  /// <param name="stringarg">Stack index of the long string table</param>
   /// <returns></returns>
-  ParseResult Decode(lua_State *L, int userdata_idx, const char *contents, size_t len, size_t &position, int nullarg = -1, int objectarg = -1, int arrayarg = -1) {
+  ParseResult Decode(lua_State *L, int userdata_idx, const char *contents, size_t len, size_t &position, int nullarg = -1, int objectarg = -1, int arrayarg = -1, int internarg = -1, int stringarg = -1) {
+    if (parsemode != JSON_DECODE_STRUCTURAL) {
+      extend::StringStream s(contents + (position - 1), len - (position - 1));
+      return DecodeStream(L, userdata_idx, s, position, nullarg, objectarg, arrayarg, internarg, stringarg);
+    }
+
+    const size_t start = position - 1;
+    LuaSAX::Decoder<RAPIDJSON_ALLOCATOR> decoder(L, stack, scratch, flags, nullarg, objectarg, arrayarg, columnar, columnar_len, internarg, stringarg);
+    const ParseResult result = structural.Parse<ParseFlag::kParseDefaultFlags
+      | ParseFlag::kParseStopWhenDoneFlag
+      | ParseFlag::kParseTrailingCommasFlag
+      | ParseFlag::kParseNanAndInfFlag
+    >(contents + start, len - start, decoder, position);
+    if (result.IsError() && structural.IsTooDeep()) {  // Decoded by the default preset, as nothing has been decoded yet
+      extend::StringStream s(contents + start, len - start);
+      return DecodeStream(L, userdata_idx, s, position, nullarg, objectarg, arrayarg, internarg, stringarg);
+    }
+
+    // Cleanup userdata allocations instead of waiting for GC cycle.
+#if defined(LUA_RAPIDJSON_ANCHOR)
+    if (userdata_idx > 0)
+      CleanupUserdata(L, userdata_idx);
+#else
+    JSON_UNUSED(userdata_idx);
+#endif
+    return result;
+  }
+
+  /// <summary>
+  /// Decode the value at the beginning of an input stream, e.g., a file or
+  /// compressed contents; "position" is set to the number of characters read.
+  /// The "structural" preset requires the contents in memory and is decoded
+  /// with the default preset.
+  /// </summary>
+  template<typename Stream>
+  ParseResult DecodeStream(lua_State *L, int userdata_idx, Stream &s, size_t &position, int nullarg = -1, int objectarg = -1, int arrayarg = -1, int internarg = -1, int stringarg = -1) {
     ParseResult result = ParseResult(ParseErrorCode::kParseErrorValueInvalid, position);
     if (parsemode == JSON_DECODE_EXTENDED)
       flags |= JSON_NAN_AND_INF;  // Temporary fix for propagating runtime "NanAndInf" checking
 
-    extend::StringStream s(contents + (position - 1), len - (position - 1));
-    LuaSAX::Decoder<RAPIDJSON_ALLOCATOR> decoder(L, stack, flags, nullarg, objectarg, arrayarg);
+    LuaSAX::Decoder<RAPIDJSON_ALLOCATOR> decoder(L, stack, scratch, flags, nullarg, objectarg, arrayarg, columnar, columnar_len, internarg, stringarg);
     switch (parsemode) {
       case JSON_DECODE_EXTENDED: {
         result = reader.Parse<ParseFlag::kParseDefaultFlags
@@ -596,10 +1237,37 @@ struct DecoderData {
     return result;
   }
 
+  /// <summary>
+  /// Decode the value at the beginning of "file". Compressed files (see
+  /// LUA_RAPIDJSON_ZLIB) are inflated as they are read; "inflate_error" is set
+  /// if the compressed data is malformed.
+  /// </summary>
+  ParseResult DecodeFile(lua_State *L, int userdata_idx, size_t &position, bool &inflate_error, int nullarg = -1, int objectarg = -1, int arrayarg = -1, int internarg = -1, int stringarg = -1) {
+    inflate_error = false;
+#if defined(LUA_RAPIDJSON_ZLIB)
+    const int c = std::getc(file);
+    if (c != EOF)
+      std::ungetc(c, file);
+    if (c == 0x1F || c == 0x78) {  // gzip or (default) zlib header
+      extend::InflateStream s(file);
+      const ParseResult result = DecodeStream(L, userdata_idx, s, position, nullarg, objectarg, arrayarg, internarg, stringarg);
+      inflate_error = s.HasError();
+      return result;
+    }
+#endif
+
+    char buffer[LUA_RAPIDJSON_FILE_BUFFER];
+    FileReadStream s(file, buffer, sizeof(buffer));
+    return DecodeStream(L, userdata_idx, s, position, nullarg, objectarg, arrayarg, internarg, stringarg);
+  }
+
   void CleanupUserdata(lua_State *L, int userdata_idx) {
+    Close();
     if (init) {
       stack.~Stack();
+      scratch.~Stack();
       reader.~GenericReader();
+      structural.~StructuralReader();
 
       init = false;
       allocator = RAPIDJSON_NULLPTR;
@@ -648,51 +1316,352 @@ struct DecoderData {
   }
 };
 
-extern "C" {
-LUALIB_API int rapidjson_null (lua_State *L) {
-#if LUA_VERSION_NUM == 501
-  lua_pushlightuserdata(L, reinterpret_cast<void *>(&rapidjson_null));
-#else
-  lua_pushcfunction(L, rapidjson_null);
-#endif
-  return 1;
-}
+/// <summary>
+/// Intermediate data of json.query: handler stacks, the read buffer, and the
+/// queried file (closed on cleanup if opened by json.query).
+/// </summary>
+struct QueryData {
+  bool init;  // Has been constructed in-place
+  std::FILE *file;
+  bool owns_file;
 
-LUALIB_API int rapidjson_encode (lua_State *L) {
-  int top = 0;
-  int key_order_idx = 0; // Stack index of preset key ordering (temporary)
-  int error_handler_idx = 0;  // Stack index of error handling function.
-  int userdata_idx = 0;  // Stack index of the anchored rapidjson userdata.
-  lua_settop(L, 2);  // Ensure second argument is created
+  RAPIDJSON_ALLOCATOR *allocator;
+  internal::Stack<RAPIDJSON_ALLOCATOR> stack;
+  internal::Stack<RAPIDJSON_ALLOCATOR> scratch;
+  internal::Stack<RAPIDJSON_ALLOCATOR> frames;  // LuaSAX::Query containers
+  GenericReader<LUA_RAPIDJSON_SOURCE, LUA_RAPIDJSON_TARGET, RAPIDJSON_ALLOCATOR> reader;
+  char buffer[LUA_RAPIDJSON_QUERY_BUFFER];
 
-  /* Create and anchor a userdata on the stack that manages intermediate rapidjson data */
-#if defined(LUA_RAPIDJSON_ANCHOR)
-  EncoderData *eud = reinterpret_cast<EncoderData *>(json_newuserdata(L, sizeof(EncoderData)));  // [..., userdata]
-  eud->Preinitialize();
+  QueryData(RAPIDJSON_ALLOCATOR *_allocator)
+    : init(true), file(RAPIDJSON_NULLPTR), owns_file(false), allocator(_allocator), stack(_allocator, 0), scratch(_allocator, 0), frames(_allocator, 0), reader(allocator) {
+  }
 
-  top = userdata_idx = lua_gettop(L);  // Ensure lua_settop(L) contains the userdata
-  luaL_getmetatable(L, LUA_RAPIDJSON_ENCODER);  // [..., userdata, metatable]
-  lua_setmetatable(L, -2);  // [..., userdata]
-#else
-  top = lua_gettop(L);
+  ~QueryData() {
+    Close();
+  }
+
+  /// <summary>
+  /// Initialize necessary fields after a rapidjson::Allocator malloc.
+  /// </summary>
+  RAPIDJSON_FORCEINLINE void Preinitialize() {
+    init = false;
+    file = RAPIDJSON_NULLPTR;
+    owns_file = false;
+    allocator = RAPIDJSON_NULLPTR;
+  }
+
+  /// <summary>
+  /// Initialize the QueryData in-place; preserving the file.
+  /// </summary>
+  RAPIDJSON_FORCEINLINE void InitializeInPlace(RAPIDJSON_ALLOCATOR *_allocator) {
+    std::FILE *_file = file;
+    const bool _owns_file = owns_file;
+
+    ::new(this) QueryData(_allocator);
+    file = _file;
+    owns_file = _owns_file;
+  }
+
+  void Close() {
+    if (file != RAPIDJSON_NULLPTR && owns_file)
+      std::fclose(file);
+    file = RAPIDJSON_NULLPTR;
+    owns_file = false;
+  }
+
+  /// <summary>
+  /// Evaluate "path" over the file; see LuaSAX::Query.
+  /// </summary>
+  ParseResult Query(lua_State *L, int userdata_idx, const LuaSAX::JSONPath &path, lua_Integer flags, int resultarg, int callbackarg, lua_Integer &count) {
+    ParseResult result;
+
+    FileReadStream s(file, buffer, sizeof(buffer));
+    LuaSAX::Query<RAPIDJSON_ALLOCATOR> query(L, path, stack, scratch, frames, flags, -1, resultarg, callbackarg);
+    result = reader.Parse<ParseFlag::kParseDefaultFlags
+      | ParseFlag::kParseTrailingCommasFlag
+      | ParseFlag::kParseNanAndInfFlag
+    >(s, query);
+
+    count = query.Count();
+    if (query.Stopped())
+      result.Clear();
+
+    // Cleanup userdata allocations (and the file) instead of waiting for GC cycle.
+#if defined(LUA_RAPIDJSON_ANCHOR)
+    if (userdata_idx > 0)
+      CleanupUserdata(L, userdata_idx);
+#else
+    JSON_UNUSED(userdata_idx);
 #endif
+    return result;
+  }
 
-  /* Parse default options */
-  lua_rapidjson_getsubtable(L, LUA_REGISTRYINDEX, LUA_RAPIDJSON_REG);
-  lua_Integer flags = geti(L, -1, LUA_RAPIDJSON_REG_FLAGS, JSON_DEFAULT);
-  lua_Integer parsemode = geti(L, -1, LUA_RAPIDJSON_REG_PRESET, JSON_DECODE_DEFAULT);
-  lua_Integer indent = geti(L, -1, LUA_RAPIDJSON_REG_INDENT, 0);
-  lua_Integer indent_amt = geti(L, -1, LUA_RAPIDJSON_REG_INDENT_AMT, (indent == 0) ? 4 : 0);
-  int depth = static_cast<int>(geti(L, -1, LUA_RAPIDJSON_REG_DEPTH, LUA_RAPIDJSON_DEFAULT_DEPTH));
-  int decimals = static_cast<int>(geti(L, -1, LUA_RAPIDJSON_REG_MAXDEC, LUA_NUMBER_FMT_LEN));
-  lua_pop(L, 1);
+  void CleanupUserdata(lua_State *L, int userdata_idx) {
+    Close();
+    if (init) {
+      stack.~Stack();
+      scratch.~Stack();
+      frames.~Stack();
+      reader.~GenericReader();
+
+      init = false;
+      allocator = RAPIDJSON_NULLPTR;
+    }
+
+    lua_pushnil(L);
+    lua_setmetatable(L, userdata_idx);
+  }
+
+  /// <summary>
+  /// Garbage collection sweep
+  /// </summary>
+  static int __gc(lua_State *L) {
+    void *udata = luaL_checkudata(L, 1, LUA_RAPIDJSON_QUERY);
+    if (udata != RAPIDJSON_NULLPTR) {
+      reinterpret_cast<QueryData *>(udata)->CleanupUserdata(L, 1);
+    }
+
+    return 0;
+  }
+};
+
+#if LUA_RAPIDJSON_TINY_SIZE > 0
+/*
+** {==================================================================
+** Fast path for tiny documents
+** ===================================================================
+*/
+
+/*
+** Return true if json.decode may use decode_tiny under the given (global)
+** configuration: options that require additional state are decoded by the
+** general path.
+*/
+static RAPIDJSON_FORCEINLINE bool decode_is_tiny (const JsonConfig &config) {
+  return config.parsemode == JSON_DECODE_DEFAULT && config.cache_entries <= 0
+    && (config.flags & (JSON_COLUMNAR | JSON_HASH_CONS | JSON_DEDUP_STRINGS | JSON_TYPED_ARRAYS)) == 0;
+}
+
+/*
+** Decode a string of at most LUA_RAPIDJSON_TINY_SIZE bytes with the parser and
+** decoder stacks in fixed-size storage on the C stack; there is no anchored
+** userdata or heap allocation to release if a Lua error unwinds the decoder.
+**
+** Returns -1 if the string must be decoded by the general path: on parse errors
+** (reported by the general path) or if the storage is exhausted.
+*/
+static int decode_tiny (lua_State *L, const JsonConfig &config, const char *contents, size_t len) {
+  const int top = lua_gettop(L);
+  try {
+    char arena[LUA_RAPIDJSON_TINY_ARENA];
+    FixedAllocator allocator(arena, sizeof(arena));
+    internal::Stack<FixedAllocator> stack(&allocator, 0);
+    internal::Stack<FixedAllocator> scratch(&allocator, 0);
+    GenericReader<LUA_RAPIDJSON_SOURCE, LUA_RAPIDJSON_TARGET, FixedAllocator> reader(&allocator, LUA_RAPIDJSON_TINY_SIZE);
+
+    extend::StringStream s(contents, len);
+    LuaSAX::Decoder<FixedAllocator> decoder(L, stack, scratch, config.flags);
+    const ParseResult r = reader.Parse<ParseFlag::kParseDefaultFlags
+      | ParseFlag::kParseStopWhenDoneFlag
+      | ParseFlag::kParseTrailingCommasFlag
+      | ParseFlag::kParseNanAndInfFlag
+    >(s, decoder);
+
+    if (!r.IsError()) {
+      lua_pushinteger(L, 1 + static_cast<lua_Integer>(s.Tell()));
+      return 2;
+    }
+  }
+  catch (const std::exception &) {
+    // Decoded again by the general path
+  }
+
+  lua_settop(L, top);
+  return -1;
+}
+
+/// <summary>
+/// Output stream of the json.encode fast path: characters are written to
+/// fixed-size storage on the C stack. Longer outputs restart the encoding on
+/// the general path, which is faster for them.
+/// </summary>
+struct TinyStream {
+  typedef char Ch;
+
+  TinyStream() : current_(fixed_) { }
+
+  RAPIDJSON_FORCEINLINE void Put(Ch c) {
+    if (RAPIDJSON_UNLIKELY(current_ == fixed_ + sizeof(fixed_)))
+      throw LuaRestartException();
+    *current_++ = c;
+  }
+
+  void Flush() { }
+
+  const Ch *GetString() const { return fixed_; }
+  size_t GetSize() const { return static_cast<size_t>(current_ - fixed_); }
+
+private:
+  TinyStream(const TinyStream &);
+  TinyStream &operator=(const TinyStream &);
+
+  Ch *current_;
+  Ch fixed_[LUA_RAPIDJSON_TINY_SIZE];
+};
+
+/*
+** Return true if json.encode, without a state argument, may use encode_tiny
+** under the given (global) configuration.
+*/
+static RAPIDJSON_FORCEINLINE bool encode_is_tiny (const JsonConfig &config) {
+  return (config.flags & (JSON_PRETTY_PRINT | JSON_SORT_KEYS)) == 0
+    && config.depth > 0 && config.depth <= LUA_RAPIDJSON_DEFAULT_DEPTH;
+}
+
+template<unsigned writeFlags>
+static void encode_tiny_value (lua_State *L, const JsonConfig &config, TinyStream &stream) {
+  typedef Writer<TinyStream, LUA_RAPIDJSON_SOURCE, LUA_RAPIDJSON_TARGET, FixedAllocator, writeFlags> TinyWriter;
+
+  /* Writer::Level stack: at most depth + 1 nested tables */
+  char arena[LUA_RAPIDJSON_TINY_ARENA];
+  FixedAllocator allocator(arena, sizeof(arena));
+
+  const LuaSAX::KeyOrder order;  // Empty
+  LuaSAX::Encoder sax(config.flags, static_cast<int>(config.depth), 0, order);
+  TinyWriter writer(stream, &allocator, LUA_RAPIDJSON_DEFAULT_DEPTH + 2);
+  writer.SetMaxDecimalPlaces(static_cast<int>(config.decimals));
+  sax.SetFixedDecimals(static_cast<int>(config.fixed));
+  sax.SetTentative();
+  sax.encodeValue(L, writer, 1);
+}
+
+/*
+** Encode the first argument with the global configuration: the writer stack
+** and output reside on the C stack; there is no anchored userdata or heap
+** allocation to release if a Lua error unwinds the encoder.
+**
+** Returns -1 if the value must be encoded by the general path: its output is
+** longer than LUA_RAPIDJSON_TINY_SIZE or it has metafunctions. No Lua function
+** has been called by then.
+*/
+static int encode_tiny (lua_State *L, const JsonConfig &config) {
+  const int top = lua_gettop(L);
+
+  bool has_error_string = false;
+  try {
+    TinyStream stream;
+    if (config.flags & JSON_NAN_AND_INF)
+      encode_tiny_value<kWriteDefaultFlags | kWriteNanAndInfFlag>(L, config, stream);
+    else
+      encode_tiny_value<kWriteDefaultFlags>(L, config, stream);
+
+    lua_pushlstring(L, stream.GetString(), stream.GetSize());  // [..., encoded_string]
+    return 1;
+  }
+  catch (const LuaRestartException &) {
+    lua_settop(L, top);
+    return -1;
+  }
+  catch (const LuaCallException &e) {
+    has_error_string = e.pushError(L, top);
+  }
+  catch (const LuaTypeException &e) {
+    has_error_string = e.pushError(L, top);
+  }
+  catch (const std::exception &e) {
+    lua_settop(L, top);
+    has_error_string = LuaTypeException::_lua_pushstring(L, e.what());
+  }
+  catch (...) {
+    lua_settop(L, top);
+  }
 
-  if (lua_istable(L, 2)) {  // Parse all options from the additional argument table.
+  if (!has_error_string)
+    lua_pushstring(L, "Unexpected exception");
+  return lua_error(L);
+}
+
+/* }================================================================== */
+#endif
+
+extern "C" {
+LUALIB_API int rapidjson_null (lua_State *L) {
+#if LUA_VERSION_NUM == 501
+  lua_pushlightuserdata(L, reinterpret_cast<void *>(&rapidjson_null));
+#else
+  lua_pushcfunction(L, rapidjson_null);
+#endif
+  return 1;
+}
+
+/* Destination of an encoded value */
+enum EncodeTarget {
+  ENCODE_STRING,  /* json.encode(value [, state]) */
+  ENCODE_FILE,  /* json.dump(value, file [, state]) */
+  ENCODE_SINK,  /* json.encode_to(sink, value [, state]) */
+};
+
+/*
+** json.encode, json.dump, and json.encode_to: "dump" writes to the file name or
+** file handle at the second argument, and "encode_to" passes chunks to the
+** function at the first argument, rather than returning a string. The state
+** table is then the third argument.
+*/
+static int encode (lua_State *L, EncodeTarget target) {
+  int top = 0;
+  int key_order_idx = 0; // Stack index of preset key ordering (temporary)
+  int error_handler_idx = 0;  // Stack index of error handling function.
+  int userdata_idx = 0;  // Stack index of the anchored rapidjson userdata.
+  const int valuearg = (target == ENCODE_SINK) ? 2 : 1;  // Stack index of the encoded value
+  const int statearg = (target == ENCODE_STRING) ? 2 : 3;  // Stack index of the state table
+  lua_settop(L, statearg);  // Ensure state argument is created
+  if (target == ENCODE_SINK)
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+
+#if LUA_RAPIDJSON_TINY_SIZE > 0
+  if (target == ENCODE_STRING && lua_isnil(L, 2)) {
+    JsonConfig local;
+    const JsonConfig &config = json_getconfig(L, local);
+    if (encode_is_tiny(config)) {
+      const int results = encode_tiny(L, config);
+      if (results >= 0)
+        return results;
+    }
+  }
+#endif
+
+  /* Create and anchor a userdata on the stack that manages intermediate rapidjson data */
+#if defined(LUA_RAPIDJSON_ANCHOR)
+  EncoderData *eud = reinterpret_cast<EncoderData *>(json_newuserdata(L, sizeof(EncoderData)));  // [..., userdata]
+  eud->Preinitialize();
+
+  top = userdata_idx = lua_gettop(L);  // Ensure lua_settop(L) contains the userdata
+  luaL_getmetatable(L, LUA_RAPIDJSON_ENCODER);  // [..., userdata, metatable]
+  lua_setmetatable(L, -2);  // [..., userdata]
+#else
+  top = lua_gettop(L);
+#endif
+
+  /* Parse default options */
+  JsonConfig local;
+  const JsonConfig &config = json_getconfig(L, local);
+  lua_Integer flags = config.flags;
+  lua_Integer parsemode = config.parsemode;
+  lua_Integer indent = config.indent;
+  lua_Integer indent_amt = config.indent_amt;
+  int depth = static_cast<int>(config.depth);
+  int decimals = static_cast<int>(config.decimals);
+  int fixed = static_cast<int>(config.fixed);
+  int compress = JSON_COMPRESS_NONE;
+  lua_Integer chunk = LUA_RAPIDJSON_SINK_CHUNK;
+  lua_Integer threads = 1;  // Zero: one per hardware thread
+
+  if (lua_istable(L, statearg)) {  // Parse all options from the additional argument table.
     bool has_key_order = false;
     bool has_exception_handler = false;
 
     lua_pushnil(L);
-    while (lua_next(L, 2)) {  // [..., key, value]
+    while (lua_next(L, statearg)) {  // [..., key, value]
       const lua_Integer opt = option_keys_num[luaL_optcheckoption(L, -2, RAPIDJSON_NULLPTR, option_keys, 0)];
       switch (opt) {
         case JSON_PRETTY_PRINT:
@@ -706,6 +1675,7 @@ LUALIB_API int rapidjson_encode (lua_State *L) {
         case JSON_ARRAY_SINGLE_LINE:
         case JSON_ARRAY_EMPTY:
         case JSON_ARRAY_WITH_HOLES:
+        case JSON_TRUST_JSONTYPE:
           flags = lua_toboolean(L, -1) ? (flags | opt) : (flags & ~opt);
           break;
         case JSON_ENCODER_MAX_DEPTH:
@@ -716,6 +1686,11 @@ LUALIB_API int rapidjson_encode (lua_State *L) {
           if ((decimals = static_cast<int>(lua_tointeger(L, -1))) <= 0)
             return luaL_error(L, "invalid decimal count");
           break;
+        case JSON_ENCODER_FIXED:  // false or zero disables
+          fixed = lua_isboolean(L, -1) ? 0 : static_cast<int>(lua_tointeger(L, -1));
+          if (fixed < 0 || fixed > LUA_RAPIDJSON_FIXED_MAX)
+            return luaL_error(L, "invalid fixed decimal count");
+          break;
         case JSON_ENCODER_INDENT:
           indent = lua_tointeger(L, -1);
           if (indent < 0 || indent >= 4)
@@ -729,9 +1704,41 @@ LUALIB_API int rapidjson_encode (lua_State *L) {
           has_exception_handler = lua_isfunction(L, -1);
           break;
         case JSON_TABLE_KEY_ORDER: {
-          has_key_order = lua_istable(L, -1);
+          has_key_order = lua_istable(L, -1) || LuaSAX::KeyOrder::Test(L, -1) != RAPIDJSON_NULLPTR;
+          break;
+        }
+        case JSON_ENCODER_COMPRESS: {  // true, false, "gzip", or "zlib"
+          if (lua_type(L, -1) == LUA_TSTRING) {
+            const char *format = lua_tostring(L, -1);
+            if (strcmp(format, "gzip") == 0)
+              compress = JSON_COMPRESS_GZIP;
+            else if (strcmp(format, "zlib") == 0)
+              compress = JSON_COMPRESS_ZLIB;
+            else
+              return luaL_error(L, "invalid compression format");
+          }
+          else
+            compress = lua_toboolean(L, -1) ? JSON_COMPRESS_GZIP : JSON_COMPRESS_NONE;
+#if !defined(LUA_RAPIDJSON_ZLIB)
+          if (compress != JSON_COMPRESS_NONE)
+            return luaL_error(L, "compression requires LUA_RAPIDJSON_ZLIB");
+#endif
           break;
         }
+        case JSON_ENCODER_CHUNK:
+          if ((chunk = lua_tointeger(L, -1)) <= 0)
+            return luaL_error(L, "invalid chunk size");
+          break;
+        case JSON_ENCODER_THREADS:  // true (one per hardware thread), false, or a thread count
+          if (lua_isboolean(L, -1))
+            threads = lua_toboolean(L, -1) ? 0 : 1;
+          else if ((threads = lua_tointeger(L, -1)) <= 0)
+            return luaL_error(L, "invalid thread count");
+#if !defined(LUA_RAPIDJSON_THREADS)
+          if (threads != 1)
+            return luaL_error(L, "threads requires LUA_RAPIDJSON_THREADS");
+#endif
+          break;
         default:
           break;
       }
@@ -739,23 +1746,33 @@ LUALIB_API int rapidjson_encode (lua_State *L) {
     }
 
     if (has_exception_handler) {
-      lua_getfield(L, 2, LUA_RAPIDJSON_STATE_EXCEPTION);  // [... [, userdata] [, exception_handler]]
+      lua_getfield(L, statearg, LUA_RAPIDJSON_STATE_EXCEPTION);  // [... [, userdata] [, exception_handler]]
       error_handler_idx = lua_gettop(L);
     }
 
     if (has_key_order) {
-      lua_getfield(L, 2, LUA_RAPIDJSON_STATE_KEYORDER);  // [... [, userdata] [, exception_handler] [, key_order]]
+      lua_getfield(L, statearg, LUA_RAPIDJSON_STATE_KEYORDER);  // [... [, userdata] [, exception_handler] [, key_order]]
       key_order_idx = lua_gettop(L);
     }
   }
-  else if (!lua_isnoneornil(L, 2)) {
-    return luaL_error(L, "Argument 2: table or nothing expected");
+  else if (!lua_isnoneornil(L, statearg)) {
+    return luaL_error(L, "Argument %d: table or nothing expected", statearg);
   }
 
   /* Sanitize pretty_print parameters even when not using them. */
   if (indent < 0 || indent >= 4 || depth < 0)
     return luaL_error(L, "invalid encoder parameters");
 
+  std::FILE *file = RAPIDJSON_NULLPTR;
+  bool owns_file = false;
+  if (target == ENCODE_FILE) {
+    file = json_checkfile(L, 2, "wb", owns_file);
+#if defined(LUA_RAPIDJSON_ANCHOR)
+    eud->file = file;
+    eud->owns_file = owns_file;
+#endif
+  }
+
   bool has_error_string = false;
   try {
     RAPIDJSON_ALLOCATOR_INIT(L, _allocator);
@@ -764,6 +1781,8 @@ LUALIB_API int rapidjson_encode (lua_State *L) {
     EncoderData &encoder = *eud;
 #else
     EncoderData encoder(&_allocator);
+    encoder.file = file;
+    encoder.owns_file = owns_file;
 #endif
     encoder.flags = flags;
     encoder.parsemode = parsemode;
@@ -771,12 +1790,28 @@ LUALIB_API int rapidjson_encode (lua_State *L) {
     encoder.indent_amt = indent_amt;
     encoder.depth = depth;
     encoder.decimals = decimals;
-    if (key_order_idx > 0) {
+    encoder.fixed = fixed;
+    encoder.compress = compress;
+    encoder.chunk = static_cast<size_t>(chunk);
+#if defined(LUA_RAPIDJSON_THREADS)
+    if (threads == 0)
+      threads = static_cast<lua_Integer>(std::max(1u, std::thread::hardware_concurrency()));
+    encoder.threads = static_cast<unsigned>(std::min<lua_Integer>(threads, LUA_RAPIDJSON_THREADS_MAX));
+#endif
+    encoder.Acquire(reinterpret_cast<EncoderOutput *>(lua_touserdata(L, lua_upvalueindex(2))));
+    if (key_order_idx > 0 && (encoder.compiled_order = LuaSAX::KeyOrder::Test(L, key_order_idx)) != RAPIDJSON_NULLPTR)
+      lua_pop(L, 1);  // [... [, userdata] [, exception_handler]]; anchored by the state table
+    else if (key_order_idx > 0) {
       if (LuaSAX::populate_key_vector(L, key_order_idx, encoder._order) != 0)
         throw LuaException("invalid key_order element");
       lua_pop(L, 1);  // [... [, userdata] [, exception_handler]]
     }
 
+    if (target == ENCODE_FILE)
+      return encoder.Dump(L, valuearg, error_handler_idx, userdata_idx);
+    else if (target == ENCODE_SINK)
+      return encoder.EncodeTo(L, valuearg, 1, error_handler_idx, userdata_idx);
+
     // After encoding: [... [, userdata] [, exception_handler], encoded_string]
     // ldo.moveresults  will cleanup the intermediate arguments.
     if (encoder.flags & JSON_PRETTY_PRINT) {
@@ -802,16 +1837,402 @@ LUALIB_API int rapidjson_encode (lua_State *L) {
     lua_settop(L, top);
     has_error_string = LuaTypeException::_lua_pushstring(L, e.what());
   }
-  catch (...) {
-    lua_settop(L, top);
+  catch (...) {
+    lua_settop(L, top);
+  }
+
+  if (!has_error_string)
+    lua_pushstring(L, "Unexpected exception");
+#if defined(LUA_RAPIDJSON_ANCHOR)
+  eud->CleanupUserdata(L, userdata_idx);  // Release the shared output buffer now rather than on __gc
+#endif
+  return lua_error(L);
+}
+
+LUALIB_API int rapidjson_encode (lua_State *L) {
+  return encode(L, ENCODE_STRING);
+}
+
+LUALIB_API int rapidjson_dump (lua_State *L) {
+  return encode(L, ENCODE_FILE);
+}
+
+LUALIB_API int rapidjson_encode_to (lua_State *L) {
+  return encode(L, ENCODE_SINK);
+}
+
+LUALIB_API int rapidjson_keyorder (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+
+  const int top = lua_gettop(L);
+  try {
+    LuaSAX::KeyOrder::Compile(L, 1);
+    return 1;
+  }
+  catch (const LuaTypeException &e) {
+    if (!e.pushError(L, top))
+      lua_pushstring(L, "Unexpected exception");
+  }
+  catch (const std::exception &e) {
+    lua_settop(L, top);
+    if (!LuaTypeException::_lua_pushstring(L, e.what()))
+      lua_pushstring(L, "Unexpected exception");
+  }
+  return lua_error(L);
+}
+
+LUALIB_API int rapidjson_raw (lua_State *L) {
+  if (LuaSAX::RawFragment::Test(L, 1) != RAPIDJSON_NULLPTR) {
+    lua_settop(L, 1);
+    return 1;
+  }
+
+  size_t len = 0;
+  const char *s = luaL_checklstring(L, 1, &len);
+  LuaSAX::RawFragment::Create(L, s, len);
+  return 1;
+}
+
+/*
+** Replace the table of memoized encodings (see LuaSAX::Encoder::encodeMemoized)
+** with an empty one; weak-keyed by the memoized tables.
+*/
+static void memo_create (lua_State *L) {
+  lua_newtable(L);  // [..., memo]
+  lua_createtable(L, 0, 1);  // [..., memo, metatable]
+  lua_pushliteral(L, "k");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);  // [..., memo]
+  lua_setfield(L, LUA_REGISTRYINDEX, LUA_RAPIDJSON_REG_MEMO);  // [...]
+}
+
+LUALIB_API int rapidjson_invalidate (lua_State *L) {
+  if (lua_isnoneornil(L, 1)) {
+    memo_create(L);
+    return 0;
+  }
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_getfield(L, LUA_REGISTRYINDEX, LUA_RAPIDJSON_REG_MEMO);  // [..., memo]
+  lua_pushvalue(L, 1);
+  lua_pushnil(L);
+  lua_rawset(L, -3);
+  return 0;
+}
+
+static int raw_tostring (lua_State *L) {
+  const LuaSAX::RawFragment *raw = reinterpret_cast<LuaSAX::RawFragment *>(luaL_checkudata(L, 1, LUA_RAPIDJSON_REG_RAW));
+  lua_pushlstring(L, raw->Data(), raw->length);
+  return 1;
+}
+
+/*
+** {==================================================================
+** Parse cache
+** ===================================================================
+*/
+
+/* Parse cache table: statistics, the hash -> entry map, and the LRU list */
+#define LUA_RAPIDJSON_CACHE_HITS 1
+#define LUA_RAPIDJSON_CACHE_MISSES 2
+#define LUA_RAPIDJSON_CACHE_EVICTIONS 3
+#define LUA_RAPIDJSON_CACHE_COUNT 4  // Number of entries
+#define LUA_RAPIDJSON_CACHE_SIZE 5  // Sum of the input lengths of all entries
+#define LUA_RAPIDJSON_CACHE_NEWEST 6  // Most recently used entry
+#define LUA_RAPIDJSON_CACHE_OLDEST 7  // Least recently used entry
+#define LUA_RAPIDJSON_CACHE_MAP 8
+
+/* Cache entry: { input, value, position, hash, newer entry, older entry } */
+#define LUA_RAPIDJSON_ENTRY_INPUT 1
+#define LUA_RAPIDJSON_ENTRY_VALUE 2
+#define LUA_RAPIDJSON_ENTRY_POSITION 3
+#define LUA_RAPIDJSON_ENTRY_HASH 4
+#define LUA_RAPIDJSON_ENTRY_NEWER 5
+#define LUA_RAPIDJSON_ENTRY_OLDER 6
+
+/* Push the parse cache table, creating it if necessary */
+static void cache_push (lua_State *L) {
+  if (!lua_rapidjson_getsubtable(L, LUA_REGISTRYINDEX, LUA_RAPIDJSON_CACHE)) {  // [..., cache]
+    lua_createtable(L, 0, 0);
+    json_conf_setfield(L, -2, LUA_RAPIDJSON_CACHE_MAP);
+  }
+}
+
+/* Drop all cached values, e.g., after a decoding option has changed */
+static void cache_flush (lua_State *L) {
+  json_getfield(L, LUA_REGISTRYINDEX, LUA_RAPIDJSON_CACHE);  // [..., cache]
+  if (lua_istable(L, -1)) {
+    lua_createtable(L, 0, 0);
+    json_conf_setfield(L, -2, LUA_RAPIDJSON_CACHE_MAP);
+    lua_pushnil(L);
+    json_conf_setfield(L, -2, LUA_RAPIDJSON_CACHE_NEWEST);
+    lua_pushnil(L);
+    json_conf_setfield(L, -2, LUA_RAPIDJSON_CACHE_OLDEST);
+    seti(L, -1, LUA_RAPIDJSON_CACHE_COUNT, 0);
+    seti(L, -1, LUA_RAPIDJSON_CACHE_SIZE, 0);
+  }
+  lua_pop(L, 1);
+}
+
+/*
+** Push the read-only proxy of the value at (absolute) "idx", if it is a table
+** not yet frozen: its proxy is recorded in "seen" and the table is queued (in
+** "queue") to have its fields frozen. Other values, including the proxies of
+** hash_cons "readonly", are pushed as-is.
+*/
+static void cache_freeze_value (lua_State *L, int idx, int seen, int queue, int &pending) {
+  if (!lua_istable(L, idx)) {
+    lua_pushvalue(L, idx);
+    return;
+  }
+
+  json_checkstack(L, 3);
+  lua_pushvalue(L, idx);
+  lua_rawget(L, seen);  // [..., proxy]
+  if (!lua_isnil(L, -1))
+    return;
+  lua_pop(L, 1);
+
+  bool is_array = false;
+  if (luaL_getmetafield(L, idx, "__metatable") != LUA_METAFIELD_FAIL) {  // [..., protected]
+    const bool proxy = lua_type(L, -1) == LUA_TSTRING && strcmp(lua_tostring(L, -1), LUA_RAPIDJSON_META_READONLY) == 0;
+    lua_pop(L, 1);
+    if (proxy) {
+      lua_pushvalue(L, idx);
+      return;
+    }
+  }
+  if (luaL_getmetafield(L, idx, LUA_RAPIDJSON_META_TYPE) != LUA_METAFIELD_FAIL) {  // [..., jsontype]
+    is_array = lua_type(L, -1) == LUA_TSTRING && strcmp(lua_tostring(L, -1), LUA_RAPIDJSON_META_TYPE_ARRAY) == 0;
+    lua_pop(L, 1);
+  }
+
+  lua_pushvalue(L, idx);
+  lua_rawseti(L, queue, ++pending);
+  lua_pushvalue(L, idx);
+  LuaSAX::push_readonly(L, is_array);  // [..., proxy]
+  lua_pushvalue(L, idx);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, seen);  // seen[table] = proxy
+}
+
+/*
+** Replace the decoded value on top of the stack with a read-only view of it
+** (see hash_cons "readonly"), shared by all hits: each table, nested ones
+** included, is replaced by its proxy. Tables are frozen breadth-first rather
+** than recursively, as they may be nested arbitrarily deep; a table shared
+** within the value is given a single proxy.
+*/
+static void cache_freeze (lua_State *L) {
+  const int top = lua_gettop(L);
+  if (!lua_istable(L, top))
+    return;
+
+  json_checkstack(L, 8);
+  lua_createtable(L, 0, 0);  // [..., value, seen]
+  lua_createtable(L, 0, 0);  // [..., value, seen, queue]
+  int pending = 0;
+  cache_freeze_value(L, top, top + 1, top + 2, pending);  // [..., value, seen, queue, proxy]
+  while (pending > 0) {
+    lua_rawgeti(L, top + 2, pending);  // [..., value, seen, queue, proxy, table]
+    lua_pushnil(L);
+    lua_rawseti(L, top + 2, pending--);
+
+    lua_pushnil(L);
+    while (lua_next(L, top + 4)) {  // [..., table, key, value]
+      if (lua_istable(L, -1)) {
+        cache_freeze_value(L, top + 6, top + 1, top + 2, pending);  // [..., table, key, value, proxy]
+        lua_pushvalue(L, top + 5);
+        lua_insert(L, -2);  // [..., table, key, value, key, proxy]
+        lua_rawset(L, top + 4);  // Assigning an existing field does not disturb lua_next.
+      }
+      lua_pop(L, 1);  // [..., table, key]
+    }
+    lua_pop(L, 1);  // [..., value, seen, queue, proxy]
+  }
+
+  lua_replace(L, top);
+  lua_settop(L, top);  // [..., proxy]
+}
+
+/* Remove the (absolute) "entry" of the cache at "idx" from the LRU list */
+static void cache_unlink (lua_State *L, int idx, int entry) {
+  json_checkstack(L, 3);
+  json_conf_getfield(L, entry, LUA_RAPIDJSON_ENTRY_NEWER);  // [..., newer]
+  json_conf_getfield(L, entry, LUA_RAPIDJSON_ENTRY_OLDER);  // [..., newer, older]
+
+  lua_pushvalue(L, -1);
+  if (lua_istable(L, -3))
+    json_conf_setfield(L, -3, LUA_RAPIDJSON_ENTRY_OLDER);  // newer.older = older
+  else
+    json_conf_setfield(L, idx, LUA_RAPIDJSON_CACHE_NEWEST);
+
+  lua_pushvalue(L, -2);
+  if (lua_istable(L, -2))
+    json_conf_setfield(L, -2, LUA_RAPIDJSON_ENTRY_NEWER);  // older.newer = newer
+  else
+    json_conf_setfield(L, idx, LUA_RAPIDJSON_CACHE_OLDEST);
+  lua_pop(L, 2);
+
+  lua_pushnil(L);
+  json_conf_setfield(L, entry, LUA_RAPIDJSON_ENTRY_NEWER);
+  lua_pushnil(L);
+  json_conf_setfield(L, entry, LUA_RAPIDJSON_ENTRY_OLDER);
+}
+
+/* Make the (absolute, unlinked) "entry" the most recently used of the cache at "idx" */
+static void cache_link (lua_State *L, int idx, int entry) {
+  json_checkstack(L, 2);
+  json_conf_getfield(L, idx, LUA_RAPIDJSON_CACHE_NEWEST);  // [..., newest]
+  lua_pushvalue(L, entry);
+  if (lua_istable(L, -2))
+    json_conf_setfield(L, -2, LUA_RAPIDJSON_ENTRY_NEWER);  // newest.newer = entry
+  else
+    json_conf_setfield(L, idx, LUA_RAPIDJSON_CACHE_OLDEST);
+  json_conf_setfield(L, entry, LUA_RAPIDJSON_ENTRY_OLDER);  // entry.older = newest
+
+  lua_pushvalue(L, entry);
+  json_conf_setfield(L, idx, LUA_RAPIDJSON_CACHE_NEWEST);
+}
+
+/* Remove the (absolute) "entry" from the cache at "idx" and its "map" */
+static void cache_remove (lua_State *L, int idx, int map, int entry) {
+  cache_unlink(L, idx, entry);
+
+  json_checkstack(L, 2);
+  json_conf_getfield(L, entry, LUA_RAPIDJSON_ENTRY_HASH);  // [..., hash]
+  lua_pushnil(L);
+  lua_rawset(L, map);  // [...]
+
+  size_t len = 0;
+  json_conf_getfield(L, entry, LUA_RAPIDJSON_ENTRY_INPUT);  // [..., input]
+  lua_tolstring(L, -1, &len);
+  lua_pop(L, 1);
+
+  const lua_Integer length = static_cast<lua_Integer>(len);
+  seti(L, idx, LUA_RAPIDJSON_CACHE_COUNT, geti(L, idx, LUA_RAPIDJSON_CACHE_COUNT, 1) - 1);
+  seti(L, idx, LUA_RAPIDJSON_CACHE_SIZE, geti(L, idx, LUA_RAPIDJSON_CACHE_SIZE, length) - length);
+}
+
+/* Remove the least recently used entry from the cache at (absolute) "idx" */
+static void cache_evict (lua_State *L, int idx, int map) {
+  json_checkstack(L, 1);
+  json_conf_getfield(L, idx, LUA_RAPIDJSON_CACHE_OLDEST);  // [..., entry]
+  if (lua_istable(L, -1)) {
+    cache_remove(L, idx, map, lua_gettop(L));
+    seti(L, idx, LUA_RAPIDJSON_CACHE_EVICTIONS, geti(L, idx, LUA_RAPIDJSON_CACHE_EVICTIONS, 0) + 1);
+  }
+  lua_pop(L, 1);
+}
+
+/*
+** Lookup the decoding of the string at "input". On a hit, the (read-only)
+** cached value and its position are pushed onto the stack. Otherwise, the cache table
+** and the hash of the input are left on the stack for cache_insert.
+*/
+static bool cache_lookup (lua_State *L, int input, const char *contents, size_t len) {
+  const int top = lua_gettop(L);
+  json_checkstack(L, 6);
+  cache_push(L);  // [..., cache]
+  lua_pushnumber(L, static_cast<lua_Number>(LuaSAX::hash_bytes(contents, len) >> 11));  // [..., cache, hash]
+
+  json_conf_getfield(L, -2, LUA_RAPIDJSON_CACHE_MAP);  // [..., cache, hash, map]
+  lua_pushvalue(L, -2);
+  lua_rawget(L, -2);  // [..., cache, hash, map, entry]
+  if (lua_istable(L, -1)) {
+    json_conf_getfield(L, -1, LUA_RAPIDJSON_ENTRY_INPUT);  // [..., cache, hash, map, entry, input]
+
+    size_t cached_len = 0;
+    const char *cached = lua_tolstring(L, -1, &cached_len);
+    if (lua_rawequal(L, -1, input) || (cached_len == len && memcmp(cached, contents, len) == 0)) {
+      cache_unlink(L, top + 1, top + 4);
+      cache_link(L, top + 1, top + 4);
+      seti(L, top + 1, LUA_RAPIDJSON_CACHE_HITS, geti(L, top + 1, LUA_RAPIDJSON_CACHE_HITS, 0) + 1);
+
+      json_conf_getfield(L, top + 4, LUA_RAPIDJSON_ENTRY_VALUE);  // [..., cache, hash, map, entry, input, value]
+      lua_replace(L, top + 1);  // [..., value, hash, map, entry, input]
+      json_conf_getfield(L, top + 4, LUA_RAPIDJSON_ENTRY_POSITION);
+      lua_replace(L, top + 2);  // [..., value, position, map, entry, input]
+      lua_settop(L, top + 2);
+      return true;
+    }
+    lua_pop(L, 1);  // On collision, the entry is replaced.
+  }
+  lua_pop(L, 2);  // [..., cache, hash]
+
+  seti(L, -2, LUA_RAPIDJSON_CACHE_MISSES, geti(L, -2, LUA_RAPIDJSON_CACHE_MISSES, 0) + 1);
+  return false;
+}
+
+/*
+** Insert the decoded value on top of the stack into the cache, replacing it
+** with its read-only view (see cache_freeze). The cache table and input hash
+** (from cache_lookup) are at "idx" and "idx + 1".
+*/
+static void cache_insert (lua_State *L, int idx, int input, size_t len, size_t position, lua_Integer max_entries, lua_Integer max_bytes) {
+  const lua_Integer length = static_cast<lua_Integer>(len);
+  if (length > max_bytes)
+    return;
+
+  cache_freeze(L);
+  const int value = lua_gettop(L);
+  json_checkstack(L, 4);
+  json_conf_getfield(L, idx, LUA_RAPIDJSON_CACHE_MAP);  // [..., value, map]
+  lua_pushvalue(L, idx + 1);
+  lua_rawget(L, -2);  // [..., value, map, previous]
+  if (lua_istable(L, -1))  // Replace the colliding entry
+    cache_remove(L, idx, value + 1, value + 2);
+  lua_pop(L, 1);  // [..., value, map]
+
+  while (geti(L, idx, LUA_RAPIDJSON_CACHE_COUNT, 0) >= max_entries
+         || geti(L, idx, LUA_RAPIDJSON_CACHE_SIZE, 0) + length > max_bytes) {
+    if (geti(L, idx, LUA_RAPIDJSON_CACHE_COUNT, 0) == 0)
+      break;
+    cache_evict(L, idx, value + 1);
   }
 
-  if (!has_error_string)
-    lua_pushstring(L, "Unexpected exception");
-  return lua_error(L);
+  lua_createtable(L, LUA_RAPIDJSON_ENTRY_OLDER, 0);  // [..., value, map, entry]
+  lua_pushvalue(L, input);
+  json_conf_setfield(L, -2, LUA_RAPIDJSON_ENTRY_INPUT);
+  lua_pushvalue(L, value);
+  json_conf_setfield(L, -2, LUA_RAPIDJSON_ENTRY_VALUE);
+  seti(L, -1, LUA_RAPIDJSON_ENTRY_POSITION, 1 + static_cast<lua_Integer>(position));
+  lua_pushvalue(L, idx + 1);
+  json_conf_setfield(L, -2, LUA_RAPIDJSON_ENTRY_HASH);
+  cache_link(L, idx, value + 2);
+
+  lua_pushvalue(L, idx + 1);
+  lua_pushvalue(L, value + 2);
+  lua_rawset(L, value + 1);  // map[hash] = entry
+  lua_settop(L, value);  // [..., value]
+
+  seti(L, idx, LUA_RAPIDJSON_CACHE_COUNT, geti(L, idx, LUA_RAPIDJSON_CACHE_COUNT, 0) + 1);
+  seti(L, idx, LUA_RAPIDJSON_CACHE_SIZE, geti(L, idx, LUA_RAPIDJSON_CACHE_SIZE, 0) + length);
 }
 
-LUALIB_API int rapidjson_decode (lua_State *L) {
+LUALIB_API int rapidjson_cachestats (lua_State *L) {
+  cache_push(L);  // [..., cache]
+  lua_createtable(L, 0, 5);  // [..., cache, stats]
+  lua_pushinteger(L, geti(L, -2, LUA_RAPIDJSON_CACHE_HITS, 0));
+  lua_setfield(L, -2, "hits");
+  lua_pushinteger(L, geti(L, -2, LUA_RAPIDJSON_CACHE_MISSES, 0));
+  lua_setfield(L, -2, "misses");
+  lua_pushinteger(L, geti(L, -2, LUA_RAPIDJSON_CACHE_EVICTIONS, 0));
+  lua_setfield(L, -2, "evictions");
+  lua_pushinteger(L, geti(L, -2, LUA_RAPIDJSON_CACHE_COUNT, 0));
+  lua_setfield(L, -2, "entries");
+  lua_pushinteger(L, geti(L, -2, LUA_RAPIDJSON_CACHE_SIZE, 0));
+  lua_setfield(L, -2, "bytes");
+  return 1;
+}
+
+/* }================================================================== */
+
+/*
+** json.decode and json.load: "load" decodes the file name or file handle at the
+** first argument rather than a string.
+*/
+static int decode (lua_State *L, bool load) {
   int top = 0;  // Ensure lua_settop(L) still contains the userdata
   int userdata_idx = 0;  // Stack index of the anchored rapidjson userdata.
   int trailer = 0;  // First argument after the input string/length
@@ -820,17 +2241,31 @@ LUALIB_API int rapidjson_decode (lua_State *L) {
   size_t len = 0, position = 0;  // Length and offset of decoded string.
 
   /* Parse decoding configuration */
-  lua_rapidjson_getsubtable(L, LUA_REGISTRYINDEX, LUA_RAPIDJSON_REG);
-  const lua_Integer flags = geti(L, -1, LUA_RAPIDJSON_REG_FLAGS, JSON_DEFAULT);
-  const lua_Integer parsemode = geti(L, -1, LUA_RAPIDJSON_REG_PRESET, JSON_DECODE_DEFAULT);
-  lua_pop(L, 1);
+  JsonConfig local;
+  const JsonConfig &config = json_getconfig(L, local);
+  const lua_Integer flags = config.flags;
+  const lua_Integer parsemode = config.parsemode;
+  const lua_Integer cache_entries = config.cache_entries;
+  const lua_Integer cache_bytes = config.cache_bytes;
+
+#if LUA_RAPIDJSON_TINY_SIZE > 0
+  if (!load && lua_gettop(L) == 1 && lua_type(L, 1) == LUA_TSTRING && decode_is_tiny(config)) {
+    contents = lua_tolstring(L, 1, &len);
+    if (len > 0 && len <= LUA_RAPIDJSON_TINY_SIZE) {
+      const int results = decode_tiny(L, config, contents, len);
+      if (results >= 0)
+        return results;
+    }
+  }
+#endif
 
   /*
   ** Similar to dkjson, attempt to coerce non-string types to strings.
   ** luaL_checklstring should throw an error when not possible.
   */
-  trailer = 2;
-  switch (lua_type(L, 1)) {
+  trailer = load ? 1 : 2;
+  switch (load ? LUA_TNONE : lua_type(L, 1)) {
+    case LUA_TNONE:
     case LUA_TNIL: break;
     case LUA_TLIGHTUSERDATA: {
       luaL_checktype(L, 2, LUA_TNUMBER);
@@ -851,14 +2286,17 @@ LUALIB_API int rapidjson_decode (lua_State *L) {
   int objectarg = -1;  // Stack index of "object" metatable
   int arrayarg = -1;  // Stack index of "array" metatable
 
-  position = luaL_optsizet(L, trailer, 1);
+  position = load ? 1 : luaL_optsizet(L, trailer, 1);
   nullarg = (lua_gettop(L) >= (trailer + 1)) ? (trailer + 1) : -1;
   objectarg = json_decoding_metatable(L, trailer + 2) ? (trailer + 2) : -1;
   arrayarg = json_decoding_metatable(L, trailer + 3) ? (trailer + 3) : -1;
   if (objectarg > 0 && arrayarg < 0 && lua_isnil(L, objectarg))
     arrayarg = objectarg;
 
-  if (len == 0) {  // Gracefully handle empty strings
+  if (load) {
+    // Files are read as they are decoded.
+  }
+  else if (len == 0) {  // Gracefully handle empty strings
     lua_pushnil(L);
     lua_pushinteger(L, 0);
     lua_pushfstring(L, "%s (%d)", GetParseError_En(ParseErrorCode::kParseErrorDocumentEmpty), 0);
@@ -868,6 +2306,42 @@ LUALIB_API int rapidjson_decode (lua_State *L) {
     return luaL_error(L, "invalid position");
   }
 
+  /* Complete strings decoded with the global configuration may be cached */
+  int cacheidx = -1;
+  if (cache_entries > 0 && !load && position == 1 && static_cast<lua_Integer>(len) <= cache_bytes
+      && (flags & JSON_TYPED_ARRAYS) == 0 && lua_type(L, 1) == LUA_TSTRING && nullarg < 0 && objectarg < 0 && arrayarg < 0) {
+    if (cache_lookup(L, 1, contents, len))
+      return 2;
+    cacheidx = lua_gettop(L) - 1;  // [..., cache, hash]
+  }
+
+  /* JSON pointer of the columnar array; anchored on the stack while decoding */
+  const char *columnar = RAPIDJSON_NULLPTR;
+  size_t columnar_len = 0;
+  if (flags & JSON_COLUMNAR) {
+    lua_rapidjson_getsubtable(L, LUA_REGISTRYINDEX, LUA_RAPIDJSON_REG);  // [..., reg]
+    json_conf_getfield(L, -1, LUA_RAPIDJSON_REG_COLUMNAR);  // [..., reg, pointer]
+    lua_remove(L, -2);  // [..., pointer]
+    if ((columnar = lua_tolstring(L, -1, &columnar_len)) == RAPIDJSON_NULLPTR)
+      columnar = "";
+  }
+
+  /* Structurally identical subtrees decoded so far: hash -> table */
+  int internarg = -1;
+  if (flags & JSON_HASH_CONS) {
+    lua_createtable(L, 0, 0);  // [..., intern]
+    internarg = lua_gettop(L);
+  }
+
+  /* Long strings decoded so far: hash -> string (Lua 5.1 interns all strings) */
+  int stringarg = -1;
+#if LUA_VERSION_NUM >= 502
+  if (flags & JSON_DEDUP_STRINGS) {
+    lua_createtable(L, 0, 0);  // [..., strings]
+    stringarg = lua_gettop(L);
+  }
+#endif
+
   /* Function has six potential parameters, setup decoder data after all have been parsed  */
 #if defined(LUA_RAPIDJSON_ANCHOR)
   DecoderData *dud = reinterpret_cast<DecoderData *>(json_newuserdata(L, sizeof(DecoderData)));  // [..., userdata]
@@ -880,6 +2354,16 @@ LUALIB_API int rapidjson_decode (lua_State *L) {
   top = lua_gettop(L);
 #endif
 
+  std::FILE *file = RAPIDJSON_NULLPTR;
+  bool owns_file = false;
+  if (load) {
+    file = json_checkfile(L, 1, "rb", owns_file);
+#if defined(LUA_RAPIDJSON_ANCHOR)
+    dud->file = file;
+    dud->owns_file = owns_file;
+#endif
+  }
+
   bool has_error_string = false;
   try {
     RAPIDJSON_ALLOCATOR_INIT(L, _allocator);
@@ -888,23 +2372,44 @@ LUALIB_API int rapidjson_decode (lua_State *L) {
     DecoderData &decoder = *dud;
 #else
     DecoderData decoder(&_allocator);
+    decoder.file = file;
+    decoder.owns_file = owns_file;
 #endif
     decoder.flags = flags;
     decoder.parsemode = parsemode;
-    const ParseResult r = decoder.Decode(L, userdata_idx, contents, len, position, nullarg, objectarg, arrayarg);
+    decoder.columnar = columnar;
+    decoder.columnar_len = columnar_len;
+
+    ParseResult r;
+    bool inflate_error = false;  // Compressed input is malformed
+    if (load)
+      r = decoder.DecodeFile(L, userdata_idx, position, inflate_error, nullarg, objectarg, arrayarg, internarg, stringarg);
+#if defined(LUA_RAPIDJSON_ZLIB)
+    else if (position == 1 && extend::IsCompressed(contents, len)) {
+      extend::InflateStream s(contents, len);
+      r = decoder.DecodeStream(L, userdata_idx, s, position, nullarg, objectarg, arrayarg, internarg, stringarg);
+      inflate_error = s.HasError();
+    }
+#endif
+    else
+      r = decoder.Decode(L, userdata_idx, contents, len, position, nullarg, objectarg, arrayarg, internarg, stringarg);
+
     if (r.IsError()) {
+      const char *msg = inflate_error ? "Invalid compressed data." : GetParseError_En(r.Code());
       lua_settop(L, top);
 #if defined(LUA_RAPIDJSON_EXPLICIT)
-      lua_pushfstring(L, "%s (%d)", GetParseError_En(r.Code()), r.Offset());
+      lua_pushfstring(L, "%s (%d)", msg, r.Offset());
       /* fall outside of try/catch */
 #else
       lua_pushnil(L);
       lua_pushinteger(L, static_cast<lua_Integer>(r.Offset()));
-      lua_pushfstring(L, "%s (%d)", GetParseError_En(r.Code()), r.Offset());
+      lua_pushfstring(L, "%s (%d)", msg, r.Offset());
       return 3;
 #endif
     }
     else {
+      if (cacheidx > 0)
+        cache_insert(L, cacheidx, 1, len, position, cache_entries, cache_bytes);
       lua_pushinteger(L, 1 + static_cast<lua_Integer>(position));
       return 2;
     }
@@ -936,6 +2441,113 @@ LUALIB_API int rapidjson_decode (lua_State *L) {
   return lua_error(L);
 }
 
+LUALIB_API int rapidjson_decode (lua_State *L) {
+  return decode(L, false);
+}
+
+LUALIB_API int rapidjson_load (lua_State *L) {
+  return decode(L, true);
+}
+
+LUALIB_API int rapidjson_query (lua_State *L) {
+  int top = 0;  // Ensure lua_settop(L) still contains the userdata
+  int userdata_idx = 0;  // Stack index of the anchored rapidjson userdata.
+  int resultarg = -1;  // Stack index of the result (or pending callback) table
+  int callbackarg = -1;  // Stack index of the result function
+
+  std::FILE *file = RAPIDJSON_NULLPTR;
+  bool owns_file = false;
+
+  size_t path_len = 0;
+  const char *path_str = luaL_checklstring(L, 2, &path_len);
+  if (!lua_isnoneornil(L, 3)) {
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+    callbackarg = 3;
+  }
+
+  LuaSAX::JSONPath path;
+  const char *path_error = path.Compile(path_str, path_len);
+  if (path_error != RAPIDJSON_NULLPTR)
+    return luaL_argerror(L, 2, path_error);
+
+  lua_rapidjson_getsubtable(L, LUA_REGISTRYINDEX, LUA_RAPIDJSON_REG);
+  const lua_Integer flags = geti(L, -1, LUA_RAPIDJSON_REG_FLAGS, JSON_DEFAULT);
+  lua_pop(L, 1);
+
+  lua_settop(L, 3);
+  lua_createtable(L, 0, 0);  // [..., results]; pending matches with a callback
+  resultarg = lua_gettop(L);
+
+#if defined(LUA_RAPIDJSON_ANCHOR)
+  QueryData *qud = reinterpret_cast<QueryData *>(json_newuserdata(L, sizeof(QueryData)));  // [..., userdata]
+  qud->Preinitialize();
+
+  top = userdata_idx = lua_gettop(L);
+  luaL_getmetatable(L, LUA_RAPIDJSON_QUERY);  // [..., userdata, metatable]
+  lua_setmetatable(L, -2);  // [..., userdata]
+#else
+  top = lua_gettop(L);
+#endif
+
+  file = json_checkfile(L, 1, "rb", owns_file);  // A file name or an open file handle
+#if defined(LUA_RAPIDJSON_ANCHOR)
+  qud->file = file;
+  qud->owns_file = owns_file;
+#endif
+
+  bool has_error_string = false;
+  try {
+    RAPIDJSON_ALLOCATOR_INIT(L, _allocator);
+#if defined(LUA_RAPIDJSON_ANCHOR)
+    qud->InitializeInPlace(&_allocator);
+    QueryData &query = *qud;
+#else
+    QueryData query(&_allocator);
+    query.file = file;
+    query.owns_file = owns_file;
+#endif
+
+    lua_Integer count = 0;
+    const ParseResult r = query.Query(L, userdata_idx, path, flags, resultarg, callbackarg, count);
+    if (r.IsError()) {
+      lua_settop(L, top);
+#if defined(LUA_RAPIDJSON_EXPLICIT)
+      lua_pushfstring(L, "%s (%d)", GetParseError_En(r.Code()), r.Offset());
+      /* fall outside of try/catch */
+#else
+      lua_pushnil(L);
+      lua_pushinteger(L, static_cast<lua_Integer>(r.Offset()));
+      lua_pushfstring(L, "%s (%d)", GetParseError_En(r.Code()), r.Offset());
+      return 3;
+#endif
+    }
+    else {
+      if (callbackarg < 0)
+        lua_pushvalue(L, resultarg);
+      else
+        lua_pushinteger(L, count);
+      return 1;
+    }
+  }
+  catch (const LuaCallException &e) {
+    has_error_string = e.pushError(L, top);
+  }
+  catch (const LuaTypeException &e) {
+    has_error_string = e.pushError(L, top);
+  }
+  catch (const std::exception &e) {
+    lua_settop(L, top);
+    has_error_string = LuaTypeException::_lua_pushstring(L, e.what());
+  }
+  catch (...) {
+    lua_settop(L, top);
+  }
+
+  if (!has_error_string)
+    lua_pushstring(L, "Unexpected exception");
+  return lua_error(L);
+}
+
 LUALIB_API int rapidjson_setoption (lua_State *L) {
   lua_Integer v = 0;
   const lua_Integer opt = option_keys_num[luaL_checkoption(L, 1, RAPIDJSON_NULLPTR, option_keys)];
@@ -954,7 +2566,11 @@ LUALIB_API int rapidjson_setoption (lua_State *L) {
     case JSON_LUA_GRISU:
     case JSON_ARRAY_SINGLE_LINE:
     case JSON_ARRAY_EMPTY:
-    case JSON_ARRAY_WITH_HOLES: {
+    case JSON_ARRAY_WITH_HOLES:
+    case JSON_TRUST_JSONTYPE:
+    case JSON_TYPED_ARRAYS:
+    case JSON_DEDUP_STRINGS:
+    case JSON_PRESERVE_ORDER: {
       v = geti(L, -1, LUA_RAPIDJSON_REG_FLAGS, JSON_DEFAULT);
       luaL_checktype(L, 2, LUA_TBOOLEAN);
       seti(L, -1, LUA_RAPIDJSON_REG_FLAGS, lua_toboolean(L, 2) ? (v | opt) : (v & ~opt));
@@ -976,14 +2592,69 @@ LUALIB_API int rapidjson_setoption (lua_State *L) {
       if ((v = luaL_checkinteger(L, 2)) >= 0)
         seti(L, -1, LUA_RAPIDJSON_REG_MAXDEC, v);
       break;
+    case JSON_ENCODER_FIXED:
+      if ((v = luaL_checkinteger(L, 2)) >= 0 && v <= LUA_RAPIDJSON_FIXED_MAX)
+        seti(L, -1, LUA_RAPIDJSON_REG_FIXED, v);
+      break;
     case JSON_DECODER_PRESET:
       v = decode_presets_num[luaL_optcheckoption(L, 2, RAPIDJSON_NULLPTR, decode_presets, 0)];
       seti(L, -1, LUA_RAPIDJSON_REG_PRESET, v);
       break;
+    case JSON_DECODER_CACHE:
+      if ((v = luaL_checkinteger(L, 2)) >= 0)
+        seti(L, -1, LUA_RAPIDJSON_REG_CACHE_ENTRIES, v);
+      break;
+    case JSON_DECODER_CACHE_BYTES:
+      if ((v = luaL_checkinteger(L, 2)) >= 0)
+        seti(L, -1, LUA_RAPIDJSON_REG_CACHE_BYTES, v);
+      break;
+    case JSON_COLUMNAR: {  // true (root array), false, or a JSON pointer
+      v = geti(L, -1, LUA_RAPIDJSON_REG_FLAGS, JSON_DEFAULT);
+      if (lua_type(L, 2) == LUA_TSTRING) {
+        const char *pointer = lua_tostring(L, 2);
+        luaL_argcheck(L, pointer[0] == '\0' || pointer[0] == '/', 2, "invalid JSON pointer");
+        lua_pushvalue(L, 2);
+      }
+      else {
+        luaL_checktype(L, 2, LUA_TBOOLEAN);
+        if (lua_toboolean(L, 2))
+          lua_pushliteral(L, "");
+        else
+          lua_pushnil(L);
+      }
+      json_conf_setfield(L, -2, LUA_RAPIDJSON_REG_COLUMNAR);
+      seti(L, -1, LUA_RAPIDJSON_REG_FLAGS, lua_toboolean(L, 2) ? (v | opt) : (v & ~opt));
+      break;
+    }
+    case JSON_HASH_CONS: {  // true, false, or "readonly"
+      v = geti(L, -1, LUA_RAPIDJSON_REG_FLAGS, JSON_DEFAULT) & ~(JSON_HASH_CONS | JSON_HASH_CONS_READONLY);
+      if (lua_type(L, 2) == LUA_TSTRING) {
+        luaL_argcheck(L, strcmp(lua_tostring(L, 2), "readonly") == 0, 2, "invalid hash_cons mode");
+        v |= JSON_HASH_CONS | JSON_HASH_CONS_READONLY;
+      }
+      else {
+        luaL_checktype(L, 2, LUA_TBOOLEAN);
+        if (lua_toboolean(L, 2))
+          v |= JSON_HASH_CONS;
+      }
+      seti(L, -1, LUA_RAPIDJSON_REG_FLAGS, v);
+      break;
+    }
+    case JSON_ENCODER_COMPRESS:  // Encoder state options apply to a single call
+    case JSON_ENCODER_CHUNK:
+    case JSON_ENCODER_THREADS:
+      return luaL_argerror(L, 1, "option is only valid in the encoder state");
     default:
       break;
   }
-  lua_pop(L, 1);
+
+  json_conf_getfield(L, -1, LUA_RAPIDJSON_REG_CONFIG);  // [..., reg, config]
+  JsonConfig *config = reinterpret_cast<JsonConfig *>(lua_touserdata(L, -1));
+  if (config != RAPIDJSON_NULLPTR)
+    config->Read(L, -2);
+  lua_pop(L, 2);
+
+  cache_flush(L);  // Cached values may no longer match the configuration.
   return 0;
 }
 
@@ -1005,6 +2676,10 @@ LUALIB_API int rapidjson_getoption (lua_State *L) {
     case JSON_ARRAY_SINGLE_LINE:
     case JSON_ARRAY_EMPTY:
     case JSON_ARRAY_WITH_HOLES:
+    case JSON_TRUST_JSONTYPE:
+    case JSON_TYPED_ARRAYS:
+    case JSON_DEDUP_STRINGS:
+    case JSON_PRESERVE_ORDER:
       v = geti(L, -1, LUA_RAPIDJSON_REG_FLAGS, JSON_DEFAULT);
       lua_pushboolean(L, (v & opt) != 0);  // [..., reg, flag]
       break;
@@ -1021,9 +2696,35 @@ LUALIB_API int rapidjson_getoption (lua_State *L) {
       v = geti(L, -1, LUA_RAPIDJSON_REG_MAXDEC, Writer<StringBuffer>::kDefaultMaxDecimalPlaces);
       lua_pushinteger(L, v);  // [..., reg, decimals]
       break;
+    case JSON_ENCODER_FIXED:
+      lua_pushinteger(L, geti(L, -1, LUA_RAPIDJSON_REG_FIXED, 0));  // [..., reg, fixed]
+      break;
+    case JSON_COLUMNAR: {  // Returns the JSON pointer or a boolean for the root array
+      size_t pointer_len = 0;
+      v = geti(L, -1, LUA_RAPIDJSON_REG_FLAGS, JSON_DEFAULT);
+      json_conf_getfield(L, -1, LUA_RAPIDJSON_REG_COLUMNAR);  // [..., reg, pointer]
+      if (!(v & opt) || lua_tolstring(L, -1, &pointer_len) == RAPIDJSON_NULLPTR || pointer_len == 0) {
+        lua_pop(L, 1);
+        lua_pushboolean(L, (v & opt) != 0);  // [..., reg, flag]
+      }
+      break;
+    }
+    case JSON_HASH_CONS:
+      v = geti(L, -1, LUA_RAPIDJSON_REG_FLAGS, JSON_DEFAULT);
+      if (v & JSON_HASH_CONS_READONLY)
+        lua_pushliteral(L, "readonly");  // [..., reg, mode]
+      else
+        lua_pushboolean(L, (v & opt) != 0);  // [..., reg, flag]
+      break;
+    case JSON_DECODER_CACHE:
+      lua_pushinteger(L, geti(L, -1, LUA_RAPIDJSON_REG_CACHE_ENTRIES, 0));  // [..., reg, entries]
+      break;
+    case JSON_DECODER_CACHE_BYTES:
+      lua_pushinteger(L, geti(L, -1, LUA_RAPIDJSON_REG_CACHE_BYTES, LUA_RAPIDJSON_CACHE_BYTES));  // [..., reg, bytes]
+      break;
     case JSON_DECODER_PRESET: {
       v = geti(L, -1, LUA_RAPIDJSON_REG_PRESET, JSON_DECODE_DEFAULT);
-      if (JSON_DECODE_DEFAULT <= v && v <= JSON_DECODE_EXTENDED)
+      if (JSON_DECODE_DEFAULT <= v && v <= JSON_DECODE_STRUCTURAL)
         lua_pushstring(L, decode_presets[v]);  // [..., reg, preset]
       else
         lua_pushnil(L);
@@ -1061,6 +2762,204 @@ LUALIB_API int rapidjson_isarray (lua_State *L) {
   return 1;
 }
 
+/*
+** {==================================================================
+** TypedArray
+** ===================================================================
+*/
+
+/* Convert the argument to a (zero-based) TypedArray offset; false if invalid. */
+static bool typed_array_offset (lua_State *L, int arg, const LuaSAX::TypedArray *ta, size_t *offset) {
+  if (json_isinteger(L, arg)) {
+    const lua_Integer i = lua_tointeger(L, arg);
+    if (i >= 1 && static_cast<size_t>(i) <= ta->length) {
+      *offset = static_cast<size_t>(i - 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+static int typed_array_index (lua_State *L) {
+  size_t offset = 0;
+  const LuaSAX::TypedArray *ta = reinterpret_cast<LuaSAX::TypedArray *>(luaL_checkudata(L, 1, LUA_RAPIDJSON_REG_TYPED_ARRAY));
+  if (typed_array_offset(L, 2, ta, &offset))
+    ta->Push(L, offset);
+  else
+    lua_pushnil(L);
+  return 1;
+}
+
+static int typed_array_newindex (lua_State *L) {
+  size_t offset = 0;
+  LuaSAX::TypedArray *ta = reinterpret_cast<LuaSAX::TypedArray *>(luaL_checkudata(L, 1, LUA_RAPIDJSON_REG_TYPED_ARRAY));
+  if (!typed_array_offset(L, 2, ta, &offset))
+    return luaL_argerror(L, 2, "index out of range");
+
+  if (ta->is_integer) {
+    if (!json_isinteger(L, 3))
+      return luaL_argerror(L, 3, "integer expected");
+    ta->Data()[offset].i = lua_tointeger(L, 3);
+  }
+  else
+    ta->Data()[offset].n = luaL_checknumber(L, 3);
+  return 0;
+}
+
+static int typed_array_len (lua_State *L) {
+  const LuaSAX::TypedArray *ta = reinterpret_cast<LuaSAX::TypedArray *>(luaL_checkudata(L, 1, LUA_RAPIDJSON_REG_TYPED_ARRAY));
+  lua_pushinteger(L, static_cast<lua_Integer>(ta->length));
+  return 1;
+}
+
+static int typed_array_next (lua_State *L) {
+  const LuaSAX::TypedArray *ta = reinterpret_cast<LuaSAX::TypedArray *>(luaL_checkudata(L, 1, LUA_RAPIDJSON_REG_TYPED_ARRAY));
+  const lua_Integer i = lua_isnoneornil(L, 2) ? 1 : (luaL_checkinteger(L, 2) + 1);
+  if (i >= 1 && static_cast<size_t>(i) <= ta->length) {
+    lua_pushinteger(L, i);
+    ta->Push(L, static_cast<size_t>(i - 1));
+    return 2;
+  }
+  return 0;
+}
+
+static int typed_array_pairs (lua_State *L) {
+  luaL_checkudata(L, 1, LUA_RAPIDJSON_REG_TYPED_ARRAY);
+  lua_pushcfunction(L, typed_array_next);
+  lua_pushvalue(L, 1);
+  lua_pushnil(L);
+  return 3;
+}
+
+static void typed_array_create_meta (lua_State *L) {
+  static const luaL_Reg typed_array_meta[] = {
+    { "__index", typed_array_index },
+    { "__newindex", typed_array_newindex },
+    { "__len", typed_array_len },
+    { "__pairs", typed_array_pairs },
+  #if LUA_VERSION_NUM == 502
+    { "__ipairs", typed_array_pairs },
+  #endif
+    { RAPIDJSON_NULLPTR, RAPIDJSON_NULLPTR }
+  };
+
+  if (luaL_newmetatable(L, LUA_RAPIDJSON_REG_TYPED_ARRAY)) {
+#if LUA_VERSION_NUM == 501
+    luaL_register(L, RAPIDJSON_NULLPTR, typed_array_meta);
+#else
+    luaL_setfuncs(L, typed_array_meta, 0);
+#endif
+    lua_pushstring(L, LUA_RAPIDJSON_META_TYPE_ARRAY);
+    lua_setfield(L, -2, LUA_RAPIDJSON_META_TYPE);
+  }
+  lua_pop(L, 1);
+}
+
+/* }================================================================== */
+
+/*
+** {==================================================================
+** Hash-consing
+** ===================================================================
+*/
+
+static int readonly_newindex (lua_State *L) {
+  return luaL_error(L, "attempt to modify a shared (read-only) table");
+}
+
+/* Push the table guarded by the read-only proxy at "idx" */
+static void readonly_pushtarget (lua_State *L, int idx) {
+  json_checkstack(L, 2);
+  if (!lua_getmetatable(L, idx)) {
+    lua_pushnil(L);
+    return;
+  }
+  lua_pushliteral(L, "__index");
+  lua_rawget(L, -2);  // [..., meta, target]
+  lua_remove(L, -2);  // [..., target]
+}
+
+static int readonly_len (lua_State *L) {
+  readonly_pushtarget(L, 1);
+  luaL_checktype(L, -1, LUA_TTABLE);
+#if LUA_VERSION_NUM >= 502
+  lua_pushinteger(L, static_cast<lua_Integer>(lua_rawlen(L, -1)));
+#else
+  lua_pushinteger(L, static_cast<lua_Integer>(lua_objlen(L, -1)));
+#endif
+  return 1;
+}
+
+static int readonly_next (lua_State *L) {
+  lua_settop(L, 2);
+  readonly_pushtarget(L, 1);  // [proxy, key, target]
+  luaL_checktype(L, 3, LUA_TTABLE);
+  lua_pushvalue(L, 2);  // [proxy, key, target, key]
+  if (lua_next(L, 3))
+    return 2;
+  lua_pushnil(L);
+  return 1;
+}
+
+static int readonly_pairs (lua_State *L) {
+  lua_pushcfunction(L, readonly_next);
+  lua_pushvalue(L, 1);
+  lua_pushnil(L);
+  return 3;
+}
+
+#if LUA_VERSION_NUM == 502
+static int readonly_inext (lua_State *L) {
+  const lua_Integer i = luaL_checkinteger(L, 2) + 1;
+  readonly_pushtarget(L, 1);
+  luaL_checktype(L, -1, LUA_TTABLE);
+  lua_pushinteger(L, i);
+  lua_rawgeti(L, -2, static_cast<int>(i));
+  return lua_isnil(L, -1) ? 1 : 2;
+}
+
+static int readonly_ipairs (lua_State *L) {
+  lua_pushcfunction(L, readonly_inext);
+  lua_pushvalue(L, 1);
+  lua_pushinteger(L, 0);
+  return 3;
+}
+#endif
+
+/*
+** Template of the metatables of the read-only proxies produced by the
+** "readonly" hash_cons mode (see LuaSAX::Decoder::PushReadOnly). The proxy is
+** empty, so every assignment reaches __newindex; reads, the length operator,
+** and pairs are forwarded to the shared table at __index. __metatable hides
+** the metatable, and with it the shared table, from getmetatable.
+*/
+static void readonly_create_meta (lua_State *L, const char *meta, const char *type) {
+  static const luaL_Reg readonly_meta[] = {
+    { "__newindex", readonly_newindex },
+    { "__len", readonly_len },
+    { "__pairs", readonly_pairs },
+  #if LUA_VERSION_NUM == 502
+    { "__ipairs", readonly_ipairs },
+  #endif
+    { RAPIDJSON_NULLPTR, RAPIDJSON_NULLPTR }
+  };
+
+  if (luaL_newmetatable(L, meta)) {
+#if LUA_VERSION_NUM == 501
+    luaL_register(L, RAPIDJSON_NULLPTR, readonly_meta);
+#else
+    luaL_setfuncs(L, readonly_meta, 0);
+#endif
+    lua_pushstring(L, type);
+    lua_setfield(L, -2, LUA_RAPIDJSON_META_TYPE);
+    lua_pushliteral(L, LUA_RAPIDJSON_META_READONLY);
+    lua_setfield(L, -2, "__metatable");
+  }
+  lua_pop(L, 1);
+}
+
+/* }================================================================== */
+
 static int rapidjson_use_lpeg (lua_State *L) {
   return luaL_error(L, "use_lpeg has been deprecated!");
 }
@@ -1081,7 +2980,13 @@ static void rapidjson_create_anchor (lua_State *L, const char *name, const luaL_
 LUAMOD_API int luaopen_rapidjson (lua_State *L) {
   static const luaL_Reg luajson_lib[] = {
     { "decode", rapidjson_decode },
+    { "load", rapidjson_load },
     { "encode", rapidjson_encode },
+    { "dump", rapidjson_dump },
+    { "encode_to", rapidjson_encode_to },
+    { "keyorder", rapidjson_keyorder },
+    { "raw", rapidjson_raw },
+    { "invalidate", rapidjson_invalidate },
     { "setoption", rapidjson_setoption },
     { "getoption", rapidjson_getoption },
     /* special tags and functions */
@@ -1090,6 +2995,8 @@ LUAMOD_API int luaopen_rapidjson (lua_State *L) {
     { "array", rapidjson_array },
     { "isobject", rapidjson_isobject },
     { "isarray", rapidjson_isarray },
+    { "cachestats", rapidjson_cachestats },
+    { "query", rapidjson_query },
     { "use_lpeg", rapidjson_use_lpeg },
     /* library details */
     { "_NAME", RAPIDJSON_NULLPTR },
@@ -1117,12 +3024,48 @@ LUAMOD_API int luaopen_rapidjson (lua_State *L) {
     { RAPIDJSON_NULLPTR, RAPIDJSON_NULLPTR },
   };
 
+  static luaL_Reg rapidjson_query_anchor[] {
+    { "__gc", QueryData::__gc },
+  #if LUA_VERSION_NUM >= 504
+    { "__close", QueryData::__gc },
+  #endif
+    { RAPIDJSON_NULLPTR, RAPIDJSON_NULLPTR },
+  };
+
   rapidjson_create_anchor(L, LUA_RAPIDJSON_ENCODER, rapidjson_encode_anchor);
   rapidjson_create_anchor(L, LUA_RAPIDJSON_DECODER, rapidjson_decode_anchor);
+  rapidjson_create_anchor(L, LUA_RAPIDJSON_QUERY, rapidjson_query_anchor);
+#endif
+
+  static const luaL_Reg rapidjson_output_meta[] = {
+    { "__gc", EncoderOutput::__gc },
+    { RAPIDJSON_NULLPTR, RAPIDJSON_NULLPTR },
+  };
+
+  if (luaL_newmetatable(L, LUA_RAPIDJSON_OUTPUT)) {
+#if LUA_VERSION_NUM == 501
+    luaL_register(L, RAPIDJSON_NULLPTR, rapidjson_output_meta);
+#else
+    luaL_setfuncs(L, rapidjson_output_meta, 0);
 #endif
+  }
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, LUA_RAPIDJSON_REG_KEYORDER);  // Compiled key orders hold no resources
+  lua_pop(L, 1);
+
+  if (luaL_newmetatable(L, LUA_RAPIDJSON_REG_RAW)) {
+    lua_pushcfunction(L, raw_tostring);
+    lua_setfield(L, -2, "__tostring");
+  }
+  lua_pop(L, 1);
+  memo_create(L);
 
   create_shared_meta(L, LUA_RAPIDJSON_REG_ARRAY, LUA_RAPIDJSON_META_TYPE_ARRAY);
   create_shared_meta(L, LUA_RAPIDJSON_REG_OBJECT, LUA_RAPIDJSON_META_TYPE_OBJECT);
+  typed_array_create_meta(L);
+  readonly_create_meta(L, LUA_RAPIDJSON_REG_ARRAY_READONLY, LUA_RAPIDJSON_META_TYPE_ARRAY);
+  readonly_create_meta(L, LUA_RAPIDJSON_REG_OBJECT_READONLY, LUA_RAPIDJSON_META_TYPE_OBJECT);
 
 #if LUA_VERSION_NUM == 501
   luaL_register(L, LUA_RAPIDJSON_JSON_LIBNAME, luajson_lib);
@@ -1130,6 +3073,15 @@ LUAMOD_API int luaopen_rapidjson (lua_State *L) {
   luaL_newlib(L, luajson_lib);
 #endif
 
+  /* Functions that read the configuration snapshot from their upvalue */
+  json_pushconfig(L);  // [..., lib, config]
+  lua_pushvalue(L, -1); lua_pushcclosure(L, rapidjson_decode, 1); lua_setfield(L, -3, "decode");
+  lua_pushvalue(L, -1); lua_pushcclosure(L, rapidjson_load, 1); lua_setfield(L, -3, "load");
+  lua_pushvalue(L, -1); json_pushoutput(L); lua_pushcclosure(L, rapidjson_encode, 2); lua_setfield(L, -3, "encode");
+  lua_pushvalue(L, -1); json_pushoutput(L); lua_pushcclosure(L, rapidjson_dump, 2); lua_setfield(L, -3, "dump");
+  lua_pushvalue(L, -1); json_pushoutput(L); lua_pushcclosure(L, rapidjson_encode_to, 2); lua_setfield(L, -3, "encode_to");
+  lua_pop(L, 1);  // [..., lib]
+
   rapidjson_null(L); lua_setfield(L, -2, "null");
   rapidjson_null(L); lua_setfield(L, -2, "sentinel");
   lua_pushboolean(L, 0); lua_setfield(L, -2, "using_lpeg");
@@ -19,6 +19,13 @@
 #include <cstring>
 #include <vector>
 #include <cmath>
+#if defined(LUA_RAPIDJSON_THREADS)
+  #include <atomic>
+  #include <exception>
+  #include <memory>
+  #include <mutex>
+  #include <thread>
+#endif
 
 #include <rapidjson/internal/stack.h>
 #include <rapidjson/rapidjson.h>
@@ -41,12 +48,19 @@ extern LUA_RAPIDJSON_LINKAGE {
 #endif
 
 #include "StringStream.hpp"
+#include "ShortestDtoa.hpp"
 #include "lua_rapidjsonlib.h"
 using namespace RAPIDJSON_NAMESPACE;
 
 /* Registry Table Keys */
 #define LUA_RAPIDJSON_REG_ARRAY "lua_rapidjson_array"
 #define LUA_RAPIDJSON_REG_OBJECT "lua_rapidjson_object"
+#define LUA_RAPIDJSON_REG_TYPED_ARRAY "lua_rapidjson_typed_array"
+#define LUA_RAPIDJSON_REG_KEYORDER "lua_rapidjson_keyorder"
+#define LUA_RAPIDJSON_REG_RAW "lua_rapidjson_raw"
+#define LUA_RAPIDJSON_REG_MEMO "lua_rapidjson_memo"
+#define LUA_RAPIDJSON_REG_ARRAY_READONLY "lua_rapidjson_array_readonly"
+#define LUA_RAPIDJSON_REG_OBJECT_READONLY "lua_rapidjson_object_readonly"
 
 /* Metamethods */
 #define LUA_RAPIDJSON_META_TOJSON "__tojson"
@@ -54,10 +68,22 @@ using namespace RAPIDJSON_NAMESPACE;
 #define LUA_RAPIDJSON_META_TYPE "__jsontype"
 #define LUA_RAPIDJSON_META_TYPE_ARRAY "array"
 #define LUA_RAPIDJSON_META_TYPE_OBJECT "object"
+#define LUA_RAPIDJSON_META_VERSION "__jsonversion"
+#define LUA_RAPIDJSON_META_READONLY "readonly" /* __metatable of the proxies of hash_cons "readonly" */
+
+/* Fields of a memoized table entry (see LuaSAX::Encoder::encodeMemoized) */
+#define LUA_RAPIDJSON_MEMO_BYTES 1
+#define LUA_RAPIDJSON_MEMO_VERSION 2
+#define LUA_RAPIDJSON_MEMO_FLAGS 3
+#define LUA_RAPIDJSON_MEMO_DECIMALS 4
+#define LUA_RAPIDJSON_MEMO_NESTED 5
 
 /* dkjson state functions */
 #define LUA_RAPIDJSON_STATE_KEYORDER "keyorder"
 #define LUA_RAPIDJSON_STATE_EXCEPTION "exception"
+#define LUA_RAPIDJSON_STATE_COMPRESS "compress"
+#define LUA_RAPIDJSON_STATE_CHUNK "chunk_size"
+#define LUA_RAPIDJSON_STATE_THREADS "threads"
 
 /* dkjson Error Messages */
 #define LUA_RAPIDJSON_ERROR_CYCLE "reference cycle"
@@ -112,6 +138,7 @@ using namespace RAPIDJSON_NAMESPACE;
 
 /* Utility to help abstract relative stack indices with absolute */
 #define json_rel_index(idx, n) (((idx) < 0) ? ((idx) - (n)) : (idx))
+#define json_abs_index(L, idx) (((idx) < 0 && (idx) > LUA_REGISTRYINDEX) ? (lua_gettop(L) + (idx) + 1) : (idx))
 
 /*
 ** Returns 1 if the value at the given index is an integer (that is, the value
@@ -169,6 +196,23 @@ static inline int json_isinteger (lua_State *L, int idx) {
   #error unsupported Lua version
 #endif
 
+/* Lua 5.1 does not provide luaL_testudata */
+#if LUA_VERSION_NUM >= 502
+  #define json_testudata(L, I, T) luaL_testudata((L), (I), (T))
+#else
+static void *json_testudata (lua_State *L, int ud, const char *tname) {
+  void *p = lua_touserdata(L, ud);
+  if (p != NULL && lua_getmetatable(L, ud)) {  /* does it have a metatable? */
+    luaL_getmetatable(L, tname);  /* get correct metatable */
+    if (!lua_rawequal(L, -1, -2))  /* not the same? */
+      p = NULL;  /* value is a userdata with wrong metatable */
+    lua_pop(L, 2);  /* remove both metatables */
+    return p;
+  }
+  return NULL;  /* value is not a userdata with a metatable */
+}
+#endif
+
 /* }================================================================== */
 
 /*
@@ -191,6 +235,155 @@ static inline int json_isinteger (lua_State *L, int idx) {
   #define LUA_RAPIDJSON_TABLE_CUTOFF 10
 #endif
 
+/*
+** Maximum number of (key, value) pairs of a decoded table that is considered
+** for hash-consing. Larger tables are unlikely to repeat and are never shared.
+*/
+#if !defined(LUA_RAPIDJSON_HASH_CONS_MAX)
+  #define LUA_RAPIDJSON_HASH_CONS_MAX 32
+#endif
+
+/*
+** Decoded string values longer than this are considered by "dedup_strings".
+** Shorter strings are interned by Lua (LUAI_MAXSHORTLEN) and never duplicated.
+*/
+#if !defined(LUA_RAPIDJSON_DEDUP_MIN)
+  #define LUA_RAPIDJSON_DEDUP_MIN 40
+#endif
+
+/*
+** Default upper bound of the total input length of json.decode results held
+** by the parse cache (see the "parse_cache" option).
+*/
+#if !defined(LUA_RAPIDJSON_CACHE_BYTES)
+  #define LUA_RAPIDJSON_CACHE_BYTES (1 << 20)
+#endif
+
+/*
+** Size of the read buffer used by json.query; the memory required to query a
+** file is independent of its size.
+*/
+#if !defined(LUA_RAPIDJSON_QUERY_BUFFER)
+  #define LUA_RAPIDJSON_QUERY_BUFFER (1 << 16)
+#endif
+
+/* Size of the read buffer used by json.load and the write buffer of json.dump */
+#if !defined(LUA_RAPIDJSON_FILE_BUFFER)
+  #define LUA_RAPIDJSON_FILE_BUFFER (1 << 14)
+#endif
+
+/* Default number of bytes passed to each json.encode_to sink call */
+#if !defined(LUA_RAPIDJSON_SINK_CHUNK)
+  #define LUA_RAPIDJSON_SINK_CHUNK (1 << 14)
+#endif
+
+/*
+** Strings of at most this many bytes are decoded, and encoded outputs of at most
+** this many bytes are written, using fixed-size storage on the C stack: no
+** anchored userdata or heap allocation (see decode_tiny and encode_tiny). Zero
+** disables the fast path.
+*/
+#if !defined(LUA_RAPIDJSON_TINY_SIZE)
+  #define LUA_RAPIDJSON_TINY_SIZE 256
+#endif
+
+/* Size of the on-stack storage used by the parser and writer stacks of the fast path */
+#if !defined(LUA_RAPIDJSON_TINY_ARENA)
+  #define LUA_RAPIDJSON_TINY_ARENA (LUA_RAPIDJSON_TINY_SIZE * 8)
+#endif
+
+/*
+** The json.encode output buffer persists between calls (see EncoderOutput) and
+** its capacity is released once it exceeds LUA_RAPIDJSON_OUTPUT_SLACK times the
+** moving average of recent output sizes; buffers smaller than
+** LUA_RAPIDJSON_OUTPUT_MIN bytes are always kept.
+*/
+#if !defined(LUA_RAPIDJSON_OUTPUT_SLACK)
+  #define LUA_RAPIDJSON_OUTPUT_SLACK 8
+#endif
+
+#if !defined(LUA_RAPIDJSON_OUTPUT_MIN)
+  #define LUA_RAPIDJSON_OUTPUT_MIN (1 << 16)
+#endif
+
+/*
+** Number of (direct-mapped) entries in the per-state cache of encoded object
+** keys and the maximum length of a cached key; see LuaSAX::KeyCache. Zero
+** disables the cache.
+*/
+#if !defined(LUA_RAPIDJSON_KEY_CACHE)
+  #define LUA_RAPIDJSON_KEY_CACHE 256
+#endif
+
+#if !defined(LUA_RAPIDJSON_KEY_CACHE_LEN)
+  #define LUA_RAPIDJSON_KEY_CACHE_LEN 46
+#endif
+
+/* Number of metatables whose metafields are remembered during an encode; see LuaSAX::MetaCache */
+#if !defined(LUA_RAPIDJSON_META_CACHE)
+  #define LUA_RAPIDJSON_META_CACHE 8
+#endif
+
+/*
+** Number of sorted key orders remembered during a "sort_keys" encode and the
+** minimum number of keys of an object for its order to be remembered; see
+** LuaSAX::SortCache. Zero disables the cache.
+*/
+#if !defined(LUA_RAPIDJSON_SORT_CACHE)
+  #define LUA_RAPIDJSON_SORT_CACHE 8
+#endif
+
+#if !defined(LUA_RAPIDJSON_SORT_CACHE_MIN)
+  #define LUA_RAPIDJSON_SORT_CACHE_MIN 4
+#endif
+
+/*
+** Minimum length of a (non-pretty) array, beginning with a number, whose
+** numeric elements are formatted into a LUA_RAPIDJSON_NUMBER_RUN_BUFFER byte
+** buffer and written in batches; see LuaSAX::Encoder::encodeNumberRun. Zero
+** disables batching.
+*/
+#if !defined(LUA_RAPIDJSON_NUMBER_RUN)
+  #define LUA_RAPIDJSON_NUMBER_RUN 4
+#endif
+
+#if !defined(LUA_RAPIDJSON_NUMBER_RUN_BUFFER)
+  #define LUA_RAPIDJSON_NUMBER_RUN_BUFFER 1024
+#endif
+
+/*
+** json.encode with "threads" (LUA_RAPIDJSON_THREADS): strings of at least
+** LUA_RAPIDJSON_SNAPSHOT_ANCHOR bytes are anchored and referenced by the
+** snapshot, shorter ones are copied into LUA_RAPIDJSON_SNAPSHOT_BLOCK byte
+** blocks. Outputs are split into about LUA_RAPIDJSON_PARALLEL_SPLIT pieces per
+** thread, each of at least LUA_RAPIDJSON_PARALLEL_MIN (estimated) bytes, by at
+** most LUA_RAPIDJSON_THREADS_MAX threads; see LuaSAX::Snapshot.
+*/
+#if !defined(LUA_RAPIDJSON_SNAPSHOT_ANCHOR)
+  #define LUA_RAPIDJSON_SNAPSHOT_ANCHOR 256
+#endif
+
+#if !defined(LUA_RAPIDJSON_SNAPSHOT_BLOCK)
+  #define LUA_RAPIDJSON_SNAPSHOT_BLOCK (1 << 16)
+#endif
+
+#if !defined(LUA_RAPIDJSON_PARALLEL_SPLIT)
+  #define LUA_RAPIDJSON_PARALLEL_SPLIT 4
+#endif
+
+#if !defined(LUA_RAPIDJSON_PARALLEL_MIN)
+  #define LUA_RAPIDJSON_PARALLEL_MIN (1 << 16)
+#endif
+
+#if !defined(LUA_RAPIDJSON_THREADS_MAX)
+  #define LUA_RAPIDJSON_THREADS_MAX 64
+#endif
+
+/* Maximum number of JSONPath segments (at most 63; see LuaSAX::JSONPath) */
+#if !defined(LUA_RAPIDJSON_QUERY_STEPS)
+  #define LUA_RAPIDJSON_QUERY_STEPS 32
+#endif
+
 /*
 ** Limit to the encoding of nested tables to prevent infinite looping against
 ** circular references in tables. The alternative solution, as with DKJson, is
@@ -284,8 +477,8 @@ static const char *lua_dtoa(char *s, size_t n, double value) {
 #define EXP(digits) _EXP2(1##E, digits)
 
 /*
-** Massage how Grisu (rapidjson::internal::dtoa) manages inexact IEEE floats
-** for smaller values by explicitly rounding them at some decimal point.
+** Round inexact IEEE floats at LUA_NUMBER_FMT_LEN decimal places before they
+** are formatted, e.g., 0.1 + 0.2 encodes as 0.3 rather than 0.30000000000000004.
 */
 static inline double lua_grisuRound(double d) {
   if ((std::numeric_limits<double>::max() / EXP(LUA_NUMBER_FMT_LEN)) <= d)
@@ -330,6 +523,15 @@ LUA_RAPIDJSON_API bool is_json_null (lua_State *L, int idx);
 */
 LUA_RAPIDJSON_API bool has_json_type (lua_State *L, int idx, bool *is_array);
 
+/* Metafields present in a metatable (see LuaSAX::MetaCache) */
+#define JSON_META_UNKNOWN -1 /* Not yet looked up */
+#define JSON_META_TOJSON  0x1 /* __tojson */
+#define JSON_META_TYPE    0x2 /* __jsontype (a string) */
+#define JSON_META_ARRAY   0x4 /* __jsontype is "array" */
+#define JSON_META_ORDER   0x8 /* __jsonorder */
+#define JSON_META_VERSION 0x10 /* __jsonversion */
+#define JSON_META_PROXY   0x20 /* Read-only proxy of the table at __index (hash_cons "readonly") */
+
 /*
 ** Return true if the table at the specified stack index can be encoded as an
 ** array, i.e., a table whose keys are (1) integers; (2) begin at one; (3)
@@ -344,8 +546,11 @@ LUA_RAPIDJSON_API bool has_json_type (lua_State *L, int idx, bool *is_array);
 **    if n == 0 and valmeta and valmeta.__jsontype == 'object' then
 **      isa = false
 **    end*
+**
+** "jsontype" is the JSON_META_TYPE and JSON_META_ARRAY bits of the metatable
+** when already known, e.g., by LuaSAX::MetaCache; JSON_META_UNKNOWN otherwise.
 */
-LUA_RAPIDJSON_API bool table_is_json_array (lua_State *L, int idx, lua_Integer flags, size_t *array_length);
+LUA_RAPIDJSON_API bool table_is_json_array (lua_State *L, int idx, lua_Integer flags, size_t *array_length, int jsontype = JSON_META_UNKNOWN);
 
 /* }================================================================== */
 
@@ -369,13 +574,32 @@ LUA_RAPIDJSON_API bool table_is_json_array (lua_State *L, int idx, lua_Integer f
 #define JSON_ENCODE_TYPE_IGNORE 0x80 /* Ignore invalid types during encoding instead of throwing an error */
 
 /* Floating Point Encoding */
-#define JSON_LUA_DTOA           0x100 /* Use sprintf instead of rapidjson's native Grisu2 implementation */
-#define JSON_LUA_GRISU          0x200 /* Massage Grisu2 by rounding at maxDecimalsPlaces */
+#define JSON_LUA_DTOA           0x100 /* Use sprintf instead of the shortest round-trip formatter (extend::Dtoa) */
+#define JSON_LUA_GRISU          0x200 /* Round floats at LUA_NUMBER_FMT_LEN decimal places before formatting */
 
 /* Array/Table Flags */
+#define JSON_TRUST_JSONTYPE     0x4000 /* Tables with a __jsontype are encoded as that type without inspecting their keys. */
 #define JSON_ARRAY_SINGLE_LINE  0x10000 /* Enable kFormatSingleLineArray */
 #define JSON_ARRAY_EMPTY        0x20000 /* Empty table encoded as an array. */
 #define JSON_ARRAY_WITH_HOLES   0x40000 /* Encode all tables with positive integer keys as arrays. */
+#define JSON_TYPED_ARRAYS       0x80000 /* Decode arrays of numbers into LuaSAX::TypedArray userdata */
+#define JSON_COLUMNAR           0x100000 /* Decode an array of objects into a table of columns */
+#define JSON_HASH_CONS          0x200000 /* Reuse tables for structurally identical (decoded) subtrees */
+#define JSON_HASH_CONS_READONLY 0x400000 /* Reused tables are given a read-only metatable */
+#define JSON_DEDUP_STRINGS      0x800000 /* Reuse Lua strings for repeated long string values */
+#define JSON_PRESERVE_ORDER     0x1000000 /* Record the parse order of object keys in a per-object __jsonorder */
+
+/* Decoder Cache Options (reserved bits) */
+#define JSON_DECODER_CACHE       0x400 /* Maximum number of cached json.decode results */
+#define JSON_DECODER_CACHE_BYTES 0x800 /* Maximum total input length of cached json.decode results */
+
+/* Encoder Number Options (reserved bits) */
+#define JSON_ENCODER_FIXED       0x8000 /* Write doubles with a fixed number of decimal places */
+
+/* Encoder State Options (identifiers: never stored in the flags; per call only) */
+#define JSON_ENCODER_COMPRESS    (-1) /* Compress the encoded string: gzip (true, "gzip") or "zlib" */
+#define JSON_ENCODER_CHUNK       (-2) /* json.encode_to: number of bytes passed to each sink call */
+#define JSON_ENCODER_THREADS     (-3) /* json.encode: number of threads writing the output */
 
 /* Encoder/Decoder Options (reserved bits) */
 #define JSON_ENCODER_HANDLER    0x2000000 /* Exception Handled, reserved*/
@@ -395,6 +619,9 @@ LUA_RAPIDJSON_API bool table_is_json_array (lua_State *L, int idx, lua_Integer f
 
 #define JSON_DEFAULT (JSON_LUA_NULL | JSON_ARRAY_EMPTY | JSON_ARRAY_WITH_HOLES | JSON_NAN_AND_INF | JSON_DEFAULT_BIT32)
 
+/* Encoder flags tested per value; fixed at compile time by a LuaSAX::FlagWriter */
+#define JSON_HOT_FLAGS (JSON_SORT_KEYS | JSON_UNSIGNED_INTEGERS | JSON_ENCODE_INT32 | JSON_ENCODE_TYPE_IGNORE | JSON_LUA_DTOA | JSON_LUA_GRISU)
+
 namespace LuaSAX {
   /// <summary>
   /// Generic key for sorting/maintaining JSON objects.
@@ -493,6 +720,264 @@ namespace LuaSAX {
     return 0;  // LUA_OK
   }
 
+  /// <summary>
+  /// 64-bit finalizer (MurmurHash3 fmix64) used to hash decoded values.
+  /// </summary>
+  static RAPIDJSON_FORCEINLINE uint64_t hash_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+  /// <summary>
+  /// Hash of a complete byte sequence, consumed a word at a time.
+  /// </summary>
+  static inline uint64_t hash_bytes(const char *str, size_t length) {
+    uint64_t h = hash_mix(static_cast<uint64_t>(length));
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+      uint64_t word = 0;
+      std::memcpy(&word, str + i, sizeof(word));
+      h = hash_mix(h ^ word);
+    }
+
+    uint64_t tail = 0;
+    std::memcpy(&tail, str + i, length - i);
+    return hash_mix(h ^ tail);
+  }
+
+  /// <summary>
+  /// Replace the table on top of the stack with a read-only proxy: an empty
+  /// table whose metatable, a copy of the "readonly" template, indexes the
+  /// table and raises an error on assignment.
+  /// </summary>
+  static void push_readonly(lua_State *L, bool is_array) {
+    const int table = lua_gettop(L);
+    json_checkstack(L, 5);
+    lua_createtable(L, 0, 0);  // [..., table, proxy]
+    lua_createtable(L, 0, 8);  // [..., table, proxy, meta]
+    luaL_getmetatable(L, is_array ? LUA_RAPIDJSON_REG_ARRAY_READONLY : LUA_RAPIDJSON_REG_OBJECT_READONLY);  // [..., table, proxy, meta, template]
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {  // [..., table, proxy, meta, template, key, value]
+      lua_pushvalue(L, -2);
+      lua_insert(L, -2);  // [..., table, proxy, meta, template, key, key, value]
+      lua_rawset(L, -5);  // [..., table, proxy, meta, template, key]
+    }
+    lua_pop(L, 1);  // [..., table, proxy, meta]
+
+    lua_pushliteral(L, "__index");
+    lua_pushvalue(L, table);
+    lua_rawset(L, -3);
+    lua_setmetatable(L, -2);  // [..., table, proxy]
+    lua_replace(L, table);  // [..., proxy]
+  }
+
+  /// <summary>
+  /// Read-only view of a key ordering list: either the keys of a Lua table
+  /// (see populate_key_vector), searched linearly, or a compiled json.keyorder
+  /// userdata. The compiled block is a KeyOrder header followed by "count" keys,
+  /// "mask + 1" open-addressed hash slots (one-based key offsets; zero when
+  /// empty), and a NUL-terminated copy of each string key.
+  /// </summary>
+  struct KeyOrder {
+    const Key *keys;
+    size_t count;
+    const size_t *slots;  // NULL if not compiled
+    size_t mask;
+
+    KeyOrder() : keys(RAPIDJSON_NULLPTR), count(0), slots(RAPIDJSON_NULLPTR), mask(0) { }
+    KeyOrder(const std::vector<Key> &list)
+      : keys(list.empty() ? RAPIDJSON_NULLPTR : &list[0]), count(list.size()), slots(RAPIDJSON_NULLPTR), mask(0) {
+    }
+
+    RAPIDJSON_FORCEINLINE const Key *begin() const { return keys; }
+    RAPIDJSON_FORCEINLINE const Key *end() const { return keys + count; }
+
+    /// <summary>
+    /// Hash of a key; numbers hash by value, so integer and float keys of the
+    /// same value collide (as they compare equal).
+    /// </summary>
+    static uint64_t Hash(const Key &k) {
+      if (k.is_number) {
+        double d = static_cast<double>(k.asNumber());
+        if (d == 0.0)
+          d = 0.0;  // -0.0
+
+        uint64_t bits = 0;
+        std::memcpy(&bits, &d, sizeof(bits));
+        return hash_mix(bits);
+      }
+      return hash_bytes(k.data.s.key, k.data.s.len);
+    }
+
+    /// <summary>
+    /// Return the first occurrence of the key in the ordering list; NULL if it
+    /// is not contained.
+    /// </summary>
+    const Key *Find(const Key &k) const {
+      if (slots == RAPIDJSON_NULLPTR) {
+        const Key *found = std::find_if(begin(), end(), k);
+        return (found != end()) ? found : RAPIDJSON_NULLPTR;
+      }
+
+      for (size_t i = static_cast<size_t>(Hash(k)) & mask; slots[i] != 0; i = (i + 1) & mask) {
+        const Key &other = keys[slots[i] - 1];
+        if (k.is_number ? k(other) : (!other.is_number && other.data.s.len == k.data.s.len
+              && std::memcmp(other.data.s.key, k.data.s.key, k.data.s.len) == 0))
+          return &other;
+      }
+      return RAPIDJSON_NULLPTR;
+    }
+
+    /// <summary>
+    /// Compile the ordering list of the table at "idx" into a new userdata on
+    /// the top of the Lua stack.
+    /// </summary>
+    static KeyOrder *Compile(lua_State *L, int idx) {
+      std::vector<Key> list;
+      populate_key_vector(L, idx, list);
+
+      size_t capacity = 4, bytes = 0;
+      while (capacity < 2 * list.size())
+        capacity <<= 1;
+      for (size_t i = 0; i < list.size(); ++i)
+        bytes += list[i].is_number ? 0 : (list[i].data.s.len + 1);
+
+      const size_t header = sizeof(KeyOrder) + list.size() * sizeof(Key) + capacity * sizeof(size_t);
+      char *ud = reinterpret_cast<char *>(json_newuserdata(L, header + bytes));  // [..., userdata]
+      KeyOrder *order = reinterpret_cast<KeyOrder *>(ud);
+      Key *keys = reinterpret_cast<Key *>(order + 1);
+      size_t *slots = reinterpret_cast<size_t *>(keys + list.size());
+      char *strings = ud + header;
+
+      order->keys = keys;
+      order->count = list.size();
+      order->slots = slots;
+      order->mask = capacity - 1;
+      std::memset(slots, 0, capacity * sizeof(size_t));
+      for (size_t i = 0; i < list.size(); ++i) {
+        keys[i] = list[i];
+        if (!keys[i].is_number) {  // Copy the string; the table may be collected
+          std::memcpy(strings, list[i].data.s.key, list[i].data.s.len);
+          strings[list[i].data.s.len] = '\0';
+          keys[i].data.s.key = strings;
+          strings += list[i].data.s.len + 1;
+        }
+
+        /* Duplicate keys keep their position in "keys" but only the first is hashed */
+        if (order->Find(keys[i]) == RAPIDJSON_NULLPTR) {
+          size_t slot = static_cast<size_t>(Hash(keys[i])) & order->mask;
+          while (slots[slot] != 0)
+            slot = (slot + 1) & order->mask;
+          slots[slot] = i + 1;
+        }
+      }
+
+      luaL_getmetatable(L, LUA_RAPIDJSON_REG_KEYORDER);  // [..., userdata, metatable]
+      lua_setmetatable(L, -2);  // [..., userdata]
+      return order;
+    }
+
+    /// <summary>
+    /// Return the compiled KeyOrder at the given stack index; NULL otherwise.
+    /// </summary>
+    static RAPIDJSON_FORCEINLINE const KeyOrder *Test(lua_State *L, int idx) {
+      return reinterpret_cast<const KeyOrder *>(json_testudata(L, idx, LUA_RAPIDJSON_REG_KEYORDER));
+    }
+  };
+
+  /// <summary>
+  /// Contiguous storage for a decoded JSON array of numbers (see the
+  /// "typed_arrays" option). The userdata block is a TypedArray header followed
+  /// by "length" lua_Integer (is_integer) or lua_Number elements.
+  /// </summary>
+  struct TypedArray {
+    size_t length;  // Number of elements
+    bool is_integer;  // Storage type of each element
+
+    union Element {
+      lua_Integer i;
+      lua_Number n;
+    };
+
+    RAPIDJSON_FORCEINLINE Element *Data() {
+      return reinterpret_cast<Element *>(this + 1);
+    }
+
+    RAPIDJSON_FORCEINLINE const Element *Data() const {
+      return reinterpret_cast<const Element *>(this + 1);
+    }
+
+    /// <summary>
+    /// Push the element at the (zero-based) offset onto the Lua stack.
+    /// </summary>
+    RAPIDJSON_FORCEINLINE void Push(lua_State *L, size_t offset) const {
+      if (is_integer)
+        lua_pushinteger(L, Data()[offset].i);
+      else
+        lua_pushnumber(L, Data()[offset].n);
+    }
+
+    /// <summary>
+    /// Create a new TypedArray userdata of "length" elements on the top of the
+    /// Lua stack; element data is left uninitialized.
+    /// </summary>
+    static TypedArray *Create(lua_State *L, size_t length, bool is_integer) {
+      void *ud = json_newuserdata(L, sizeof(TypedArray) + length * sizeof(Element));  // [..., userdata]
+      TypedArray *ta = reinterpret_cast<TypedArray *>(ud);
+      ta->length = length;
+      ta->is_integer = is_integer;
+
+      luaL_getmetatable(L, LUA_RAPIDJSON_REG_TYPED_ARRAY);  // [..., userdata, metatable]
+      lua_setmetatable(L, -2);  // [..., userdata]
+      return ta;
+    }
+
+    /// <summary>
+    /// Return the TypedArray at the given stack index; NULL otherwise.
+    /// </summary>
+    static RAPIDJSON_FORCEINLINE TypedArray *Test(lua_State *L, int idx) {
+      return reinterpret_cast<TypedArray *>(json_testudata(L, idx, LUA_RAPIDJSON_REG_TYPED_ARRAY));
+    }
+  };
+
+  /// <summary>
+  /// Pre-encoded JSON text written verbatim by the encoder (see json.raw). The
+  /// userdata block is a RawFragment header followed by "length" bytes.
+  /// </summary>
+  struct RawFragment {
+    size_t length;
+
+    RAPIDJSON_FORCEINLINE const char *Data() const {
+      return reinterpret_cast<const char *>(this + 1);
+    }
+
+    /// <summary>
+    /// Create a new RawFragment userdata, a copy of "str", on the top of the
+    /// Lua stack.
+    /// </summary>
+    static RawFragment *Create(lua_State *L, const char *str, size_t length) {
+      void *ud = json_newuserdata(L, sizeof(RawFragment) + length);  // [..., userdata]
+      RawFragment *raw = reinterpret_cast<RawFragment *>(ud);
+      raw->length = length;
+      std::memcpy(raw + 1, str, length);
+
+      luaL_getmetatable(L, LUA_RAPIDJSON_REG_RAW);  // [..., userdata, metatable]
+      lua_setmetatable(L, -2);  // [..., userdata]
+      return raw;
+    }
+
+    /// <summary>
+    /// Return the RawFragment at the given stack index; NULL otherwise.
+    /// </summary>
+    static RAPIDJSON_FORCEINLINE const RawFragment *Test(lua_State *L, int idx) {
+      return reinterpret_cast<const RawFragment *>(json_testudata(L, idx, LUA_RAPIDJSON_REG_RAW));
+    }
+  };
+
   /** SAX Handler: https://rapidjson.org/classrapidjson_1_1_handler.html */
   template<typename StackAllocator>
   struct Decoder {
@@ -502,21 +987,38 @@ private:
     /// </summary>
     struct Ctx {
       typedef void (*ctx_callback) (lua_State *, struct Ctx &);
+
+      /// <summary>
+      /// Container being populated. Modes greater than or equal to kTyped
+      /// correspond to arrays whose final representation is not yet known.
+      /// </summary>
+      enum Mode {
+        kObject,  // Object table
+        kArray,  // Array table
+        kRow,  // Object whose members are appended to the columns of its parent
+        kTyped,  // Array elements are buffered in the numeric scratch stack.
+        kColumns,  // Array of objects decoded into a table of columns.
+      };
+
       SizeType index;
       ctx_callback callback;
+      Mode mode;
 
-      Ctx() : index(0), callback(&Unused) { }
-      Ctx(const Ctx &rhs) : index(rhs.index), callback(rhs.callback) { }
-      explicit Ctx(ctx_callback f) : index(0), callback(f) { }
+      Ctx() : index(0), callback(&Unused), mode(kObject) { }
+      Ctx(const Ctx &rhs) : index(rhs.index), callback(rhs.callback), mode(rhs.mode) { }
+      explicit Ctx(ctx_callback f, Mode _mode) : index(0), callback(f), mode(_mode) { }
 
       const Ctx &operator=(const Ctx &rhs) {
         if (this != &rhs) {
           index = rhs.index;
           callback = rhs.callback;
+          mode = rhs.mode;
         }
         return *this;
       }
 
+      RAPIDJSON_FORCEINLINE bool IsDeferred() const { return mode >= kTyped; }
+
       RAPIDJSON_FORCEINLINE void Push(lua_State *Ls) { callback(Ls, *this); }
 
       static void Unused(lua_State *L, Ctx &ctx) {
@@ -528,34 +1030,110 @@ private:
         return Ctx([](lua_State *L_, Ctx &ctx) {
           JSON_UNUSED(ctx);
           lua_rawset(L_, -3);
-        });
+        }, kObject);
+      }
+
+      static void ArrayCallback(lua_State *L_, Ctx &ctx) {
+#if LUA_VERSION_NUM >= 503
+        lua_rawseti(L_, -2, ++ctx.index);
+#else
+        lua_pushinteger(L_, ++ctx.index);  // [..., value, key]
+        lua_pushvalue(L_, -2);  // [..., value, key, value]
+        lua_rawset(L_, -4);  // [..., value]
+        lua_pop(L_, 1);  // [...]
+#endif
       }
 
       static RAPIDJSON_FORCEINLINE Ctx Array() {
-        return Ctx([](lua_State *L_, Ctx &ctx) {
+        return Ctx(&ArrayCallback, kArray);
+      }
+
+      /// <summary>
+      /// An array whose table has yet to be created: until a non-numeric
+      /// element is parsed, all elements are buffered and the array may be
+      /// packed into a TypedArray.
+      /// </summary>
+      static RAPIDJSON_FORCEINLINE Ctx Typed() {
+        return Ctx(&ArrayCallback, kTyped);
+      }
+
+      /// <summary>
+      /// An array of objects decoded as a table of columns (see "columnar").
+      /// Elements are never submitted to this context: objects are decoded as
+      /// rows and any other element converts the columns back into an array.
+      /// </summary>
+      static RAPIDJSON_FORCEINLINE Ctx Columns() {
+        return Ctx(&Unused, kColumns);
+      }
+
+      /// <summary>
+      /// An object (the "index"-th element of a kColumns array) whose members
+      /// are appended to the column of the same key. Columns are given the
+      /// default array metatable as they do not correspond to a JSON array.
+      /// </summary>
+      static RAPIDJSON_FORCEINLINE Ctx Row(SizeType row) {
+        Ctx ctx([](lua_State *L_, Ctx &ctx_) {  // [..., columns, key, value]
+          lua_pushvalue(L_, -2);  // [..., columns, key, value, key]
+          lua_rawget(L_, -4);  // [..., columns, key, value, column]
+          if (!lua_istable(L_, -1)) {
+            lua_pop(L_, 1);  // [..., columns, key, value]
+            lua_createtable(L_, static_cast<int>(ctx_.index), 0);  // [..., columns, key, value, column]
+            luaL_getmetatable(L_, LUA_RAPIDJSON_REG_ARRAY);
+            lua_setmetatable(L_, -2);
+            lua_pushvalue(L_, -3);  // [..., columns, key, value, column, key]
+            lua_pushvalue(L_, -2);  // [..., columns, key, value, column, key, column]
+            lua_rawset(L_, -6);  // [..., columns, key, value, column]
+          }
+          lua_insert(L_, -2);  // [..., columns, key, column, value]
 #if LUA_VERSION_NUM >= 503
-          lua_rawseti(L_, -2, ++ctx.index);
+          lua_rawseti(L_, -2, ctx_.index);  // [..., columns, key, column]
 #else
-          lua_pushinteger(L_, ++ctx.index);  // [..., value, key]
-          lua_pushvalue(L_, -2);  // [..., value, key, value]
-          lua_rawset(L_, -4);  // [..., value]
-          lua_pop(L_, 1);  // [...]
+          lua_pushinteger(L_, ctx_.index);  // [..., columns, key, column, value, index]
+          lua_insert(L_, -2);  // [..., columns, key, column, index, value]
+          lua_rawset(L_, -3);  // [..., columns, key, column]
 #endif
-        });
+          lua_pop(L_, 2);  // [..., columns]
+        }, kRow);
+        ctx.index = row;
+        return ctx;
       }
     };
 
+    /// <summary>
+    /// A buffered element of a (potentially) typed array.
+    /// </summary>
+    struct TypedValue {
+      bool is_integer;
+      LuaSAX::TypedArray::Element value;
+    };
+
     lua_State *L;
     internal::Stack<StackAllocator> &stack_;  // Nested table population stack
+    internal::Stack<StackAllocator> &scratch_;  // Buffered elements of a (pending) typed array
     lua_Integer flags;
     int nullarg;  // Stack index of object that represents "null"
     int objectarg;  // Stack index of "object" metatable
     int arrayarg;  // Stack index of "array" metatable
+    int internarg;  // Stack index of the hash-consing table (hash -> table)
+    int stringarg;  // Stack index of the long string table (hash -> string)
     Ctx context_;  // Current table being populated
 
+    /* JSON pointer (RFC 6901) tracking for the "columnar" option */
+    const char *pointer_;  // JSON pointer of the array decoded as columns.
+    size_t pointer_len_;
+    int depth_;  // Number of open containers
+    int on_path_;  // Number of open containers on the pointer path
+    size_t offset_;  // Offset of the next unmatched reference token.
+    size_t next_offset_;  // Offset after the most recently matched token
+    bool key_match_;  // Most recent key matches the next reference token.
+
+    bool ordered_;  // Objects are given a metatable that records their key order.
+
 public:
-    explicit Decoder(lua_State *L_, internal::Stack<StackAllocator> &_stack, lua_Integer _flags = 0, int _nullidx = -1, int _oidx = -1, int _aidx = -1)
-      : L(L_), stack_(_stack), flags(_flags), nullarg(_nullidx), objectarg(_oidx), arrayarg(_aidx) {
+    explicit Decoder(lua_State *L_, internal::Stack<StackAllocator> &_stack, internal::Stack<StackAllocator> &_scratch, lua_Integer _flags = 0, int _nullidx = -1, int _oidx = -1, int _aidx = -1, const char *_pointer = RAPIDJSON_NULLPTR, size_t _pointer_len = 0, int _internidx = -1, int _stringidx = -1)
+      : L(L_), stack_(_stack), scratch_(_scratch), flags(_flags), nullarg(_nullidx), objectarg(_oidx), arrayarg(_aidx), internarg(_internidx), stringarg(_stringidx),
+        pointer_(_pointer), pointer_len_(_pointer_len), depth_(0), on_path_(0), offset_(0), next_offset_(0), key_match_(false),
+        ordered_((_flags & JSON_PRESERVE_ORDER) != 0 && _oidx <= 0) {
 #if LUA_RAPIDJSON_DEFAULT_DEPTH <= 64  // In case DEFAULT_DEPTH is increased
       stack_.template Reserve<Ctx>(LUA_RAPIDJSON_DEFAULT_DEPTH >> 1);
 #else
@@ -567,64 +1145,459 @@ public:
     #define LUA_JSON_HANDLE(NAME, ...) RAPIDJSON_FORCEINLINE bool NAME(__VA_ARGS__)
     #define LUA_JSON_HANDLE_NULL(NAME) RAPIDJSON_FORCEINLINE bool NAME()
 
-    LUA_JSON_HANDLE_NULL(Null) {
-      if (nullarg > 0)
-        lua_pushvalue(L, nullarg);
-      else if ((flags & JSON_LUA_NULL))
-        lua_pushnil(L);
+    /// <summary>
+    /// Create the table of a pending typed array, populated with all elements
+    /// buffered so far, as a non-numeric element has been parsed.
+    /// </summary>
+    void Materialize() {
+      const SizeType count = context_.index;
+      const TypedValue *values = scratch_.template Bottom<TypedValue>();
+
+      json_checkstack(L, 3);
+      lua_createtable(L, static_cast<int>(count), 0);  // mark as array
+      if (arrayarg > 0)
+        lua_pushvalue(L, arrayarg);
       else
-        rapidjson_null(L);
-      LUA_JSON_SUBMIT();
-      return true;
-    }
+        luaL_getmetatable(L, LUA_RAPIDJSON_REG_ARRAY);
+      lua_setmetatable(L, -2);
 
-    LUA_JSON_HANDLE(Bool, bool b) {
-      lua_pushboolean(L, b);
-      LUA_JSON_SUBMIT();
-      return true;
+      context_ = Ctx::Array();
+      for (SizeType i = 0; i < count; ++i) {
+        if (values[i].is_integer)
+          lua_pushinteger(L, values[i].value.i);
+        else
+          lua_pushnumber(L, values[i].value.n);
+        LUA_JSON_SUBMIT();
+      }
+      scratch_.Clear();
     }
 
-    LUA_JSON_HANDLE(Int, int i) {
-      lua_pushinteger(L, i);
-      LUA_JSON_SUBMIT();
-      return true;
-    }
+    /// <summary>
+    /// Pack all buffered elements of a pending typed array into a TypedArray
+    /// userdata. Elements are stored as integers iff all elements are integers.
+    /// </summary>
+    void PushTypedArray() {
+      const SizeType count = context_.index;
+      const TypedValue *values = scratch_.template Bottom<TypedValue>();
 
-    LUA_JSON_HANDLE(Uint, unsigned u) {
-      LUA_RAPIDJSON_IF_CONSTEXPR (sizeof(lua_Integer) > sizeof(unsigned) || u <= static_cast<unsigned>(LUA_MAXINTEGER))
-        lua_pushinteger(L, static_cast<lua_Integer>(u));
-      else
-        lua_pushnumber(L, static_cast<lua_Number>(u));
-      LUA_JSON_SUBMIT();
-      return true;
-    }
+      bool is_integer = true;
+      for (SizeType i = 0; i < count && is_integer; ++i)
+        is_integer = values[i].is_integer;
 
-    LUA_JSON_HANDLE(Int64, int64_t i) {
-      LUA_RAPIDJSON_IF_CONSTEXPR (sizeof(lua_Integer) >= sizeof(int64_t) || (i <= LUA_MAXINTEGER && i >= LUA_MININTEGER))
-        lua_pushinteger(L, static_cast<lua_Integer>(i));
-      else
-        lua_pushnumber(L, static_cast<lua_Number>(i));
-      LUA_JSON_SUBMIT();
-      return true;
+      json_checkstack(L, 2);
+      LuaSAX::TypedArray *ta = LuaSAX::TypedArray::Create(L, count, is_integer);
+      LuaSAX::TypedArray::Element *data = ta->Data();
+      for (SizeType i = 0; i < count; ++i) {
+        if (is_integer || !values[i].is_integer)
+          data[i] = values[i].value;
+        else
+          data[i].n = static_cast<lua_Number>(values[i].value.i);
+      }
+      scratch_.Clear();
     }
 
-    LUA_JSON_HANDLE(Uint64, uint64_t u) {
-      if (sizeof(lua_Integer) > sizeof(uint64_t) || u <= static_cast<uint64_t>(LUA_MAXINTEGER))
-        lua_pushinteger(L, static_cast<lua_Integer>(u));
+    /// <summary>
+    /// Convert the table of columns (on top of the stack) into an array of
+    /// object tables, as an element that is not an object has been parsed.
+    /// </summary>
+    void Decolumnize() {
+      const SizeType rows = context_.index;
+
+      json_checkstack(L, 6);
+      lua_createtable(L, static_cast<int>(rows), 0);  // [..., columns, array]
+      if (arrayarg > 0)
+        lua_pushvalue(L, arrayarg);
       else
-        lua_pushnumber(L, static_cast<lua_Number>(u));
-      LUA_JSON_SUBMIT();
-      return true;
+        luaL_getmetatable(L, LUA_RAPIDJSON_REG_ARRAY);
+      lua_setmetatable(L, -2);
+
+      for (SizeType i = 1; i <= rows; ++i) {
+        lua_createtable(L, 0, 0);  // [..., columns, array, row]
+        if (objectarg > 0)
+          lua_pushvalue(L, objectarg);
+        else
+          luaL_getmetatable(L, LUA_RAPIDJSON_REG_OBJECT);
+        lua_setmetatable(L, -2);
+        lua_rawseti(L, -2, static_cast<lua_Integer>(i));  // [..., columns, array]
+      }
+
+      lua_pushnil(L);  // [..., columns, array, nil]
+      while (lua_next(L, -3)) {  // [..., columns, array, key, column]
+        for (SizeType i = 1; i <= rows; ++i) {
+          lua_rawgeti(L, -1, static_cast<lua_Integer>(i));  // [..., columns, array, key, column, value]
+          if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            continue;
+          }
+          lua_rawgeti(L, -4, static_cast<lua_Integer>(i));  // [..., columns, array, key, column, value, row]
+          lua_pushvalue(L, -4);  // [..., columns, array, key, column, value, row, key]
+          lua_pushvalue(L, -3);  // [..., columns, array, key, column, value, row, key, value]
+          lua_rawset(L, -3);  // [..., columns, array, key, column, value, row]
+          lua_pop(L, 2);  // [..., columns, array, key, column]
+        }
+        lua_pop(L, 1);  // [..., columns, array, key]
+      }
+      lua_replace(L, -2);  // [..., array]
+
+      context_ = Ctx::Array();
+      context_.index = rows;
     }
 
-    LUA_JSON_HANDLE(Double, double d) {
-      lua_pushnumber(L, static_cast<lua_Number>(d));
-      LUA_JSON_SUBMIT();
-      return true;
+    /// <summary>
+    /// Store the number of rows in the "n" field of the table of columns on top
+    /// of the stack, as rows may have no members. Returning false if a column
+    /// is named "n".
+    /// </summary>
+    bool CountRows() {
+      json_checkstack(L, 2);
+      lua_pushliteral(L, "n");
+      lua_rawget(L, -2);  // [..., columns, column]
+      const bool available = lua_isnil(L, -1);
+      lua_pop(L, 1);
+      if (available) {
+        lua_pushliteral(L, "n");
+        lua_pushinteger(L, static_cast<lua_Integer>(context_.index));
+        lua_rawset(L, -3);  // [..., columns]
+      }
+      return available;
+    }
+
+    /// <summary>
+    /// Resolve the representation of a deferred array: a non-numeric element,
+    /// or an element that is not an object, has been parsed.
+    /// </summary>
+    RAPIDJSON_FORCEINLINE void Resolve() {
+      if (context_.mode == Ctx::kTyped)
+        Materialize();
+      else if (context_.mode == Ctx::kColumns)
+        Decolumnize();
+    }
+
+    /// <summary>
+    /// Return true if the unescaped reference token at offset_ equals "str"; the
+    /// end of the token is stored in next_offset_.
+    /// </summary>
+    bool TokenMatch(const char *str, size_t len) {
+      size_t p = offset_ + 1, i = 0;  // pointer_[offset_] == '/'
+      while (p < pointer_len_ && pointer_[p] != '/') {
+        char c = pointer_[p++];
+        if (c == '~' && p < pointer_len_ && (pointer_[p] == '0' || pointer_[p] == '1'))
+          c = (pointer_[p++] == '1') ? '/' : '~';
+        if (i >= len || str[i++] != c)
+          return false;
+      }
+
+      next_offset_ = p;
+      return i == len;
+    }
+
+    /// <summary>
+    /// Update the pointer path when entering a container; returning true if the
+    /// container is referenced by the pointer.
+    /// </summary>
+    bool PathEnter() {
+      bool on_path = false;
+      if (depth_ == 0) {  // Root
+        on_path = true;
+        next_offset_ = 0;
+      }
+      else if (depth_ == on_path_ && offset_ < pointer_len_) {
+        if (context_.mode == Ctx::kArray) {
+          char buffer[MAXNUMBER2STR];
+          const char *end = internal::u64toa(static_cast<uint64_t>(context_.index), buffer);
+          on_path = TokenMatch(buffer, static_cast<size_t>(end - buffer));
+        }
+        else
+          on_path = key_match_;
+      }
+
+      key_match_ = false;
+      if (on_path) {
+        on_path_ = ++depth_;
+        offset_ = next_offset_;
+        return offset_ >= pointer_len_;
+      }
+      ++depth_;
+      return false;
+    }
+
+    RAPIDJSON_FORCEINLINE void PathLeave() {
+      if (on_path_ == depth_--) {
+        on_path_--;
+        while (offset_ > 0 && pointer_[--offset_] != '/') {
+        }
+      }
+    }
+
+    /// <summary>
+    /// Hash of a table key or value. Strings are sampled (length, head, and
+    /// tail); tables and other reference types are hashed by identity, as each
+    /// nested table has already been hash-consed.
+    /// </summary>
+    static uint64_t HashValue(lua_State *L_, int idx) {
+      const int type = lua_type(L_, idx);
+      switch (type) {
+        case LUA_TNUMBER: {
+          if (json_isinteger(L_, idx))
+            return hash_mix(static_cast<uint64_t>(lua_tointeger(L_, idx)));
+
+          uint64_t bits = 0;
+          const double d = static_cast<double>(lua_tonumber(L_, idx));
+          std::memcpy(&bits, &d, sizeof(bits));
+          return hash_mix(bits ^ 0x9e3779b97f4a7c15ULL);
+        }
+        case LUA_TSTRING: {
+          size_t len = 0;
+          const char *str = lua_tolstring(L_, idx, &len);
+
+          uint64_t h = 0xcbf29ce484222325ULL ^ len;  // FNV-1a
+          const size_t head = len < 32 ? len : 16;
+          for (size_t i = 0; i < head; ++i)
+            h = (h ^ static_cast<unsigned char>(str[i])) * 0x100000001b3ULL;
+          for (size_t i = (len < 32 ? len : len - 16); i < len; ++i)
+            h = (h ^ static_cast<unsigned char>(str[i])) * 0x100000001b3ULL;
+          return hash_mix(h);
+        }
+        case LUA_TBOOLEAN:
+          return hash_mix(static_cast<uint64_t>(lua_toboolean(L_, idx)) + 1);
+        default:
+          return hash_mix(static_cast<uint64_t>(reinterpret_cast<uintptr_t>(lua_topointer(L_, idx))) ^ static_cast<uint64_t>(type));
+      }
+    }
+
+    /// <summary>
+    /// Return true if both tables (that have nested tables hash-consed) contain
+    /// the same (key, value) pairs; numbers must also share the same subtype.
+    /// </summary>
+    static bool TableEqual(lua_State *L_, int a, int b, int count) {
+      int n = 0;
+      lua_pushnil(L_);  // [..., key]
+      while (lua_next(L_, b)) {  // [..., key, value]
+        lua_pushvalue(L_, -2);  // [..., key, value, key]
+        lua_rawget(L_, a);  // [..., key, value, a_value]
+        const bool equal = lua_rawequal(L_, -1, -2)
+                           && (lua_type(L_, -1) != LUA_TNUMBER || json_isinteger(L_, -1) == json_isinteger(L_, -2));
+        lua_pop(L_, 2);  // [..., key]
+        if (!equal || ++n > count) {
+          lua_pop(L_, 1);
+          return false;
+        }
+      }
+      return n == count;
+    }
+
+    /// <summary>
+    /// Replace the completed table on top of the stack with a structurally
+    /// identical table decoded earlier; otherwise, register it for reuse. In
+    /// "readonly" mode, a registered table is replaced by its proxy, which is
+    /// stored under the table in the hash-consing table.
+    /// </summary>
+    void HashCons(bool is_array) {
+      const int table = lua_gettop(L);
+      json_checkstack(L, 4);
+
+      int count = 0;
+      uint64_t h = hash_mix(is_array ? 0x5bd1e995ULL : 0x27d4eb2dULL);
+      lua_pushnil(L);  // [..., table, key]
+      while (lua_next(L, table)) {  // [..., table, key, value]
+        if (++count > LUA_RAPIDJSON_HASH_CONS_MAX) {
+          lua_settop(L, table);
+          return;
+        }
+        h += hash_mix(HashValue(L, -2) * 31 + HashValue(L, -1));  // Independent of traversal order
+        lua_pop(L, 1);  // [..., table, key]
+      }
+      h = hash_mix(h ^ static_cast<uint64_t>(count));
+
+      lua_pushnumber(L, static_cast<lua_Number>(h >> 11));  // [..., table, hash] (exact as a double)
+      lua_pushvalue(L, -1);  // [..., table, hash, hash]
+      lua_rawget(L, internarg);  // [..., table, hash, candidate]
+      if (lua_istable(L, -1)) {
+        bool candidate_array = false, table_array = false;
+        has_json_type(L, -1, &candidate_array);
+        has_json_type(L, table, &table_array);
+        if (candidate_array == table_array && TableEqual(L, table + 2, table, count)) {
+          lua_pushvalue(L, -1);
+          lua_rawget(L, internarg);  // [..., table, hash, candidate, proxy]
+          if (lua_isnil(L, -1))
+            lua_pop(L, 1);
+          lua_replace(L, table);  // [..., candidate, hash, ...]
+          lua_settop(L, table);
+          return;
+        }
+        lua_settop(L, table);  // On collision, the table remains unique.
+        return;
+      }
+      lua_pop(L, 1);  // [..., table, hash]
+
+      lua_pushvalue(L, table);  // [..., table, hash, table]
+      lua_rawset(L, internarg);  // [..., table]
+
+      if ((flags & JSON_HASH_CONS_READONLY) && (is_array ? arrayarg : objectarg) <= 0 && (is_array || !ordered_)) {
+        lua_pushvalue(L, table);  // [..., table, table]
+        push_readonly(L, is_array);  // [..., proxy]
+        lua_pushvalue(L, table);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, internarg);  // intern[table] = proxy
+        lua_replace(L, table);  // [..., proxy]
+      }
+    }
+
+    /// <summary>
+    /// Push a string value; long strings already seen during this decode
+    /// reuse the previously created Lua string.
+    /// </summary>
+    RAPIDJSON_FORCEINLINE void PushString(const char *str, SizeType length) {
+      if (stringarg <= 0 || length <= LUA_RAPIDJSON_DEDUP_MIN) {
+        lua_pushlstring(L, str, length);
+        return;
+      }
+
+      json_checkstack(L, 3);
+      lua_pushnumber(L, static_cast<lua_Number>(hash_bytes(str, length) >> 11));  // [..., hash]
+      lua_pushvalue(L, -1);  // [..., hash, hash]
+      lua_rawget(L, stringarg);  // [..., hash, candidate]
+
+      size_t candidate_len = 0;
+      const char *candidate = lua_type(L, -1) == LUA_TSTRING ? lua_tolstring(L, -1, &candidate_len) : RAPIDJSON_NULLPTR;
+      if (candidate != RAPIDJSON_NULLPTR) {
+        if (candidate_len == length && std::memcmp(candidate, str, length) == 0) {
+          lua_remove(L, -2);  // [..., candidate]
+          return;
+        }
+        lua_pop(L, 2);  // On collision, the string remains unique.
+        lua_pushlstring(L, str, length);
+        return;
+      }
+
+      lua_pop(L, 1);  // [..., hash]
+      lua_pushlstring(L, str, length);  // [..., hash, string]
+      lua_pushvalue(L, -1);  // [..., hash, string, string]
+      lua_insert(L, -3);  // [..., string, hash, string]
+      lua_rawset(L, stringarg);  // [..., string]
+    }
+
+    /// <summary>
+    /// Create the metatable of an object decoded with "preserve_order". Its
+    /// array part lists the object keys in parse order and, as its own
+    /// __jsonorder, is used directly by the Encoder.
+    /// </summary>
+    void PushOrderedMeta() {
+      lua_createtable(L, 0, 2);  // [..., meta]
+      lua_pushstring(L, LUA_RAPIDJSON_META_TYPE_OBJECT);
+      lua_setfield(L, -2, LUA_RAPIDJSON_META_TYPE);
+      lua_pushvalue(L, -1);
+      lua_setfield(L, -2, LUA_RAPIDJSON_META_ORDER);
+    }
+
+    /// <summary>
+    /// Append the key on top of the stack to the key order of the object
+    /// beneath it; duplicate keys retain their first position.
+    /// </summary>
+    void RecordKey() {
+      json_checkstack(L, 3);
+      lua_pushvalue(L, -1);  // [..., object, key, key]
+      lua_rawget(L, -3);  // [..., object, key, previous]
+      const bool duplicate = !lua_isnil(L, -1);
+      lua_pop(L, 1);  // [..., object, key]
+      if (!duplicate && lua_getmetatable(L, -2)) {  // [..., object, key, meta]
+        lua_pushvalue(L, -2);  // [..., object, key, meta, key]
+        lua_rawseti(L, -2, ++context_.index);  // [..., object, key, meta]
+        lua_pop(L, 1);  // [..., object, key]
+      }
+    }
+
+    RAPIDJSON_FORCEINLINE void SubmitInteger(lua_Integer i) {
+      if (context_.mode == Ctx::kTyped) {
+        TypedValue *v = scratch_.template Push<TypedValue>(1);
+        v->is_integer = true;
+        v->value.i = i;
+        context_.index++;
+      }
+      else {
+        if (context_.mode == Ctx::kColumns)
+          Decolumnize();
+        lua_pushinteger(L, i);
+        LUA_JSON_SUBMIT();
+      }
+    }
+
+    RAPIDJSON_FORCEINLINE void SubmitNumber(lua_Number n) {
+      if (context_.mode == Ctx::kTyped) {
+        TypedValue *v = scratch_.template Push<TypedValue>(1);
+        v->is_integer = false;
+        v->value.n = n;
+        context_.index++;
+      }
+      else {
+        if (context_.mode == Ctx::kColumns)
+          Decolumnize();
+        lua_pushnumber(L, n);
+        LUA_JSON_SUBMIT();
+      }
+    }
+
+    LUA_JSON_HANDLE_NULL(Null) {
+      if (context_.IsDeferred())
+        Resolve();
+
+      if (nullarg > 0)
+        lua_pushvalue(L, nullarg);
+      else if ((flags & JSON_LUA_NULL))
+        lua_pushnil(L);
+      else
+        rapidjson_null(L);
+      LUA_JSON_SUBMIT();
+      return true;
+    }
+
+    LUA_JSON_HANDLE(Bool, bool b) {
+      if (context_.IsDeferred())
+        Resolve();
+
+      lua_pushboolean(L, b);
+      LUA_JSON_SUBMIT();
+      return true;
+    }
+
+    LUA_JSON_HANDLE(Int, int i) {
+      SubmitInteger(static_cast<lua_Integer>(i));
+      return true;
+    }
+
+    LUA_JSON_HANDLE(Uint, unsigned u) {
+      LUA_RAPIDJSON_IF_CONSTEXPR (sizeof(lua_Integer) > sizeof(unsigned) || u <= static_cast<unsigned>(LUA_MAXINTEGER))
+        SubmitInteger(static_cast<lua_Integer>(u));
+      else
+        SubmitNumber(static_cast<lua_Number>(u));
+      return true;
+    }
+
+    LUA_JSON_HANDLE(Int64, int64_t i) {
+      LUA_RAPIDJSON_IF_CONSTEXPR (sizeof(lua_Integer) >= sizeof(int64_t) || (i <= LUA_MAXINTEGER && i >= LUA_MININTEGER))
+        SubmitInteger(static_cast<lua_Integer>(i));
+      else
+        SubmitNumber(static_cast<lua_Number>(i));
+      return true;
+    }
+
+    LUA_JSON_HANDLE(Uint64, uint64_t u) {
+      if (sizeof(lua_Integer) > sizeof(uint64_t) || u <= static_cast<uint64_t>(LUA_MAXINTEGER))
+        SubmitInteger(static_cast<lua_Integer>(u));
+      else
+        SubmitNumber(static_cast<lua_Number>(u));
+      return true;
+    }
+
+    LUA_JSON_HANDLE(Double, double d) {
+      SubmitNumber(static_cast<lua_Number>(d));
+      return true;
     }
 
     LUA_JSON_HANDLE(RawNumber, const char *str, SizeType length, bool copy) {
       JSON_UNUSED(copy);
+      if (context_.IsDeferred())
+        Resolve();
 
       // @TODO: Rewrite using lua_stringtonumber >= 503
       lua_getglobal(L, "tonumber");  // [..., tonumber]
@@ -634,84 +1607,825 @@ public:
       return true;
     }
 
-    LUA_JSON_HANDLE(String, const char *str, SizeType length, bool copy) {
-      JSON_UNUSED(copy);
+    LUA_JSON_HANDLE(String, const char *str, SizeType length, bool copy) {
+      JSON_UNUSED(copy);
+      if (context_.IsDeferred())
+        Resolve();
+
+      PushString(str, length);
+      LUA_JSON_SUBMIT();
+      return true;
+    }
+
+    /// <summary>
+    /// "capacity" is the number of members when known in advance (see
+    /// extend::StructuralReader); zero otherwise.
+    /// </summary>
+    RAPIDJSON_FORCEINLINE bool StartObject(SizeType capacity = 0) {
+      if (context_.mode == Ctx::kTyped)
+        Materialize();
+
+      if (pointer_ != RAPIDJSON_NULLPTR)
+        PathEnter();
+
+      /* Append the object members to the columns of its array */
+      if (context_.mode == Ctx::kColumns) {
+        *stack_.template Push<Ctx>(1) = context_;
+        context_ = Ctx::Row(context_.index + 1);
+        return true;
+      }
+
+#if !defined(LUA_RAPIDJSON_UNSAFE)
+      if (lua_checkstack(L, 3)) {  // ensure room on the stack
+#endif
+        lua_createtable(L, 0, static_cast<int>(capacity));  // mark as object
+        if (ordered_)
+          PushOrderedMeta();
+        else if (objectarg > 0)
+          lua_pushvalue(L, objectarg);
+        else
+          luaL_getmetatable(L, LUA_RAPIDJSON_REG_OBJECT);
+        lua_setmetatable(L, -2);
+
+        *stack_.template Push<Ctx>(1) = context_;
+        context_ = Ctx::Object();
+        return true;
+#if !defined(LUA_RAPIDJSON_UNSAFE)
+      }
+      return false;
+#endif
+    }
+
+    RAPIDJSON_FORCEINLINE bool Key(const char *str, SizeType length, bool copy) {
+      JSON_UNUSED(copy);
+      if (pointer_ != RAPIDJSON_NULLPTR)
+        key_match_ = depth_ == on_path_ && offset_ < pointer_len_ && TokenMatch(str, length);
+
+      lua_pushlstring(L, str, length);
+      if (ordered_ && context_.mode == Ctx::kObject)
+        RecordKey();
+      return true;
+    }
+
+    LUA_JSON_HANDLE(EndObject, SizeType memberCount) {
+      JSON_UNUSED(memberCount);
+      if (pointer_ != RAPIDJSON_NULLPTR)
+        PathLeave();
+
+      const bool is_row = context_.mode == Ctx::kRow;
+      if (internarg > 0 && !is_row)
+        HashCons(false);
+
+      context_ = *stack_.template Pop<Ctx>(1);
+      if (is_row)  // Members have already been appended to each column.
+        context_.index++;
+      else
+        LUA_JSON_SUBMIT();
+      return true;
+    }
+
+    RAPIDJSON_FORCEINLINE bool StartArray(SizeType capacity = 0) {
+      if (context_.IsDeferred())
+        Resolve();
+
+      /* Defer table creation until the element types are known */
+      const bool columnar = (pointer_ != RAPIDJSON_NULLPTR) && PathEnter();
+      if (columnar || (flags & JSON_TYPED_ARRAYS)) {
+        if (columnar) {
+          json_checkstack(L, 2);
+          lua_createtable(L, 0, 0);  // columns are keyed by member name
+          if (objectarg > 0)
+            lua_pushvalue(L, objectarg);
+          else
+            luaL_getmetatable(L, LUA_RAPIDJSON_REG_OBJECT);
+          lua_setmetatable(L, -2);
+        }
+
+        *stack_.template Push<Ctx>(1) = context_;
+        context_ = columnar ? Ctx::Columns() : Ctx::Typed();
+        return true;
+      }
+
+#if !defined(LUA_RAPIDJSON_UNSAFE)
+      if (lua_checkstack(L, 2)) { /* ensure room on the stack */
+#endif
+        lua_createtable(L, static_cast<int>(capacity), 0); /* mark as array */
+        if (arrayarg > 0)
+          lua_pushvalue(L, arrayarg);
+        else
+          luaL_getmetatable(L, LUA_RAPIDJSON_REG_ARRAY);
+        lua_setmetatable(L, -2);
+
+        *stack_.template Push<Ctx>(1) = context_;
+        context_ = Ctx::Array();
+        return true;
+#if !defined(LUA_RAPIDJSON_UNSAFE)
+      }
+      return false;
+#endif
+    }
+
+    LUA_JSON_HANDLE(EndArray, SizeType elementCount) {
+      lua_assert(elementCount == context_.index);
+      JSON_UNUSED(elementCount);
+      if (pointer_ != RAPIDJSON_NULLPTR)
+        PathLeave();
+
+      if (context_.mode == Ctx::kTyped) {
+        if (context_.index > 0)
+          PushTypedArray();
+        else
+          Materialize();  // Empty arrays remain tables
+      }
+      else if (context_.mode == Ctx::kColumns && (context_.index == 0 || !CountRows()))
+        Decolumnize();
+
+      if (internarg > 0 && context_.mode == Ctx::kArray)
+        HashCons(true);
+
+      context_ = *stack_.template Pop<Ctx>(1);
+      LUA_JSON_SUBMIT();
+      return true;
+    }
+  };
+
+  /// <summary>
+  /// A compiled JSONPath expression: the subset of child (".name", "['name']"),
+  /// index ("[0]"), wildcard (".*", "[*]"), and recursive descent ("..name",
+  /// "..*", "..[0]") segments. The set of steps matched by an ancestor chain is
+  /// a bitmask, i.e., bit "i" set means the first "i" steps have been matched.
+  /// </summary>
+  struct JSONPath {
+    enum Type {
+      kName,
+      kIndex,
+      kWildcard,
+    };
+
+    struct Step {
+      Type type;
+      bool descendant;  // Step may match at any depth below the previous one
+      const char *name;  // kName: member name (not owned)
+      size_t name_len;
+      SizeType index;  // kIndex: array index
+    };
+
+    Step steps[LUA_RAPIDJSON_QUERY_STEPS];
+    int count;
+
+    JSONPath() : count(0) { }
+
+    /// <summary>
+    /// Compile "path"; returning an error message or NULL on success. Names
+    /// reference "path", which must outlive the expression.
+    /// </summary>
+    const char *Compile(const char *path, size_t len) {
+      size_t i = 1;
+      if (len == 0 || path[0] != '$')
+        return "JSONPath must begin with '$'";
+
+      count = 0;
+      while (i < len) {
+        if (count == LUA_RAPIDJSON_QUERY_STEPS)
+          return "JSONPath has too many segments";
+
+        Step &step = steps[count++];
+        step.type = kWildcard;
+        step.descendant = false;
+        step.name = RAPIDJSON_NULLPTR;
+        step.name_len = 0;
+        step.index = 0;
+        if (path[i] == '.') {
+          if (++i < len && path[i] == '.') {
+            step.descendant = true;
+            ++i;
+          }
+
+          if (i < len && path[i] == '*') {
+            ++i;
+            continue;
+          }
+          else if (!(i < len && path[i] == '[' && step.descendant)) {  // "..[...]" falls through
+            const size_t begin = i;
+            while (i < len && path[i] != '.' && path[i] != '[')
+              ++i;
+            if (i == begin)
+              return "JSONPath member name expected";
+
+            step.type = kName;
+            step.name = path + begin;
+            step.name_len = i - begin;
+            continue;
+          }
+        }
+
+        if (i >= len || path[i] != '[')
+          return "JSONPath segment expected";
+
+        if (++i < len && path[i] == '*')
+          ++i;
+        else if (i < len && (path[i] == '\'' || path[i] == '"')) {
+          const char quote = path[i++];
+          const size_t begin = i;
+          while (i < len && path[i] != quote)
+            ++i;
+          if (i >= len)
+            return "JSONPath unterminated member name";
+
+          step.type = kName;
+          step.name = path + begin;
+          step.name_len = (i++) - begin;
+        }
+        else {
+          const size_t begin = i;
+          uint64_t index = 0;
+          for (; i < len && path[i] >= '0' && path[i] <= '9'; ++i) {
+            if ((index = index * 10 + static_cast<unsigned>(path[i] - '0')) > 0xFFFFFFFEu)
+              return "JSONPath index out of range";
+          }
+          if (i == begin)
+            return "JSONPath index expected (negative indices and slices are unsupported)";
+
+          step.type = kIndex;
+          step.index = static_cast<SizeType>(index);
+        }
+
+        if (i >= len || path[i++] != ']')
+          return "JSONPath ']' expected";
+      }
+      return RAPIDJSON_NULLPTR;
+    }
+
+    /// <summary>
+    /// Return the bitmask of states after descending from a value whose states
+    /// are "states" into its member "name" (or element "index" if name is NULL).
+    /// </summary>
+    RAPIDJSON_FORCEINLINE uint64_t Next(uint64_t states, const char *name, size_t name_len, SizeType index) const {
+      uint64_t next = 0;
+      for (int i = 0; i < count && (states >> i) != 0; ++i) {
+        if (!((states >> i) & 1))
+          continue;
+
+        const Step &step = steps[i];
+        if (step.descendant)
+          next |= static_cast<uint64_t>(1) << i;
+
+        switch (step.type) {
+          case kWildcard:
+            next |= static_cast<uint64_t>(1) << (i + 1);
+            break;
+          case kName:
+            if (name != RAPIDJSON_NULLPTR && name_len == step.name_len && std::memcmp(name, step.name, name_len) == 0)
+              next |= static_cast<uint64_t>(1) << (i + 1);
+            break;
+          case kIndex:
+            if (name == RAPIDJSON_NULLPTR && index == step.index)
+              next |= static_cast<uint64_t>(1) << (i + 1);
+            break;
+          default:
+            break;
+        }
+      }
+      return next;
+    }
+
+    /// <summary>
+    /// Return true if "states" denotes a value matched by the entire path.
+    /// </summary>
+    RAPIDJSON_FORCEINLINE bool Matches(uint64_t states) const {
+      return ((states >> count) & 1) != 0;
+    }
+  };
+
+  /// <summary>
+  /// SAX Handler that evaluates a JSONPath over a stream: values are only
+  /// decoded (by a nested Decoder) while they are matched by the path, or are
+  /// within a matched value. Everything else is parsed and discarded, i.e.,
+  /// memory is bounded by the nesting depth of the document and the size of
+  /// the matched values.
+  ///
+  /// Matched values are stored in the table at "resultarg" in document order.
+  /// With a function at "callbackarg", they are instead passed to it in
+  /// document order, stopping the query if it returns false: matches within a
+  /// matched container are stored until it is complete and then passed after
+  /// it (see Flush).
+  /// </summary>
+  template<typename StackAllocator>
+  struct Query {
+private:
+    struct Frame {
+      uint64_t states;  // States of this container
+      SizeType index;  // Index of the next array element
+      bool object;
+      bool matched;  // Container is matched by the path
+      lua_Integer seq;  // Result index of a matched container
+    };
+
+    lua_State *L;
+    const JSONPath &path_;
+    internal::Stack<StackAllocator> &stack_;
+    internal::Stack<StackAllocator> &scratch_;
+    internal::Stack<StackAllocator> &frames_;  // Open containers
+    lua_Integer flags_;
+    int nullarg_;
+    int resultarg_;  // Stack index of the result table
+    int callbackarg_;  // Stack index of the result function
+    Decoder<StackAllocator> decoder_;  // Decoder of the outermost matched value
+
+    uint64_t pending_;  // States of the object member whose key was just parsed
+    int capture_;  // Number of open containers being decoded
+    lua_Integer count_;  // Number of matched values
+    bool stopped_;  // Callback requested the query to stop
+
+    /// <summary>
+    /// Compute the states of the value being parsed; returning true if matched.
+    /// </summary>
+    RAPIDJSON_FORCEINLINE bool Enter(uint64_t &states) {
+      if (frames_.Empty())
+        states = 1;
+      else {
+        Frame *parent = frames_.template Top<Frame>();
+        if (parent->object)
+          states = pending_;
+        else
+          states = (parent->states == 0) ? 0 : path_.Next(parent->states, RAPIDJSON_NULLPTR, 0, parent->index);
+        parent->index++;
+      }
+      return path_.Matches(states);
+    }
+
+    /// <summary>
+    /// Pass the matched value on top of the stack to the callback; popping it.
+    /// </summary>
+    bool Call() {
+      json_checkstack(L, 2);
+      lua_pushvalue(L, callbackarg_);  // [..., value, callback]
+      lua_insert(L, -2);  // [..., callback, value]
+      json_call(L, 1, 1);  // [..., result]
+
+      stopped_ = lua_isboolean(L, -1) && !lua_toboolean(L, -1);
+      lua_pop(L, 1);
+      return !stopped_;
+    }
+
+    /// <summary>
+    /// Pass the stored matches "from" onwards, i.e., those within the matched
+    /// container just passed, to the callback in document order.
+    /// </summary>
+    bool Flush(lua_Integer from) {
+      json_checkstack(L, 2);
+      for (lua_Integer seq = from; seq <= count_; ++seq) {
+        lua_pushinteger(L, seq);
+        lua_rawget(L, resultarg_);  // [..., value]
+        lua_pushinteger(L, seq);
+        lua_pushnil(L);
+        lua_rawset(L, resultarg_);
+        if (!Call())
+          return false;
+      }
+      return true;
+    }
+
+    /// <summary>
+    /// Pass the matched value on top of the stack to the callback or store it
+    /// in the result table; popping it. Callbacks are deferred within a matched
+    /// container (see Flush).
+    /// </summary>
+    bool Emit(lua_Integer seq) {
+      if (callbackarg_ > 0 && capture_ == 0)
+        return Call();
+
+#if LUA_VERSION_NUM >= 503
+      lua_rawseti(L, resultarg_, seq);
+#else
+      lua_pushinteger(L, seq);  // [..., value, seq]
+      lua_insert(L, -2);  // [..., seq, value]
+      lua_rawset(L, resultarg_);
+#endif
+      return true;
+    }
+
+    /// <summary>
+    /// Handle a scalar value: "submit" invokes the corresponding Decoder event.
+    /// </summary>
+    template<typename Submit>
+    RAPIDJSON_FORCEINLINE bool Scalar(const Submit &submit) {
+      uint64_t states = 0;
+      if (Enter(states)) {
+        Decoder<StackAllocator> value(L, stack_, scratch_, flags_, nullarg_);
+        if (!submit(value) || !Emit(++count_))
+          return false;
+      }
+      return capture_ == 0 || submit(decoder_);
+    }
+
+    bool Start(bool object) {
+      uint64_t states = 0;
+      const bool matched = Enter(states);
+
+      Frame *frame = frames_.template Push<Frame>();
+      frame->states = states;
+      frame->index = 0;
+      frame->object = object;
+      frame->matched = matched;
+      frame->seq = matched ? ++count_ : 0;
+      if (matched || capture_ > 0) {
+        capture_++;
+        return object ? decoder_.StartObject() : decoder_.StartArray();
+      }
+      return true;
+    }
+
+    bool End(SizeType count) {
+      const Frame frame = *frames_.template Pop<Frame>(1);
+      if (capture_ > 0) {
+        if (frame.matched) {  // [..., container]
+          json_checkstack(L, 1);
+          lua_pushvalue(L, -1);
+          if (callbackarg_ > 0 && capture_ == 1) {  // Outermost matched container
+            if (!Call() || !Flush(frame.seq + 1))
+              return false;
+          }
+          else if (!Emit(frame.seq))
+            return false;
+        }
+
+        if (!(frame.object ? decoder_.EndObject(count) : decoder_.EndArray(count)))
+          return false;
+        if (--capture_ == 0)
+          lua_pop(L, 1);  // Outermost matched value has been emitted.
+      }
+      return true;
+    }
+
+public:
+    Query(lua_State *L_, const JSONPath &path, internal::Stack<StackAllocator> &_stack, internal::Stack<StackAllocator> &_scratch, internal::Stack<StackAllocator> &_frames, lua_Integer _flags, int _nullidx, int _resultidx, int _callbackidx)
+      : L(L_), path_(path), stack_(_stack), scratch_(_scratch), frames_(_frames), flags_(_flags & ~JSON_TYPED_ARRAYS), nullarg_(_nullidx),
+        resultarg_(_resultidx), callbackarg_(_callbackidx), decoder_(L_, _stack, _scratch, _flags & ~JSON_TYPED_ARRAYS, _nullidx),
+        pending_(0), capture_(0), count_(0), stopped_(false) {
+    }
+
+    /// <summary>
+    /// Number of matched values
+    /// </summary>
+    lua_Integer Count() const { return count_; }
+
+    /// <summary>
+    /// Return true if the query was stopped by the callback.
+    /// </summary>
+    bool Stopped() const { return stopped_; }
+
+    bool Null() { return Scalar([](Decoder<StackAllocator> &d) { return d.Null(); }); }
+    bool Bool(bool b) { return Scalar([b](Decoder<StackAllocator> &d) { return d.Bool(b); }); }
+    bool Int(int i) { return Scalar([i](Decoder<StackAllocator> &d) { return d.Int(i); }); }
+    bool Uint(unsigned u) { return Scalar([u](Decoder<StackAllocator> &d) { return d.Uint(u); }); }
+    bool Int64(int64_t i) { return Scalar([i](Decoder<StackAllocator> &d) { return d.Int64(i); }); }
+    bool Uint64(uint64_t u) { return Scalar([u](Decoder<StackAllocator> &d) { return d.Uint64(u); }); }
+    bool Double(double n) { return Scalar([n](Decoder<StackAllocator> &d) { return d.Double(n); }); }
+
+    bool RawNumber(const char *str, SizeType length, bool copy) {
+      return Scalar([str, length, copy](Decoder<StackAllocator> &d) { return d.RawNumber(str, length, copy); });
+    }
+
+    bool String(const char *str, SizeType length, bool copy) {
+      return Scalar([str, length, copy](Decoder<StackAllocator> &d) { return d.String(str, length, copy); });
+    }
+
+    bool Key(const char *str, SizeType length, bool copy) {
+      const Frame *parent = frames_.template Top<Frame>();
+      pending_ = (parent->states == 0) ? 0 : path_.Next(parent->states, str, length, 0);
+      return capture_ == 0 || decoder_.Key(str, length, copy);
+    }
+
+    bool StartObject() { return Start(true); }
+    bool EndObject(SizeType memberCount) { return End(memberCount); }
+    bool StartArray() { return Start(false); }
+    bool EndArray(SizeType elementCount) { return End(elementCount); }
+  };
+
+#if LUA_RAPIDJSON_KEY_CACHE > 0
+  /// <summary>
+  /// Direct-mapped cache of encoded object keys, i.e., the quoted "key" bytes,
+  /// indexed by the address of the (interned) Lua string. Records of the same
+  /// shape then write each key with a single copy instead of escaping it.
+  ///
+  /// Only keys that need no escaping are cached, so an entry is its key between
+  /// quotes. Entries are verified against the key contents: the address of a
+  /// collected string may be reused by another.
+  /// </summary>
+  class KeyCache {
+  public:
+    struct Entry {
+      const char *key;  // Address of the Lua string
+      size_t size;  // Size of the encoded key, i.e., its length plus two quotes
+      char encoded[LUA_RAPIDJSON_KEY_CACHE_LEN + 2];
+    };
+
+    KeyCache() {
+      for (size_t i = 0; i < LUA_RAPIDJSON_KEY_CACHE; ++i) {
+        entries_[i].key = RAPIDJSON_NULLPTR;
+        entries_[i].size = 0;
+      }
+    }
+
+    /// <summary>
+    /// Return the entry of the key; creating it if the key can be cached and
+    /// returning NULL otherwise.
+    /// </summary>
+    RAPIDJSON_FORCEINLINE const Entry *Get(const char *key, size_t len) {
+      Entry &entry = entries_[(reinterpret_cast<uintptr_t>(key) >> 4) % LUA_RAPIDJSON_KEY_CACHE];
+      if (entry.key == key && entry.size == len + 2 && memcmp(entry.encoded + 1, key, len) == 0)
+        return &entry;
+      return Insert(entry, key, len);
+    }
+
+  private:
+    const Entry *Insert(Entry &entry, const char *key, size_t len) {
+      if (len > LUA_RAPIDJSON_KEY_CACHE_LEN)
+        return RAPIDJSON_NULLPTR;
+
+      for (size_t i = 0; i < len; ++i) {
+        const unsigned char c = static_cast<unsigned char>(key[i]);
+        if (c < 0x20 || c == '"' || c == '\\')  // Requires escaping
+          return RAPIDJSON_NULLPTR;
+      }
+
+      entry.key = key;
+      entry.size = len + 2;
+      entry.encoded[0] = '"';
+      memcpy(entry.encoded + 1, key, len);
+      entry.encoded[len + 1] = '"';
+      return &entry;
+    }
+
+    Entry entries_[LUA_RAPIDJSON_KEY_CACHE];
+  };
+#else
+  class KeyCache { };
+#endif
+
+  /// <summary>
+  /// Per-encode cache of the JSON metafields (JSON_META_* bits) present in the
+  /// metatables encountered, indexed by metatable address. Tables mostly share
+  /// a few metatables (e.g., those of decoded arrays and objects), so a table
+  /// needs a lua_getmetatable and a short search instead of a hashed lookup
+  /// for each metafield.
+  ///
+  /// Metatables are assumed not to change during an encode; the cache is not
+  /// kept between calls. The metatables are not anchored: a Lua function called
+  /// by the encoder may let one be collected and its address reused, so the
+  /// cache is cleared after each such call.
+  /// </summary>
+  class MetaCache {
+  public:
+    MetaCache() : count_(0), next_(0) { }
+
+    void Clear() { count_ = next_ = 0; }
+
+    /// <summary>
+    /// Return the JSON_META_* bits of the metatable of the table at "idx"; zero
+    /// if the table has no metatable.
+    /// </summary>
+    int Get(lua_State *L, int idx) {
+      if (!lua_getmetatable(L, idx))  // [..., meta]
+        return 0;
+
+      const void *meta = lua_topointer(L, -1);
+      for (size_t i = 0; i < count_; ++i) {
+        if (entries_[i].meta == meta) {
+          lua_pop(L, 1);
+          return entries_[i].fields;
+        }
+      }
+
+      int fields = 0;
+      json_checkstack(L, 1);
+      lua_pushliteral(L, LUA_RAPIDJSON_META_TOJSON);
+      lua_rawget(L, -2);  // [..., meta, tojson]
+      fields |= lua_isnil(L, -1) ? 0 : JSON_META_TOJSON;
+      lua_pop(L, 1);
+
+      lua_pushliteral(L, LUA_RAPIDJSON_META_TYPE);
+      lua_rawget(L, -2);  // [..., meta, jsontype]
+      if (lua_type(L, -1) == LUA_TSTRING) {
+        fields |= JSON_META_TYPE;
+        if (strcmp(lua_tostring(L, -1), LUA_RAPIDJSON_META_TYPE_ARRAY) == 0)
+          fields |= JSON_META_ARRAY;
+      }
+      lua_pop(L, 1);
+
+      lua_pushliteral(L, LUA_RAPIDJSON_META_ORDER);
+      lua_rawget(L, -2);  // [..., meta, order]
+      fields |= lua_isnil(L, -1) ? 0 : JSON_META_ORDER;
+      lua_pop(L, 1);
+
+      lua_pushliteral(L, LUA_RAPIDJSON_META_VERSION);
+      lua_rawget(L, -2);  // [..., meta, version]
+      fields |= lua_isnil(L, -1) ? 0 : JSON_META_VERSION;
+      lua_pop(L, 1);
+
+      lua_pushliteral(L, "__metatable");
+      lua_rawget(L, -2);  // [..., meta, protected]
+      if (lua_type(L, -1) == LUA_TSTRING && strcmp(lua_tostring(L, -1), LUA_RAPIDJSON_META_READONLY) == 0)
+        fields |= JSON_META_PROXY;
+      lua_pop(L, 2);  // [...]
+
+      /* Replace the oldest entry once full */
+      Entry &entry = entries_[(count_ < LUA_RAPIDJSON_META_CACHE) ? count_++ : (next_++ % LUA_RAPIDJSON_META_CACHE)];
+      entry.meta = meta;
+      entry.fields = fields;
+      return fields;
+    }
+
+  private:
+    struct Entry {
+      const void *meta;  // Address of the metatable
+      int fields;  // JSON_META_* bits
+    };
+
+    Entry entries_[LUA_RAPIDJSON_META_CACHE];
+    size_t count_;  // Number of entries in use
+    size_t next_;  // Next entry replaced once full
+  };
+
+  /// <summary>
+  /// Sorted key orders of the objects encoded with "sort_keys". Tables built the
+  /// same way (same keys, same insertion history) traverse their keys in the
+  /// same order, so the permutation that sorted one is remembered under a
+  /// signature of its traversal. A remembered permutation is only used once it
+  /// is confirmed to produce strictly ascending keys; otherwise the keys are
+  /// sorted and the permutation replaced.
+  ///
+  /// The signature is only a hint, e.g., string keys are identified by their
+  /// length and last bytes. The cache is not kept between calls.
+  /// </summary>
+  class SortCache {
+  public:
+    SortCache() : count_(0), next_(0) { }
+
+    void Sort(std::vector<Key> &keys) {
+#if LUA_RAPIDJSON_SORT_CACHE > 0
+      const size_t n = keys.size();
+      if (n >= LUA_RAPIDJSON_SORT_CACHE_MIN) {
+        uint64_t signature = hash_mix(static_cast<uint64_t>(n));
+        for (size_t i = 0; i < n; ++i)
+          signature = hash_mix(signature ^ Bits(keys[i]));
+
+        Entry *entry = RAPIDJSON_NULLPTR;
+        for (size_t i = 0; i < count_ && entry == RAPIDJSON_NULLPTR; ++i) {
+          if (entries_[i].signature == signature && entries_[i].permutation.size() == n)
+            entry = &entries_[i];
+        }
+
+        if (entry != RAPIDJSON_NULLPTR) {
+          sorted_.resize(n);
+          bool ascending = true;
+          for (size_t i = 0; i < n && ascending; ++i) {
+            sorted_[i] = keys[entry->permutation[i]];
+            ascending = i == 0 || sorted_[i - 1] < sorted_[i];
+          }
 
-      lua_pushlstring(L, str, length);
-      LUA_JSON_SUBMIT();
-      return true;
-    }
+          if (ascending) {
+            keys.swap(sorted_);
+            return;
+          }
+        }
+        else {  // Replace the oldest entry once full
+          entry = &entries_[(count_ < LUA_RAPIDJSON_SORT_CACHE) ? count_++ : (next_++ % LUA_RAPIDJSON_SORT_CACHE)];
+        }
 
-    RAPIDJSON_FORCEINLINE bool StartObject() {
-#if !defined(LUA_RAPIDJSON_UNSAFE)
-      if (lua_checkstack(L, 2)) {  // ensure room on the stack
-#endif
-        lua_createtable(L, 0, 0);  // mark as object
-        if (objectarg > 0)
-          lua_pushvalue(L, objectarg);
-        else
-          luaL_getmetatable(L, LUA_RAPIDJSON_REG_OBJECT);
-        lua_setmetatable(L, -2);
+        entry->signature = signature;
+        entry->permutation.resize(n);
+        for (size_t i = 0; i < n; ++i)
+          entry->permutation[i] = i;
+        std::sort(entry->permutation.begin(), entry->permutation.end(), Less(keys));
 
-        *stack_.template Push<Ctx>(1) = context_;
-        context_ = Ctx::Object();
-        return true;
-#if !defined(LUA_RAPIDJSON_UNSAFE)
+        sorted_.resize(n);
+        for (size_t i = 0; i < n; ++i)
+          sorted_[i] = keys[entry->permutation[i]];
+        keys.swap(sorted_);
+        return;
       }
-      return false;
 #endif
+      std::sort(keys.begin(), keys.end());
     }
 
-    RAPIDJSON_FORCEINLINE bool Key(const char *str, SizeType length, bool copy) const {
-      JSON_UNUSED(copy);
-      lua_pushlstring(L, str, length);
-      return true;
+  private:
+    static RAPIDJSON_FORCEINLINE uint64_t Bits(const Key &k) {
+#if LUA_VERSION_NUM >= 503
+      if (k.is_integer)
+        return static_cast<uint64_t>(k.data.i);
+#endif
+      if (k.is_number) {
+        const double d = static_cast<double>(k.data.n);
+        uint64_t bits = 0;
+        std::memcpy(&bits, &d, sizeof(bits));
+        return bits;
+      }
+
+      /* Long strings are not interned: identify strings by length and tail */
+      uint64_t tail = 0;
+      const size_t len = k.data.s.len, n = (len < sizeof(tail)) ? len : sizeof(tail);
+      std::memcpy(&tail, k.data.s.key + (len - n), n);
+      return tail ^ static_cast<uint64_t>(len);
     }
 
-    LUA_JSON_HANDLE(EndObject, SizeType memberCount) {
-      JSON_UNUSED(memberCount);
+    struct Less {
+      const std::vector<Key> &keys;
+      Less(const std::vector<Key> &_keys) : keys(_keys) { }
+      bool operator()(size_t a, size_t b) const { return keys[a] < keys[b]; }
+    };
 
-      context_ = *stack_.template Pop<Ctx>(1);
-      LUA_JSON_SUBMIT();
-      return true;
-    }
+#if LUA_RAPIDJSON_SORT_CACHE > 0
+    struct Entry {
+      uint64_t signature;  // Key count and traversal order
+      std::vector<size_t> permutation;  // Offsets of the traversed keys in sorted order
+    };
 
-    RAPIDJSON_FORCEINLINE bool StartArray() {
-#if !defined(LUA_RAPIDJSON_UNSAFE)
-      if (lua_checkstack(L, 2)) { /* ensure room on the stack */
+    Entry entries_[LUA_RAPIDJSON_SORT_CACHE];
 #endif
-        lua_createtable(L, 0, 0); /* mark as array */
-        if (arrayarg > 0)
-          lua_pushvalue(L, arrayarg);
-        else
-          luaL_getmetatable(L, LUA_RAPIDJSON_REG_ARRAY);
-        lua_setmetatable(L, -2);
+    std::vector<Key> sorted_;  // Scratch space
+    size_t count_;  // Number of entries in use
+    size_t next_;  // Next entry replaced once full
+  };
 
-        *stack_.template Push<Ctx>(1) = context_;
-        context_ = Ctx::Array();
-        return true;
-#if !defined(LUA_RAPIDJSON_UNSAFE)
-      }
-      return false;
-#endif
-    }
+  /// <summary>
+  /// A Writer whose JSON_HOT_FLAGS are the template parameter "Flags" rather
+  /// than the flags of the json.encode call, so that the Encoder tests them as
+  /// constants. See EncoderData::Write for the combinations instantiated.
+  /// </summary>
+  template<typename Base, lua_Integer Flags>
+  class FlagWriter : public Base {
+  public:
+    using Base::Base;
+  };
 
-    LUA_JSON_HANDLE(EndArray, SizeType elementCount) {
-      lua_assert(elementCount == context_.index);
-      JSON_UNUSED(elementCount);
+  template<typename Writer>
+  struct WriterFlags {
+    static const lua_Integer kMask = 0;  // Flags fixed by the writer type
+    static const lua_Integer kFlags = 0;
 
-      context_ = *stack_.template Pop<Ctx>(1);
-      LUA_JSON_SUBMIT();
-      return true;
-    }
+    /* Another writer type that fixes the same flags */
+    template<typename Other>
+    using Rebind = Other;
+  };
+
+  template<typename Base, lua_Integer Flags>
+  struct WriterFlags<FlagWriter<Base, Flags>> {
+    static const lua_Integer kMask = JSON_HOT_FLAGS;
+    static const lua_Integer kFlags = Flags & JSON_HOT_FLAGS;
+
+    template<typename Other>
+    using Rebind = FlagWriter<Other, Flags>;
   };
 
+#if defined(LUA_RAPIDJSON_THREADS)
+  class Snapshot;
+#endif
+
   class Encoder {
+#if defined(LUA_RAPIDJSON_THREADS)
+    friend class Snapshot;  // Formats the doubles it records
+#endif
 private:
     lua_Integer flags;  // Configuration flags
     int max_depth;  // Maximum recursive depth
     int error_handler_idx;  // (Positive) stack index of the error handling function
-    std::vector<LuaSAX::Key> &order;  // Key-ordering list
+    KeyOrder order;  // Key-ordering list
+    KeyCache *keys;  // Encoded key cache; NULL if unavailable
+    mutable MetaCache metas;  // Metafields of the metatables encountered
+    mutable SortCache sorts;  // Sorted orders of the "sort_keys" objects encountered
+    bool memoize;  // Tables with a __jsonversion metafield are memoized
+    mutable int memo_frame;  // (Absolute) stack index of the memoized entry being encoded; zero otherwise
+    int fixed_decimals;  // Doubles are rounded to this many decimal places; zero otherwise
+    bool tentative;  // Restart, rather than call metafunctions (see SetTentative)
+
+    /// <summary>
+    /// Return true if the configuration "flag" is set; JSON_HOT_FLAGS are
+    /// constants when encoding with a FlagWriter.
+    /// </summary>
+    template<typename Writer>
+    bool has(lua_Integer flag) const {
+      typedef WriterFlags<Writer> Fixed;
+      return ((flag & Fixed::kMask) ? (Fixed::kFlags & flag) : (flags & flag)) != 0;
+    }
+
+    /// <summary>
+    /// Format a finite double according to the "fixed_decimals" and then the
+    /// float formatting flags, returning the end of the output.
+    /// </summary>
+    template<typename Writer>
+    char *formatDouble(double d, char *buffer, int maxDecimalPlaces) const {
+      if (fixed_decimals > 0) {
+        char *end = extend::FixedDtoa(d, fixed_decimals, buffer);
+        if (end != RAPIDJSON_NULLPTR)
+          return end;
+        return extend::Dtoa(d, buffer, fixed_decimals);  // Out of range: |d| * 10^fixed_decimals >= 2^52
+      }
+      else if (has<Writer>(JSON_LUA_DTOA))
+        return const_cast<char *>(lua_dtoa(buffer, MAXNUMBER2STR, d));
+      return extend::Dtoa(has<Writer>(JSON_LUA_GRISU) ? lua_grisuRound(d) : d, buffer, maxDecimalPlaces);
+    }
 
     /// <summary>
     /// Encode a LuaSAX::Key
@@ -743,28 +2457,30 @@ private:
         }
 
         char buffer[MAXNUMBER2STR + 2] = { 0 };
-        const char *end = buffer;
-        if (flags & JSON_LUA_DTOA)
-          end = lua_dtoa(buffer, MAXNUMBER2STR, d);
-        else {
-          const double _d = (flags & JSON_LUA_GRISU) ? lua_grisuRound(d) : d;
-          end = internal::dtoa(_d, buffer, writer.GetMaxDecimalPlaces());
-        }
+        const char *end = formatDouble<Writer>(d, buffer, writer.GetMaxDecimalPlaces());
         return writer.Key(buffer, static_cast<SizeType>(end - buffer));
       }
+#if LUA_RAPIDJSON_KEY_CACHE > 0
+      if (keys != RAPIDJSON_NULLPTR) {
+        const KeyCache::Entry *entry = keys->Get(key.data.s.key, key.data.s.len);
+        if (entry != RAPIDJSON_NULLPTR)
+          return writer.RawValue(entry->encoded, entry->size, kStringType);
+      }
+#endif
       return writer.Key(key.data.s.key, static_cast<SizeType>(key.data.s.len));
     }
 
     /// <summary>
     /// Append all keys of the given table (at stack index "idx") that are not
-    /// contained in the ordering list ("key_order") to the provided sink.
+    /// contained in the ordering list ("key_order") to the provided sink, and
+    /// the ascending offsets (in "key_order") of those that are to "found".
     ///
-    /// NOTE: It's assumed the "order" table is never of significant size (i.e,
-    /// less than thirty elements), where more efficient searching structures are
-    /// required.
+    /// NOTE: Uncompiled ordering lists are searched linearly; larger lists
+    /// should be compiled with json.keyorder.
     /// </summary>
-    void populate_unordered_vector(lua_State *L, int idx, const std::vector<LuaSAX::Key> &key_order, std::vector<LuaSAX::Key> &sink) const {
+    void populate_unordered_vector(lua_State *L, int idx, const KeyOrder &key_order, std::vector<LuaSAX::Key> &sink, std::vector<size_t> &found) const {
       const int i_idx = json_rel_index(idx, 1);  // Account for key
+      const LuaSAX::Key *ordered = RAPIDJSON_NULLPTR;
       json_checkstack(L, 3);
 
       lua_pushnil(L);
@@ -773,13 +2489,15 @@ private:
           case LUA_TNUMBER: {
             LuaSAX::Key k;
 #if LUA_VERSION_NUM >= 503
-            if (lua_isinteger(L, -1))
-              k = LuaSAX::Key(lua_tointeger(L, -1));
+            if (lua_isinteger(L, -2))
+              k = LuaSAX::Key(lua_tointeger(L, -2));
             else
 #endif
             k = LuaSAX::Key(lua_tonumber(L, -2));
-            if (std::find_if(key_order.begin(), key_order.end(), k) == key_order.end())
+            if ((ordered = key_order.Find(k)) == RAPIDJSON_NULLPTR)
               sink.push_back(k);
+            else
+              found.push_back(static_cast<size_t>(ordered - key_order.begin()));
             break;
           }
           case LUA_TSTRING: {
@@ -787,8 +2505,10 @@ private:
             const char *s = lua_tolstring(L, -2, &len);
 
             LuaSAX::Key k(s, len);
-            if (std::find_if(key_order.begin(), key_order.end(), k) == key_order.end())
+            if ((ordered = key_order.Find(k)) == RAPIDJSON_NULLPTR)
               sink.push_back(k);
+            else
+              found.push_back(static_cast<size_t>(ordered - key_order.begin()));
             break;
           }
           default:
@@ -800,6 +2520,36 @@ private:
 
         lua_pop(L, 1);  // [..., key]
       }
+      std::sort(found.begin(), found.end());
+    }
+
+    /// <summary>
+    /// Return true if the ordering list at "order_idx" ("count" distinct keys)
+    /// accounts for every key of the table at "idx", i.e., no key needs to be
+    /// searched for when encoding the table.
+    /// </summary>
+    static bool contains_all_keys(lua_State *L, int idx, int order_idx, size_t count) {
+      const int t_idx = json_rel_index(idx, 1);  // Account for key
+      json_checkstack(L, 3);
+
+      size_t present = 0;
+      for (size_t i = 1; i <= count; ++i) {
+        lua_rawgeti(L, order_idx, static_cast<int>(i));  // [..., key]
+        lua_rawget(L, t_idx);  // [..., value]
+        present += lua_isnil(L, -1) ? 0 : 1;
+        lua_pop(L, 1);
+      }
+
+      size_t entries = 0;
+      lua_pushnil(L);
+      while (lua_next(L, t_idx)) {  // [..., key, value]
+        if (++entries > present) {
+          lua_pop(L, 2);
+          return false;
+        }
+        lua_pop(L, 1);  // [..., key]
+      }
+      return entries == present;
     }
 
     /// <summary>
@@ -816,6 +2566,7 @@ private:
         lua_pushstring(L, reason);  // [..., function, reason]
         lua_pushvalue(L, json_rel_index(idx, 2));  // [..., function, reason, value]
         json_call(L, 2, 2);  // [..., r_value, r_reason]
+        metas.Clear();
 
         if (lua_isnil(L, -2))
           *output = luaL_optstring(L, -1, RAPIDJSON_NULLPTR);
@@ -829,8 +2580,127 @@ private:
     }
 
 public:
-    Encoder(lua_Integer _flags, int _maxdepth, int _error_handler_idx, std::vector<LuaSAX::Key> &_order)
-      : flags(_flags), max_depth(_maxdepth), error_handler_idx(_error_handler_idx), order(_order) {
+    Encoder(lua_Integer _flags, int _maxdepth, int _error_handler_idx, const KeyOrder &_order, KeyCache *_keys = RAPIDJSON_NULLPTR)
+      : flags(_flags), max_depth(_maxdepth), error_handler_idx(_error_handler_idx), order(_order), keys(_keys),
+        memoize((_flags & JSON_PRETTY_PRINT) == 0 && _order.count == 0 && _error_handler_idx <= 0), memo_frame(0), fixed_decimals(0), tentative(false) {
+    }
+
+    /// <summary>
+    /// Round doubles to a fixed number of decimal places (json "fixed_decimals");
+    /// zero formats them in their shortest form.
+    /// </summary>
+    void SetFixedDecimals(int decimals) { fixed_decimals = decimals; }
+
+    /// <summary>
+    /// Throw LuaRestartException on tables with a __tojson, __jsonorder, or
+    /// __jsonversion metafield, so the encoding can be restarted without any
+    /// metafunction having been called.
+    /// </summary>
+    void SetTentative() { tentative = true; }
+
+    template<typename Writer>
+    void encodeInteger(Writer &writer, lua_Integer i) const {
+      if (has<Writer>(JSON_ENCODE_INT32)) {
+        if (has<Writer>(JSON_UNSIGNED_INTEGERS))
+          writer.Uint(static_cast<unsigned>(i));
+        else
+          writer.Int(static_cast<int>(i));
+      }
+      else {
+        if (has<Writer>(JSON_UNSIGNED_INTEGERS))
+          writer.Uint64(static_cast<uint64_t>(i));
+        else
+          writer.Int64(static_cast<int64_t>(i));
+      }
+    }
+
+    /// <summary>
+    /// Encode a floating point value. The "idx" parameter references the
+    /// original Lua value and is only used when the exception handler is
+    /// invoked.
+    /// </summary>
+    template<typename Writer>
+    void encodeNumber(lua_State *L, Writer &writer, int idx, int depth, lua_Number n) const {
+      const double d = static_cast<double>(n);
+      const bool is_inf = internal::Double(d).IsNanOrInf();
+
+      /*
+      ** Per DKJson:
+      **    if value ~= value or value >= huge or -value >= huge then
+      **      -- This is the behaviour of the original JSON implementation.
+      **      s = "null"
+      */
+#if defined(LUA_RAPIDJSON_COMPAT)
+      if (is_inf)
+        writer.Null();
+      else
+#endif
+      if (!is_inf) {
+        if (!writeDouble(writer, d))
+          throw LuaException("error encoding lua float");
+      }
+      else {
+        if (!writer.Double(d)) {
+          const char *output = RAPIDJSON_NULLPTR;
+          if (!handle_exception(L, writer, idx, depth, LUA_RAPIDJSON_ERROR_NUMBER, &output)) {
+            throw LuaException((output != RAPIDJSON_NULLPTR) ? output : "error encoding: kWriteNanAndInfFlag");
+          }
+        }
+      }
+    }
+
+    /// <summary>
+    /// Write a finite double formatted by formatDouble.
+    /// </summary>
+    template<typename Writer>
+    bool writeDouble(Writer &writer, double d) const {
+      char buffer[MAXNUMBER2STR + 2];
+      const char *end = formatDouble<Writer>(d, buffer, writer.GetMaxDecimalPlaces());
+      return writer.RawValue(buffer, static_cast<SizeType>(end - buffer), Type::kNumberType);
+    }
+
+    /// <summary>
+    /// Write the string "s" of the Lua value at stack index "idx".
+    /// </summary>
+    template<typename Writer>
+    bool writeString(lua_State *L, Writer &writer, int idx, const char *s, size_t len) const {
+      JSON_UNUSED(L);
+      JSON_UNUSED(idx);
+      return writer.String(s, static_cast<SizeType>(len));
+    }
+
+#if defined(LUA_RAPIDJSON_THREADS)
+    /* A Snapshot defers formatting doubles and references long strings */
+    bool writeDouble(Snapshot &writer, double d) const;
+    bool writeString(lua_State *L, Snapshot &writer, int idx, const char *s, size_t len) const;
+    size_t encodeNumberRun(lua_State *L, Snapshot &writer, int idx, size_t i, size_t array_length) const;
+#endif
+
+    /// <summary>
+    /// Encode the contents of a TypedArray (at stack index "idx") as a JSON array.
+    /// </summary>
+    template<typename Writer>
+    void encodeTypedArray(lua_State *L, Writer &writer, int idx, int depth, const LuaSAX::TypedArray &ta) const {
+      const LuaSAX::TypedArray::Element *data = ta.Data();
+
+      writer.StartArray();
+      if (ta.is_integer) {
+        for (size_t i = 0; i < ta.length; ++i)
+          encodeInteger(writer, data[i].i);
+      }
+      else {
+        for (size_t i = 0; i < ta.length; ++i) {
+          if (RAPIDJSON_LIKELY(!internal::Double(static_cast<double>(data[i].n)).IsNanOrInf()))
+            encodeNumber(L, writer, idx, depth, data[i].n);
+          else {  // Exception handlers must receive the element, not the array
+            json_checkstack(L, 1);
+            lua_pushnumber(L, data[i].n);
+            encodeNumber(L, writer, -1, depth, data[i].n);
+            lua_pop(L, 1);
+          }
+        }
+      }
+      writer.EndArray();
     }
 
     template<typename Writer>
@@ -843,57 +2713,16 @@ public:
           writer.Bool(lua_toboolean(L, idx) != 0);
           break;
         case LUA_TNUMBER: {
-          if (json_isinteger(L, idx)) {
-            if (flags & JSON_ENCODE_INT32) {
-              if (flags & JSON_UNSIGNED_INTEGERS)
-                writer.Uint(static_cast<unsigned>(lua_tointeger(L, idx)));
-              else
-                writer.Int(static_cast<int>(lua_tointeger(L, idx)));
-            }
-            else {
-              if (flags & JSON_UNSIGNED_INTEGERS)
-                writer.Uint64(static_cast<uint64_t>(lua_tointeger(L, idx)));
-              else
-                writer.Int64(static_cast<int64_t>(lua_tointeger(L, idx)));
-            }
-          }
-          else {
-            const double d = static_cast<double>(lua_tonumber(L, idx));
-            const bool is_inf = internal::Double(d).IsNanOrInf();
-
-            /*
-            ** Per DKJson:
-            **    if value ~= value or value >= huge or -value >= huge then
-            **      -- This is the behaviour of the original JSON implementation.
-            **      s = "null"
-            */
-#if defined(LUA_RAPIDJSON_COMPAT)
-            if (is_inf)
-              writer.Null();
-            else
-#endif
-            if ((flags & JSON_LUA_DTOA) && !is_inf) {
-              char buffer[MAXNUMBER2STR + 2] = { 0 };
-              const char *end = lua_dtoa(buffer, MAXNUMBER2STR, d);
-              if (!writer.RawValue(buffer, static_cast<SizeType>(end - buffer), Type::kNumberType))
-                throw LuaException("error encoding lua float");
-            }
-            else {
-              const double _d = ((flags & JSON_LUA_GRISU) && !is_inf) ? lua_grisuRound(d) : d;
-              if (!writer.Double(_d)) {
-                const char *output = RAPIDJSON_NULLPTR;
-                if (!handle_exception(L, writer, idx, depth, LUA_RAPIDJSON_ERROR_NUMBER, &output)) {
-                  throw LuaException((output != RAPIDJSON_NULLPTR) ? output : "error encoding: kWriteNanAndInfFlag");
-                }
-              }
-            }
-          }
+          if (json_isinteger(L, idx))
+            encodeInteger(writer, lua_tointeger(L, idx));
+          else
+            encodeNumber(L, writer, idx, depth, lua_tonumber(L, idx));
           break;
         }
         case LUA_TSTRING: {
           size_t len;
           const char *s = lua_tolstring(L, idx, &len);
-          if (!writer.String(s, static_cast<SizeType>(len)))
+          if (!writeString(L, writer, idx, s, len))
             throw LuaException("error encoding string");
           break;
         }
@@ -901,6 +2730,21 @@ public:
           encodeTable(L, writer, idx, depth + 1);
           break;
         }
+        case LUA_TUSERDATA: {
+          const LuaSAX::TypedArray *ta = LuaSAX::TypedArray::Test(L, idx);
+          if (ta != RAPIDJSON_NULLPTR) {
+            encodeTypedArray(L, writer, idx, depth, *ta);
+            break;
+          }
+
+          const LuaSAX::RawFragment *raw = LuaSAX::RawFragment::Test(L, idx);
+          if (raw != RAPIDJSON_NULLPTR) {
+            if (!writer.RawValue(raw->Data(), raw->length, Type::kObjectType))
+              throw LuaException("error encoding raw value");
+            break;
+          }
+          RAPIDJSON_DELIBERATE_FALLTHROUGH;  /* FALLTHROUGH */
+        }
 #if LUA_VERSION_NUM > 501
         case LUA_TFUNCTION: {
 #else
@@ -917,13 +2761,12 @@ public:
 #else
         case LUA_TFUNCTION:
 #endif
-        case LUA_TUSERDATA:
         case LUA_TTHREAD:
         case LUA_TNONE:
         default: {
           if (!encodeMetafield(L, writer, idx, depth)) {
             const char *output = RAPIDJSON_NULLPTR;
-            if ((flags & JSON_ENCODE_TYPE_IGNORE))
+            if (has<Writer>(JSON_ENCODE_TYPE_IGNORE))
               writer.Null();
             else if (!handle_exception(L, writer, idx, depth, LUA_RAPIDJSON_ERROR_TYPE, &output)) {
               if (output)
@@ -938,101 +2781,407 @@ public:
     }
 
     /// <summary>
-    /// Note: The "depth" parameter isn't propagated to the __tojson meta-function.
+    /// Encode the result of the __tojson metafunction: a string is written
+    /// verbatim, any other value is encoded in place of the original.
+    ///
+    /// Note: The "depth" parameter isn't propagated to the __tojson meta-function.
+    /// </summary>
+    template<typename Writer>
+    bool encodeMetafield(lua_State *L, Writer &writer, int idx, int depth) const {
+      const int type = luaL_getmetafield(L, idx, LUA_RAPIDJSON_META_TOJSON);
+      if (type == LUA_METAFIELD_FAIL)
+        return false;
+      else if (tentative)  // The metafield is discarded by the general path
+        throw LuaRestartException();
+
+      bool result = true;
+#if LUA_VERSION_NUM > 502
+      if (type == LUA_TFUNCTION) {
+#else
+      if (lua_type(L, -1) == LUA_TFUNCTION) {  // @TODO: LUA_RAPIDJSON_ERROR_FAIL
+#endif
+        lua_pushvalue(L, json_rel_index(idx, 1));  // [..., metafield, self]
+        json_call(L, 1, 1);  // [..., result]
+        metas.Clear();
+        if (lua_type(L, -1) == LUA_TSTRING) {
+          size_t len;
+          const char *s = lua_tolstring(L, -1, &len);
+          if (!writer.RawValue(s, len, Type::kObjectType))
+            throw LuaException("error encoding raw value");
+        }
+        else if (depth > max_depth) {  // e.g., a userdata that returns itself
+          result = false;
+          throw LuaException(LUA_RAPIDJSON_ERROR_DEPTH_LIMIT);
+        }
+        else {
+          encodeValue(L, writer, -1, depth + 1);
+        }
+        lua_pop(L, 1);  // [...]
+      }
+      else {
+        result = false;
+        throw LuaException("Invalid " LUA_RAPIDJSON_META_TOJSON " function");
+      }
+      return result;
+    }
+
+    template<typename Writer>
+    void encodeTable(lua_State *L, Writer &writer, int idx, int depth) const {
+      if (depth > max_depth) {
+        const char *output = RAPIDJSON_NULLPTR;
+        if (!handle_exception(L, writer, idx, depth, LUA_RAPIDJSON_ERROR_CYCLE, &output)) {
+          if (flags & JSON_NESTING_NULL)
+            writer.Null();
+          else
+            throw LuaException((output != RAPIDJSON_NULLPTR) ? output : LUA_RAPIDJSON_ERROR_DEPTH_LIMIT);
+        }
+        return;
+      }
+
+      const int meta = metas.Get(L, idx);
+      if (meta & JSON_META_PROXY) {  // Encode the shared table it guards
+        json_checkstack(L, 2);
+        lua_getmetatable(L, idx);  // [..., meta]
+        lua_pushliteral(L, "__index");
+        lua_rawget(L, -2);  // [..., meta, target]
+        lua_remove(L, -2);  // [..., target]
+        if (lua_istable(L, -1))
+          encodeTable(L, writer, -1, depth);
+        else
+          writer.Null();
+        lua_pop(L, 1);
+        return;
+      }
+      if (tentative && (meta & (JSON_META_TOJSON | JSON_META_ORDER | JSON_META_VERSION)))
+        throw LuaRestartException();
+      if (!(memoize && (meta & JSON_META_VERSION) && encodeMemoized(L, writer, idx, depth, meta)))
+        encodeTableBody(L, writer, idx, depth, meta);
+    }
+
+    /// <summary>
+    /// Push the version of the table at "idx", i.e., its __jsonversion metafield
+    /// or, when a function, the result of calling it with the table. Returning
+    /// false, with nothing pushed, if the table has no (or a nil) version.
+    /// </summary>
+    bool memo_version(lua_State *L, int idx) const {
+      if (luaL_getmetafield(L, idx, LUA_RAPIDJSON_META_VERSION) == LUA_METAFIELD_FAIL)
+        return false;
+
+      if (lua_type(L, -1) == LUA_TFUNCTION) {
+        lua_pushvalue(L, idx);  // [..., version_func, self]
+        json_call(L, 1, 1);  // [..., version]
+        metas.Clear();
+      }
+
+      if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return false;
+      }
+      return true;
+    }
+
+    /// <summary>
+    /// Return true if the memoized "entry" of the table "t" (absolute stack
+    /// indices) may be reused: the version of the table and the configuration
+    /// are unchanged, and so is every memoized table it contains.
+    /// </summary>
+    bool memo_valid(lua_State *L, int memo, int t, int entry, int decimals) const {
+      json_checkstack(L, 4);
+      if (!memo_version(L, t))  // [..., version]
+        return false;
+
+      lua_rawgeti(L, entry, LUA_RAPIDJSON_MEMO_VERSION);  // [..., version, entry_version]
+      lua_rawgeti(L, entry, LUA_RAPIDJSON_MEMO_FLAGS);  // [..., version, entry_version, entry_flags]
+      lua_rawgeti(L, entry, LUA_RAPIDJSON_MEMO_DECIMALS);  // [..., version, entry_version, entry_flags, entry_decimals]
+      bool valid = lua_rawequal(L, -3, -4) && lua_tointeger(L, -2) == flags && lua_tointeger(L, -1) == decimals;
+      lua_pop(L, 4);
+
+#if LUA_VERSION_NUM >= 502
+      const size_t length = static_cast<size_t>(lua_rawlen(L, entry));
+#else
+      const size_t length = lua_objlen(L, entry);
+#endif
+      for (size_t i = LUA_RAPIDJSON_MEMO_NESTED; valid && i < length; i += 2) {
+        lua_rawgeti(L, entry, static_cast<int>(i));  // [..., nested]
+        lua_rawgeti(L, entry, static_cast<int>(i + 1));  // [..., nested, nested_entry]
+        lua_pushvalue(L, -2);
+        lua_rawget(L, memo);  // [..., nested, nested_entry, current_entry]
+        valid = lua_rawequal(L, -1, -2) && memo_valid(L, memo, lua_gettop(L) - 2, lua_gettop(L) - 1, decimals);
+        lua_pop(L, 3);
+      }
+      return valid;
+    }
+
+    /// <summary>
+    /// Record the table "t" and its memoized entry (on the top of the stack)
+    /// within the entry of the memoized table being encoded, if any.
+    /// </summary>
+    void memo_record(lua_State *L, int t) const {
+      if (memo_frame > 0) {
+#if LUA_VERSION_NUM >= 502
+        const int length = static_cast<int>(lua_rawlen(L, memo_frame));
+#else
+        const int length = static_cast<int>(lua_objlen(L, memo_frame));
+#endif
+        json_checkstack(L, 1);
+        lua_pushvalue(L, t);
+        lua_rawseti(L, memo_frame, length + 1);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, memo_frame, length + 2);
+      }
+    }
+
+    /// <summary>
+    /// Encode the table "t" (an absolute stack index) into a private writer,
+    /// storing the encoded bytes in the entry on the top of the stack before
+    /// splicing them into "writer".
+    /// </summary>
+    template<typename MemoWriter, typename Writer>
+    void memo_encode(lua_State *L, Writer &writer, int t, int depth, int meta) const {
+      GenericStringBuffer<LUA_RAPIDJSON_TARGET> buffer;
+      MemoWriter memo_writer(buffer);
+      memo_writer.SetMaxDecimalPlaces(writer.GetMaxDecimalPlaces());
+
+      const int frame = memo_frame;
+      memo_frame = lua_gettop(L);
+      encodeTableBody(L, memo_writer, t, depth, meta);
+      memo_frame = frame;
+
+      json_checkstack(L, 1);
+      lua_pushlstring(L, buffer.GetString(), buffer.GetSize());
+      lua_rawseti(L, -2, LUA_RAPIDJSON_MEMO_BYTES);
+      if (!writer.RawValue(buffer.GetString(), buffer.GetSize(), Type::kObjectType))
+        throw LuaException("error encoding raw value");
+    }
+
+    /// <summary>
+    /// Encode a table whose metatable has a __jsonversion field, reusing the
+    /// bytes of its previous encoding while the entry remains valid (see
+    /// memo_valid and json.invalidate). Returning false if the table has no
+    /// version and must be encoded normally.
+    ///
+    /// An entry is a table of the encoded bytes, the version, flags, and
+    /// decimal places it was encoded with, and then each memoized table (and
+    /// its entry) nested within it.
     /// </summary>
     template<typename Writer>
-    bool encodeMetafield(lua_State *L, Writer &writer, int idx, int depth) const {
-      JSON_UNUSED(depth);
-      const int type = luaL_getmetafield(L, idx, LUA_RAPIDJSON_META_TOJSON);
-      if (type == LUA_METAFIELD_FAIL)
+    bool encodeMemoized(lua_State *L, Writer &writer, int idx, int depth, int meta) const {
+      const int top = lua_gettop(L);
+      const int t = json_abs_index(L, idx);
+      const int decimals = (fixed_decimals > 0) ? -fixed_decimals : writer.GetMaxDecimalPlaces();  // Negative: fixed
+      json_checkstack(L, 6);
+
+      lua_getfield(L, LUA_REGISTRYINDEX, LUA_RAPIDJSON_REG_MEMO);  // [..., memo]
+      if (!lua_istable(L, -1)) {  // Library not opened
+        lua_settop(L, top);
         return false;
+      }
 
-      bool result = true;
-#if LUA_VERSION_NUM > 502
-      if (type == LUA_TFUNCTION) {
-#else
-      if (lua_type(L, -1) == LUA_TFUNCTION) {  // @TODO: LUA_RAPIDJSON_ERROR_FAIL
-#endif
-        lua_pushvalue(L, json_rel_index(idx, 1));  // [..., metafield, self]
-        json_call(L, 1, 1);  // [..., result]
-        if (lua_type(L, -1) == LUA_TSTRING) {
-          size_t len;
-          const char *s = lua_tolstring(L, -1, &len);
-          if (!writer.RawValue(s, len, Type::kObjectType))
-            throw LuaException("error encoding raw value");
-        }
-        else {
-          result = false;
-          throw LuaException("Invalid " LUA_RAPIDJSON_META_TOJSON " result");
-        }
-        lua_pop(L, 1);  // [...]
+      lua_pushvalue(L, t);
+      lua_rawget(L, top + 1);  // [..., memo, entry]
+      if (lua_istable(L, -1) && memo_valid(L, top + 1, t, top + 2, decimals)) {
+        size_t len = 0;
+        lua_rawgeti(L, -1, LUA_RAPIDJSON_MEMO_BYTES);  // [..., memo, entry, bytes]
+        const char *s = lua_tolstring(L, -1, &len);
+        if (!writer.RawValue(s, len, Type::kObjectType))
+          throw LuaException("error encoding raw value");
+        lua_pop(L, 1);  // [..., memo, entry]
+
+        memo_record(L, t);
+        lua_settop(L, top);
+        return true;
       }
-      else {
-        result = false;
-        throw LuaException("Invalid " LUA_RAPIDJSON_META_TOJSON " function");
+      lua_pop(L, 1);  // [..., memo]
+
+      if (!memo_version(L, t)) {  // [..., memo, version]
+        lua_settop(L, top);
+        return false;
       }
-      return result;
+
+      lua_createtable(L, LUA_RAPIDJSON_MEMO_NESTED + 3, 0);  // [..., memo, version, entry]
+      lua_pushboolean(L, 0);  // Placeholder until encoded
+      lua_rawseti(L, -2, LUA_RAPIDJSON_MEMO_BYTES);
+      lua_pushvalue(L, -2);
+      lua_rawseti(L, -2, LUA_RAPIDJSON_MEMO_VERSION);
+      lua_pushinteger(L, flags);
+      lua_rawseti(L, -2, LUA_RAPIDJSON_MEMO_FLAGS);
+      lua_pushinteger(L, static_cast<lua_Integer>(decimals));
+      lua_rawseti(L, -2, LUA_RAPIDJSON_MEMO_DECIMALS);
+
+      typedef GenericStringBuffer<LUA_RAPIDJSON_TARGET> MemoBuffer;
+      typedef WriterFlags<Writer> Fixed;  // The memo writer fixes the same flags
+      if (flags & JSON_NAN_AND_INF)
+        memo_encode<typename Fixed::template Rebind<rapidjson::Writer<MemoBuffer, LUA_RAPIDJSON_SOURCE, LUA_RAPIDJSON_TARGET, CrtAllocator, kWriteNanAndInfFlag>>>(L, writer, t, depth, meta);
+      else
+        memo_encode<typename Fixed::template Rebind<rapidjson::Writer<MemoBuffer, LUA_RAPIDJSON_SOURCE, LUA_RAPIDJSON_TARGET, CrtAllocator, kWriteDefaultFlags>>>(L, writer, t, depth, meta);
+
+      lua_pushvalue(L, t);
+      lua_pushvalue(L, -2);
+      lua_rawset(L, top + 1);  // memo[t] = entry
+      memo_record(L, t);
+      lua_settop(L, top);
+      return true;
     }
 
+    /// <summary>
+    /// Encode a table given the JSON_META_* bits of its metatable.
+    /// </summary>
     template<typename Writer>
-    void encodeTable(lua_State *L, Writer &writer, int idx, int depth) const {
+    void encodeTableBody(lua_State *L, Writer &writer, int idx, int depth, int meta) const {
       const int top = lua_gettop(L);
-      if (depth > max_depth) {
-        const char *output = RAPIDJSON_NULLPTR;
-        if (!handle_exception(L, writer, idx, depth, LUA_RAPIDJSON_ERROR_CYCLE, &output)) {
-          if (flags & JSON_NESTING_NULL)
-            writer.Null();
-          else
-            throw LuaException((output != RAPIDJSON_NULLPTR) ? output : LUA_RAPIDJSON_ERROR_DEPTH_LIMIT);
-        }
-        return;
-      }
-
       size_t array_length;
-      if (encodeMetafield(L, writer, idx, depth)) {
+      if ((meta & JSON_META_TOJSON) && encodeMetafield(L, writer, idx, depth)) {
         // Continue
       }
-      else if (table_is_json_array(L, idx, flags, &array_length))
+      else if (table_is_json_array(L, idx, flags, &array_length, meta & (JSON_META_TYPE | JSON_META_ARRAY)))
         encode_array(L, writer, idx, array_length, depth);
-      else if (luaL_getmetafield(L, idx, LUA_RAPIDJSON_META_ORDER) != LUA_METAFIELD_FAIL) {
+      else if ((meta & JSON_META_ORDER) && luaL_getmetafield(L, idx, LUA_RAPIDJSON_META_ORDER) != LUA_METAFIELD_FAIL) {
         /* __jsonorder returns a function (i.e., order dependent on state) */
         if (lua_type(L, -1) == LUA_TFUNCTION) {
           lua_pushvalue(L, json_rel_index(idx, 1));  // [..., order_func, self]
           json_call(L, 1, 1);  // [..., order]
+          metas.Clear();
+        }
+
+        /* __jsonorder is a table, a compiled json.keyorder, or a function returning either */
+        const KeyOrder *compiled = KeyOrder::Test(L, -1);
+        if (compiled != RAPIDJSON_NULLPTR) {
+          std::vector<LuaSAX::Key> unorder;
+          std::vector<size_t> found;
+          populate_unordered_vector(L, json_rel_index(idx, 1), *compiled, unorder, found);
+
+          /* Keep the userdata, which may be a temporary, on the stack */
+          encodeOrderedObject(L, writer, json_rel_index(idx, 1), depth, *compiled, &found, unorder);
+          lua_settop(L, top);  // & Metafield
         }
+        else if (lua_type(L, -1) == LUA_TTABLE) {
+          /* The metatable of a "preserve_order" object lists its distinct keys */
+          bool decoded_order = false;
+          if (lua_getmetatable(L, json_rel_index(idx, 1))) {  // [..., order, meta]
+            decoded_order = lua_rawequal(L, -1, -2) != 0;
+            lua_pop(L, 1);
+          }
 
-        /* __jsonorder is a table or a function that returns a table */
-        if (lua_type(L, -1) == LUA_TTABLE) {
           // @TODO replace vectors with temporarily anchored userdata
           std::vector<LuaSAX::Key> meta_order, unorder;
+          std::vector<size_t> found;
           populate_key_vector(L, -1, meta_order);
+          const bool complete = decoded_order && contains_all_keys(L, json_rel_index(idx, 1), -1, meta_order.size());
+          if (!complete)
+            populate_unordered_vector(L, json_rel_index(idx, 1), meta_order, unorder, found);
           lua_settop(L, top);  // & Metafield
 
-          populate_unordered_vector(L, idx, meta_order, unorder);
-          encodeOrderedObject(L, writer, idx, depth, meta_order, unorder);
+          encodeOrderedObject(L, writer, idx, depth, meta_order, complete ? RAPIDJSON_NULLPTR : &found, unorder);
         }
         else {
           throw LuaException("Invalid " LUA_RAPIDJSON_META_ORDER " result");
         }
       }
-      else if ((flags & JSON_SORT_KEYS) != 0 || order.size() != 0) {  // Generate a key order
+      else if (has<Writer>(JSON_SORT_KEYS) || order.count != 0) {  // Generate a key order
         // @TODO replace vector with temporarily anchored userdata
         std::vector<LuaSAX::Key> unorder;  // All keys not contained in 'order'
-        populate_unordered_vector(L, idx, order, unorder);
-        if (flags & JSON_SORT_KEYS)
-          std::sort(unorder.begin(), unorder.end());
+        std::vector<size_t> found;  // Offsets of the keys contained in 'order'
+        populate_unordered_vector(L, idx, order, unorder, found);
+        if (has<Writer>(JSON_SORT_KEYS))
+          sorts.Sort(unorder);
 
-        encodeOrderedObject(L, writer, idx, depth, order, unorder);
+        encodeOrderedObject(L, writer, idx, depth, order, &found, unorder);
       }
       else {  // Treat table as object
         encodeObject(L, writer, idx, depth);
       }
     }
 
+    /// <summary>
+    /// Format an integer as encodeInteger would write it, returning the end of
+    /// the output; "buffer" must hold at least 21 characters.
+    /// </summary>
+    template<typename Writer>
+    char *formatInteger(lua_Integer i, char *buffer) const {
+      if (has<Writer>(JSON_ENCODE_INT32)) {
+        if (has<Writer>(JSON_UNSIGNED_INTEGERS))
+          return extend::U64toa(static_cast<unsigned>(i), buffer);
+        return extend::I64toa(static_cast<int>(i), buffer);
+      }
+      else if (has<Writer>(JSON_UNSIGNED_INTEGERS))
+        return extend::U64toa(static_cast<uint64_t>(i), buffer);
+      return extend::I64toa(static_cast<int64_t>(i), buffer);
+    }
+
+    /// <summary>
+    /// Encode the consecutive elements of the array (at stack index "idx"),
+    /// starting at "i", that are integers or finite floats. The elements are
+    /// formatted, comma separated, into a local buffer that is written with a
+    /// single RawValue each time it fills; bypassing encodeValue and the
+    /// per-value Writer bookkeeping. Returns the number of elements encoded.
+    ///
+    /// NOTE: Each RawValue is a single value to the Writer, so this is not used
+    /// for pretty printing.
+    /// </summary>
+    template<typename Writer>
+    size_t encodeNumberRun(lua_State *L, Writer &writer, int idx, size_t i, size_t array_length) const {
+      char buffer[LUA_RAPIDJSON_NUMBER_RUN_BUFFER];
+      char *current = buffer;
+      char *const last = buffer + sizeof(buffer) - (MAXNUMBER2STR + 3);  // Room for a number and a comma
+      const int decimals = writer.GetMaxDecimalPlaces();
+      const size_t first = i;
+
+      for (; i <= array_length; ++i) {
+#if LUA_VERSION_NUM >= 503
+        lua_rawgeti(L, idx, static_cast<lua_Integer>(i));
+#else
+        lua_pushinteger(L, static_cast<lua_Integer>(i));
+        lua_rawget(L, json_rel_index(idx, 1));
+#endif
+        if (lua_type(L, -1) != LUA_TNUMBER) {
+          lua_pop(L, 1);
+          break;
+        }
+        else if (json_isinteger(L, -1))
+          current = formatInteger<Writer>(lua_tointeger(L, -1), current);
+        else {
+          const double d = static_cast<double>(lua_tonumber(L, -1));
+          if (internal::Double(d).IsNanOrInf()) {  // Left to encodeNumber and any exception handler
+            lua_pop(L, 1);
+            break;
+          }
+          current = formatDouble<Writer>(d, current, decimals);
+        }
+        lua_pop(L, 1);
+
+        *current++ = ',';
+        if (current >= last) {
+          if (!writer.RawValue(buffer, static_cast<size_t>(current - buffer - 1), Type::kNumberType))
+            throw LuaException("error encoding number array");
+          current = buffer;
+        }
+      }
+
+      if (current != buffer && !writer.RawValue(buffer, static_cast<size_t>(current - buffer - 1), Type::kNumberType))
+        throw LuaException("error encoding number array");
+      return i - first;
+    }
+
     template<typename Writer>
     void encode_array(lua_State *L, Writer &writer, int idx, size_t array_length, int depth) const {
       writer.StartArray();
+
+      bool batch = false;
+#if LUA_RAPIDJSON_NUMBER_RUN > 0
+      if (array_length >= LUA_RAPIDJSON_NUMBER_RUN && !(flags & JSON_PRETTY_PRINT)) {
+#if LUA_VERSION_NUM >= 503
+        batch = lua_rawgeti(L, idx, 1) == LUA_TNUMBER;
+#else
+        lua_rawgeti(L, idx, 1);
+        batch = lua_type(L, -1) == LUA_TNUMBER;
+#endif
+        lua_pop(L, 1);
+      }
+#endif
+
       for (size_t i = 1; i <= array_length; ++i) {
+        if (batch && (i += encodeNumberRun(L, writer, idx, i, array_length)) > array_length)
+          break;
 #if LUA_VERSION_NUM >= 503
         lua_rawgeti(L, idx, static_cast<lua_Integer>(i));
 #else
@@ -1090,14 +3239,16 @@ public:
     }
 
     template<typename Writer>
-    void encodeOrderedObject(lua_State *L, Writer &writer, int idx, int depth, const std::vector<LuaSAX::Key> &keyorder, const std::vector<LuaSAX::Key> &unordered) const {
+    void encodeOrderedObject(lua_State *L, Writer &writer, int idx, int depth, const KeyOrder &keyorder, const std::vector<size_t> *found, const std::vector<LuaSAX::Key> &unordered) const {
       const int i_idx = json_rel_index(idx, 1);
       json_checkstack(L, 2);
 
       writer.StartObject();
 
-      auto oi = keyorder.end();  // Keys in a predefined order
-      for (auto i = keyorder.begin(); i != oi; ++i) {
+      /* Keys in a predefined order: those present in the table if known */
+      const size_t count = (found != RAPIDJSON_NULLPTR) ? found->size() : keyorder.count;
+      for (size_t o = 0; o < count; ++o) {
+        const LuaSAX::Key *i = keyorder.begin() + ((found != RAPIDJSON_NULLPTR) ? (*found)[o] : o);
         if (i->is_integer)
           lua_pushinteger(L, i->data.i);
         else if (i->is_number)
@@ -1129,6 +3280,493 @@ public:
       writer.EndObject();
     }
   };
+
+#if defined(LUA_RAPIDJSON_THREADS)
+  /*
+  ** Snapshot
+  **
+  ** json.encode with "threads": the Encoder writes the value into a Snapshot,
+  ** on the Lua thread, as a flat list of nodes that reference no Lua state:
+  ** strings shorter than LUA_RAPIDJSON_SNAPSHOT_ANCHOR bytes (and every key and
+  ** raw value) are copied, longer ones are anchored in a Lua table and
+  ** referenced, and doubles are left unformatted.
+  **
+  ** Format then splits the output into pieces: runs of sibling items whose
+  ** estimated size reaches a target (the total over the thread count times
+  ** LUA_RAPIDJSON_PARALLEL_SPLIT, at least LUA_RAPIDJSON_PARALLEL_MIN) are
+  ** tasks, larger arrays and objects are split recursively, and the brackets,
+  ** commas, and keys between them are text. Tasks are written by a pool of
+  ** threads (the calling thread included) into buffers of their own, which are
+  ** then joined in order.
+  */
+  class Snapshot {
+  public:
+    typedef char Ch;
+
+  private:
+    enum Kind {
+      kNull, kFalse, kTrue, kInt64, kUint64,
+      kDouble,  // Finite; formatted by Encoder::formatDouble
+      kNanInf,  // Written by Writer::Double
+      kString, kKey,
+      kRaw,  // Written by Writer::RawValue; an object key if kStringType
+      kStartObject, kEndObject, kStartArray, kEndArray
+    };
+
+    struct Node {
+      uint64_t tag;  // Kind, rapidjson::Type (of a raw value), and size; or, for a start node, the index of its end node
+      union {
+        int64_t i;
+        uint64_t u;
+        double d;
+        const char *s;
+        size_t cost;  // Start and end nodes: the estimated output size preceding, or including, the container
+      } value;
+
+      Kind GetKind() const { return static_cast<Kind>(tag & 0xF); }
+      Type GetType() const { return static_cast<Type>((tag >> 4) & 0xF); }
+      size_t GetSize() const { return static_cast<size_t>(tag >> 8); }
+    };
+
+    /* Output of a run of sibling items, or text between them */
+    struct Piece {
+      size_t first;  // Items [first, last); first == last for text
+      size_t last;
+      bool object;  // Items are key/value pairs
+      bool separate;  // A comma precedes the first item
+      std::string text;
+    };
+
+    typedef GenericStringBuffer<LUA_RAPIDJSON_TARGET> Output;
+    typedef rapidjson::Writer<Output, LUA_RAPIDJSON_SOURCE, LUA_RAPIDJSON_TARGET, CrtAllocator, kWriteNanAndInfFlag> OutputWriter;
+
+    lua_State *L;
+    int anchors;  // (Absolute) stack index of the table anchoring referenced strings
+    int anchored;  // Number of strings anchored
+    bool nan_and_inf;  // NaN and +/-Infinity may be written
+    int max_decimals;  // Writer::GetMaxDecimalPlaces
+    size_t cost;  // Estimated output size of the nodes recorded
+    std::vector<Node> nodes;
+    std::vector<size_t> open;  // Start nodes of the containers being recorded
+    std::vector<std::unique_ptr<char[]>> blocks;  // Copied strings
+    char *block;  // Unused space of the last LUA_RAPIDJSON_SNAPSHOT_BLOCK block
+    size_t block_left;
+
+    /// <summary>
+    /// Estimated output size of a node of the given kind and size.
+    /// </summary>
+    static size_t Weight(Kind kind, size_t size) {
+      switch (kind) {
+        case kFalse: return 5;
+        case kNull: case kTrue: return 4;
+        case kInt64: case kUint64: return 12;
+        case kDouble: case kNanInf: return 20;
+        case kString: case kKey: return size + 3;
+        case kRaw: return size + 1;
+        default: return 1;
+      }
+    }
+
+    bool Push(Kind kind, size_t size, Type type = kNullType) {
+      Node node;
+      node.tag = static_cast<uint64_t>(kind) | (static_cast<uint64_t>(type) << 4) | (static_cast<uint64_t>(size) << 8);
+      node.value.u = 0;
+      nodes.push_back(node);
+      cost += Weight(kind, size);
+      return true;
+    }
+
+    bool Push(Kind kind, size_t size, const char *s, Type type = kNullType) {
+      Push(kind, size, type);
+      nodes.back().value.s = s;
+      return true;
+    }
+
+    /// <summary>
+    /// Storage for "len" bytes: the unused space of the last block, a new
+    /// block, or, for long strings, a block of its own.
+    /// </summary>
+    char *Reserve(size_t len) {
+      if (len > block_left) {
+        if (len > (LUA_RAPIDJSON_SNAPSHOT_BLOCK / 4)) {  // A block of its own
+          blocks.emplace_back(new char[len]);
+          return blocks.back().get();
+        }
+        blocks.emplace_back(new char[LUA_RAPIDJSON_SNAPSHOT_BLOCK]);
+        block = blocks.back().get();
+        block_left = LUA_RAPIDJSON_SNAPSHOT_BLOCK;
+      }
+
+      char *space = block;
+      block += len;
+      block_left -= len;
+      return space;
+    }
+
+    const char *Copy(const char *s, size_t len) {
+      char *copy = Reserve(len);
+      if (len > 0)
+        std::memcpy(copy, s, len);
+      return copy;
+    }
+
+    bool Start(Kind kind) {
+      open.push_back(nodes.size());
+      Push(kind, 0);
+      nodes.back().value.cost = cost - 1;
+      return true;
+    }
+
+    bool End(Kind kind) {
+      if (open.empty())
+        return false;
+
+      const size_t start = open.back();
+      open.pop_back();
+      nodes[start].tag |= static_cast<uint64_t>(nodes.size()) << 8;
+      Push(kind, 0);
+      nodes.back().value.cost = cost;
+      return true;
+    }
+
+    bool IsStart(size_t i) const {
+      return nodes[i].GetKind() == kStartObject || nodes[i].GetKind() == kStartArray;
+    }
+
+    /// <summary>
+    /// Return the index following the value at "i".
+    /// </summary>
+    size_t Next(size_t i) const {
+      return IsStart(i) ? nodes[i].GetSize() + 1 : i + 1;
+    }
+
+    /// <summary>
+    /// Return the estimated output size of the value at "i".
+    /// </summary>
+    size_t Cost(size_t i) const {
+      if (IsStart(i))
+        return nodes[nodes[i].GetSize()].value.cost - nodes[i].value.cost;
+      return Weight(nodes[i].GetKind(), nodes[i].GetSize());
+    }
+
+    static void AddText(std::vector<Piece> &pieces, const char *s, size_t len) {
+      if (pieces.empty() || pieces.back().first != pieces.back().last) {
+        Piece piece = { 0, 0, false, false, std::string() };
+        pieces.push_back(piece);
+      }
+      pieces.back().text.append(s, len);
+    }
+
+    static void AddTask(std::vector<Piece> &pieces, size_t first, size_t last, bool object, bool separate) {
+      Piece piece = { first, last, object, separate, std::string() };
+      pieces.push_back(piece);
+    }
+
+    /// <summary>
+    /// Plan the value at "v": as a single task unless it is a container larger
+    /// than "target".
+    /// </summary>
+    void PlanValue(std::vector<Piece> &pieces, size_t v, size_t target) const {
+      if (!IsStart(v) || Cost(v) <= target) {
+        AddTask(pieces, v, Next(v), false, false);
+        return;
+      }
+
+      const bool object = nodes[v].GetKind() == kStartObject;
+      AddText(pieces, object ? "{" : "[", 1);
+      PlanItems(pieces, v + 1, nodes[v].GetSize(), object, target);
+      AddText(pieces, object ? "}" : "]", 1);
+    }
+
+    /// <summary>
+    /// Plan the items [first, last) of a container.
+    /// </summary>
+    void PlanItems(std::vector<Piece> &pieces, size_t first, size_t last, bool object, size_t target) const {
+      size_t begin = first;  // First item of the pending task
+      size_t pending = 0;  // Estimated output size of the pending task
+      for (size_t i = first; i < last;) {
+        const size_t v = object ? i + 1 : i;  // Value of the item
+        const size_t next = Next(v);
+        if (IsStart(v) && Cost(v) > target) {
+          if (begin < i)
+            AddTask(pieces, begin, i, object, begin != first);
+          if (i != first)
+            AddText(pieces, ",", 1);
+          if (object)
+            AddKey(pieces, i);
+          PlanValue(pieces, v, target);
+          begin = next;
+          pending = 0;
+        }
+        else if ((pending += Cost(v) + (object ? Cost(i) + 1 : 1)) >= target) {
+          AddTask(pieces, begin, next, object, begin != first);
+          begin = next;
+          pending = 0;
+        }
+        i = next;
+      }
+
+      if (begin < last)
+        AddTask(pieces, begin, last, object, begin != first);
+    }
+
+    /// <summary>
+    /// Add the object key at "i", and its separator, as text.
+    /// </summary>
+    void AddKey(std::vector<Piece> &pieces, size_t i) const {
+      const Node &node = nodes[i];
+      if (node.GetKind() == kRaw)
+        AddText(pieces, node.value.s, node.GetSize());
+      else {
+        Output os;
+        OutputWriter writer(os);
+        if (!writer.String(node.value.s, static_cast<SizeType>(node.GetSize())))
+          throw LuaException("error encoding string");
+        AddText(pieces, os.GetString(), os.GetSize());
+      }
+      AddText(pieces, ":", 1);
+    }
+
+    /// <summary>
+    /// Write the nodes [i, last), one or more complete values, to "writer".
+    /// </summary>
+    void Replay(const Encoder &encoder, OutputWriter &writer, size_t i, size_t last) const {
+      for (; i < last; ++i) {
+        const Node &node = nodes[i];
+        bool result = true;
+        switch (node.GetKind()) {
+          case kNull: result = writer.Null(); break;
+          case kFalse: result = writer.Bool(false); break;
+          case kTrue: result = writer.Bool(true); break;
+          case kInt64: result = writer.Int64(node.value.i); break;
+          case kUint64: result = writer.Uint64(node.value.u); break;
+          case kDouble: {
+            char buffer[MAXNUMBER2STR + 2];
+            const char *end = encoder.formatDouble<OutputWriter>(node.value.d, buffer, max_decimals);
+            result = writer.RawValue(buffer, static_cast<SizeType>(end - buffer), Type::kNumberType);
+            break;
+          }
+          case kNanInf: result = writer.Double(node.value.d); break;
+          case kString: result = writer.String(node.value.s, static_cast<SizeType>(node.GetSize())); break;
+          case kKey: result = writer.Key(node.value.s, static_cast<SizeType>(node.GetSize())); break;
+          case kRaw: result = writer.RawValue(node.value.s, node.GetSize(), node.GetType()); break;
+          case kStartObject: result = writer.StartObject(); break;
+          case kEndObject: result = writer.EndObject(); break;
+          case kStartArray: result = writer.StartArray(); break;
+          case kEndArray: result = writer.EndArray(); break;
+          default: break;
+        }
+        if (!result)
+          throw LuaException("error encoding value");
+      }
+    }
+
+    /// <summary>
+    /// Write the items of a task. Each value is written as the root of a reset
+    /// writer; the separators between items are written directly.
+    /// </summary>
+    void Run(const Encoder &encoder, const Piece &piece, Output &os) const {
+      OutputWriter writer;
+      writer.SetMaxDecimalPlaces(max_decimals);
+      for (size_t i = piece.first; i < piece.last;) {
+        if (i != piece.first || piece.separate)
+          os.Put(',');
+
+        if (piece.object) {
+          const Node &key = nodes[i++];
+          if (key.GetKind() == kRaw) {
+            if (key.GetSize() > 0)
+              std::memcpy(os.Push(key.GetSize()), key.value.s, key.GetSize());
+          }
+          else {
+            writer.Reset(os);
+            if (!writer.String(key.value.s, static_cast<SizeType>(key.GetSize())))
+              throw LuaException("error encoding string");
+          }
+          os.Put(':');
+        }
+
+        const size_t next = Next(i);
+        writer.Reset(os);
+        Replay(encoder, writer, i, next);
+        i = next;
+      }
+    }
+
+  public:
+    /// <summary>
+    /// Record a value of the lua_State "L", anchoring long strings in the table
+    /// at (absolute) stack index "anchor_idx".
+    /// </summary>
+    Snapshot(lua_State *_L, int anchor_idx, bool _nan_and_inf)
+      : L(_L), anchors(anchor_idx), anchored(0), nan_and_inf(_nan_and_inf), max_decimals(324), cost(0), block(RAPIDJSON_NULLPTR), block_left(0) {
+    }
+
+    int GetMaxDecimalPlaces() const { return max_decimals; }
+    void SetMaxDecimalPlaces(int maxDecimalPlaces) { max_decimals = maxDecimalPlaces; }
+
+    bool Null() { return Push(kNull, 0); }
+    bool Bool(bool b) { return Push(b ? kTrue : kFalse, 0); }
+    bool Int(int i) { return Int64(i); }
+    bool Uint(unsigned u) { return Uint64(u); }
+    bool Int64(int64_t i) { Push(kInt64, 0); nodes.back().value.i = i; return true; }
+    bool Uint64(uint64_t u) { Push(kUint64, 0); nodes.back().value.u = u; return true; }
+
+    bool Double(double d) {
+      const bool is_inf = internal::Double(d).IsNanOrInf();
+      if (is_inf && !nan_and_inf)
+        return false;
+
+      Push(is_inf ? kNanInf : kDouble, 0);
+      nodes.back().value.d = d;
+      return true;
+    }
+
+    bool String(const Ch *str, SizeType length, bool copy = false) {
+      JSON_UNUSED(copy);
+      return Push(kString, length, Copy(str, length));
+    }
+
+    /// <summary>
+    /// Record the string "s" of the Lua value at stack index "idx": referenced,
+    /// and anchored, if at least LUA_RAPIDJSON_SNAPSHOT_ANCHOR bytes.
+    /// </summary>
+    bool String(int idx, const Ch *s, size_t len) {
+      if (len < LUA_RAPIDJSON_SNAPSHOT_ANCHOR)
+        return String(s, static_cast<SizeType>(len));
+
+      json_checkstack(L, 1);
+      lua_pushvalue(L, idx);
+      lua_rawseti(L, anchors, ++anchored);
+      return Push(kString, len, s);
+    }
+
+    bool Key(const Ch *str, SizeType length, bool copy = false) {
+      JSON_UNUSED(copy);
+      return Push(kKey, length, Copy(str, length));
+    }
+
+    bool RawValue(const Ch *json, size_t length, Type type) {
+      return Push(kRaw, length, Copy(json, length), type);
+    }
+
+    bool StartObject() { return Start(kStartObject); }
+    bool EndObject(SizeType memberCount = 0) { JSON_UNUSED(memberCount); return End(kEndObject); }
+    bool StartArray() { return Start(kStartArray); }
+    bool EndArray(SizeType elementCount = 0) { JSON_UNUSED(elementCount); return End(kEndArray); }
+
+    /// <summary>
+    /// Write the recorded value to "os" with up to "threads" threads; the
+    /// "encoder" that recorded it formats its doubles.
+    /// </summary>
+    template<typename Buffer>
+    void Format(const Encoder &encoder, Buffer &os, unsigned threads) const {
+      if (nodes.empty() || !open.empty())
+        throw LuaException("error encoding value");
+
+      const size_t split = static_cast<size_t>(threads) * LUA_RAPIDJSON_PARALLEL_SPLIT;
+      const size_t target = std::max<size_t>(Cost(0) / split, LUA_RAPIDJSON_PARALLEL_MIN);
+
+      std::vector<Piece> pieces;
+      PlanValue(pieces, 0, target);
+
+      size_t tasks = 0;
+      for (size_t p = 0; p < pieces.size(); ++p)
+        tasks += (pieces[p].first != pieces[p].last) ? 1 : 0;
+
+      std::unique_ptr<Output[]> outputs(new Output[pieces.size()]);
+      std::atomic<size_t> next(0);
+      std::atomic<bool> failed(false);
+      std::exception_ptr error;
+      std::mutex error_mutex;
+
+      auto work = [&]() {
+        try {
+          size_t p = 0;
+          while (!failed.load(std::memory_order_relaxed) && (p = next.fetch_add(1)) < pieces.size()) {
+            if (pieces[p].first != pieces[p].last)
+              Run(encoder, pieces[p], outputs[p]);
+          }
+        }
+        catch (...) {
+          std::lock_guard<std::mutex> lock(error_mutex);
+          if (!error)
+            error = std::current_exception();
+          failed = true;
+        }
+      };
+
+      std::vector<std::thread> pool;
+      for (size_t t = 1; t < threads && t < tasks; ++t) {
+        try {
+          pool.emplace_back(work);
+        }
+        catch (const std::exception &) {  // Continue with the threads started
+          break;
+        }
+      }
+      work();
+      for (size_t t = 0; t < pool.size(); ++t)
+        pool[t].join();
+
+      if (error)
+        std::rethrow_exception(error);
+
+      size_t size = 0;
+      for (size_t p = 0; p < pieces.size(); ++p)
+        size += pieces[p].text.size() + outputs[p].GetSize();
+
+      char *out = os.Push(size);
+      for (size_t p = 0; p < pieces.size(); ++p) {
+        const char *s = (pieces[p].first != pieces[p].last) ? outputs[p].GetString() : pieces[p].text.data();
+        const size_t len = (pieces[p].first != pieces[p].last) ? outputs[p].GetSize() : pieces[p].text.size();
+        if (len > 0)
+          std::memcpy(out, s, len);
+        out += len;
+      }
+    }
+  };
+
+  inline bool Encoder::writeDouble(Snapshot &writer, double d) const {
+    return writer.Double(d);
+  }
+
+  inline bool Encoder::writeString(lua_State *L, Snapshot &writer, int idx, const char *s, size_t len) const {
+    JSON_UNUSED(L);
+    return writer.String(idx, s, len);
+  }
+
+  /// <summary>
+  /// encodeNumberRun for a Snapshot: records the run for the threads to format.
+  /// </summary>
+  inline size_t Encoder::encodeNumberRun(lua_State *L, Snapshot &writer, int idx, size_t i, size_t array_length) const {
+    const size_t first = i;
+    for (; i <= array_length; ++i) {
+#if LUA_VERSION_NUM >= 503
+      lua_rawgeti(L, idx, static_cast<lua_Integer>(i));
+#else
+      lua_pushinteger(L, static_cast<lua_Integer>(i));
+      lua_rawget(L, json_rel_index(idx, 1));
+#endif
+      if (lua_type(L, -1) != LUA_TNUMBER) {
+        lua_pop(L, 1);
+        break;
+      }
+      else if (json_isinteger(L, -1))
+        encodeInteger(writer, lua_tointeger(L, -1));
+      else {
+        const double d = static_cast<double>(lua_tonumber(L, -1));
+        if (internal::Double(d).IsNanOrInf()) {  // Left to encodeNumber and any exception handler
+          lua_pop(L, 1);
+          break;
+        }
+        writer.Double(d);
+      }
+      lua_pop(L, 1);
+    }
+    return i - first;
+  }
+#endif
 }
 
 /* }================================================================== */
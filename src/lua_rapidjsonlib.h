@@ -74,11 +74,25 @@ LUAMOD_API int (luaopen_rapidjson) (lua_State *L);
 **
 **    keyorder: an array to specify the ordering of keys in the encoded output.
 **      If an object has keys which are not in this array they are written after
-**      the sorted keys.
+**      the sorted keys. The array is searched linearly for each key; larger
+**      orders should be compiled with json.keyorder.
 **
 **    indent_amt: This is the initial level of indentation used when indent is
 **       set. For each level two spaces are added; when absent it is set to 0.
 **
+**    compress: "gzip" (or true), or "zlib". The encoded string is compressed
+**      in chunks as it is written. Requires LUA_RAPIDJSON_ZLIB.
+**
+**    chunk_size: json.encode_to only, the number of bytes passed to each sink
+**      call; LUA_RAPIDJSON_SINK_CHUNK by default.
+**
+**    threads: json.encode only, the number of threads writing the (non-pretty)
+**      output, or true for one per hardware thread. Requires
+**      LUA_RAPIDJSON_THREADS.
+**
+**    compress, chunk_size, and threads apply to a single call: json.setoption
+**      raises an error for them.
+**
 **    [dkjson PARTIAL COMPATBILITY]
 **    exception: An exception handler: "newValue,newReason = F(reason, value)" where:
 **           reason - is "reference cycle", "custom encoder failed", "unsupported type", or "error encoding number".
@@ -103,6 +117,67 @@ LUAMOD_API int (luaopen_rapidjson) (lua_State *L);
 */
 LUALIB_API int rapidjson_encode(lua_State *L);
 
+/*
+** json.dump(object, file [, state])
+**
+** Encode an object into a file, writing the output in LUA_RAPIDJSON_FILE_BUFFER
+** sized chunks as it is produced rather than first creating a Lua string.
+**
+**  @PARAM "file": a file name, created or truncated, or an open file handle
+**   that is written at its current position and left open.
+**
+** See json.encode for the remaining arguments. Returns true; raises an error
+** on failure, in which case the file may contain partial output.
+*/
+LUALIB_API int rapidjson_dump(lua_State *L);
+
+/*
+** json.encode_to(sink, object [, state])
+**
+** Encode an object, passing the output to "sink(chunk)" each time chunk_size
+** bytes (see json.encode) have been written and once more for the remainder.
+** The encoded value is never held in memory as a whole. Compressed output is
+** passed as it is produced, in chunks of at most LUA_RAPIDJSON_ZLIB_CHUNK bytes.
+**
+** Errors raised by the sink abort encoding and are propagated. See json.encode
+** for the remaining arguments. Returns nothing.
+*/
+LUALIB_API int rapidjson_encode_to(lua_State *L);
+
+/*
+** json.keyorder(keys)
+**
+** Compile an array of string and number keys into a userdata accepted wherever
+** a keyorder array is: the "keyorder" state field and __jsonorder metafields
+** (or their results). Membership of each encoded key is then a hash lookup
+** rather than a linear search, and the array is not read again. Later changes
+** to the array are not reflected.
+*/
+LUALIB_API int rapidjson_keyorder(lua_State *L);
+
+/*
+** json.raw(json_text)
+**
+** Return a fragment of pre-encoded JSON, written verbatim (and unvalidated) by
+** the encoder wherever it appears, e.g., as a table value or the result of a
+** __tojson function. A fragment is returned as is; tostring(fragment) returns
+** its text.
+*/
+LUALIB_API int rapidjson_raw(lua_State *L);
+
+/*
+** json.invalidate([table])
+**
+** Forget the memoized encoding of a table, or of all tables when called without
+** one. A table is memoized when its metatable has a __jsonversion field: a
+** value, or a function "version = F(self)". Its encoded bytes are kept (weak-
+** keyed by the table) and spliced into later outputs while its version, the
+** encoder configuration, and the versions of the memoized tables within it are
+** unchanged. Memoization is not applied when encoding with "indent",
+** "keyorder", or "exception" state fields.
+*/
+LUALIB_API int rapidjson_invalidate(lua_State *L);
+
 /*
 ** json.decode(string [, position [, null [, objectmeta [, arraymeta]]]])
 **
@@ -123,9 +198,27 @@ LUALIB_API int rapidjson_encode(lua_State *L);
 **
 ** The return values are the object or, in case of errors, nil, the position of
 ** the next character that doesn't belong to the object, and an error message.
+**
+** When compiled with LUA_RAPIDJSON_ZLIB, a gzip or zlib compressed string is
+** inflated while it is parsed; positions then refer to the decompressed text
+** and the "structural" preset falls back to the "default" preset. zlib streams
+** are only detected with the default 32K window (a leading 0x78 byte).
 */
 LUALIB_API int rapidjson_decode(lua_State *L);
 
+/*
+** json.load(file [, null [, objectmeta [, arraymeta]]])
+**
+** Decode the contents of a file, read through a LUA_RAPIDJSON_FILE_BUFFER
+** sized buffer, without first loading the file into a Lua string.
+**
+**  @PARAM "file": a file name or an open file handle. Compressed files are
+**   inflated as they are read when compiled with LUA_RAPIDJSON_ZLIB.
+**
+** See json.decode for the remaining arguments and return values.
+*/
+LUALIB_API int rapidjson_load(lua_State *L);
+
 /*
 ** Return the current value of the global encoding/decoding option.
 **
@@ -144,18 +237,79 @@ LUALIB_API int rapidjson_decode(lua_State *L);
 **   'level' - Alias of "indent_count".
 **   'max_depth' - Maximum table recursion depth
 **   'decimal_count' - the maximum number of decimal places for double output.
+**      Doubles are otherwise written in the shortest form that round-trips.
+**   'fixed_decimals' - Round doubles to N (1 to 15) decimal places,
+**      e.g., for metrics, through an integer fixed-point path; trailing zeros
+**      are removed. Magnitudes of 2^52 / 10^N and above use 'decimal_count'
+**      formatting with N places. Zero (or false) disables.
+**
+**  DECODING_OPTS: [NUMBERS]
+**   'decoder_preset' - ["default", "extended", "structural"] - Preset parsing configuration.
+**      "extended" enables all fields (see rapidjson::ParseFlag). "structural"
+**      indexes the document before decoding it, presizing each table to its
+**      element count; best suited to large documents held in memory. Documents
+**      nested deeper than LUA_RAPIDJSON_STRUCTURAL_DEPTH (1024) levels are
+**      decoded by the "default" preset.
+**
+**  DECODING_OPTS: [BOOL]
+**   'typed_arrays' - Decode non-empty arrays of numbers into contiguous
+**      userdata (lua_Integer storage if all elements are integers, lua_Number
+**      otherwise) supporting __index, __newindex, __len, and __pairs. Nested
+**      arrays (e.g., matrices) become tables of typed rows. The encoder
+**      writes typed arrays as JSON arrays.
+**
+**  DECODING_OPTS: [BOOL, STRING]
+**   'columnar' - Decode the root array (true) or the array referenced by a
+**      JSON pointer (e.g., "/data/rows") as a table of columns: each object
+**      member is appended to the column array of the same key, e.g.,
+**      [{"id":1},{"id":2}] -> { id = { 1, 2 }, n = 2 }. The "n" field is the
+**      number of rows; members missing from a row are holes in their column.
+**      The array is decoded as usual once an element that is not an object is
+**      parsed, or if a member is named "n".
+**
+**  DECODING_OPTS: [BOOL, STRING]
+**   'hash_cons' - Structurally identical arrays and objects (of at most
+**      LUA_RAPIDJSON_HASH_CONS_MAX members) within a single document are
+**      decoded into the same shared table, e.g., repeated {"x":0,"y":0}
+**      records. "readonly" additionally returns each shared table as an empty
+**      read-only proxy: reads, #, and pairs are forwarded to the shared table
+**      (Lua 5.2+) and any assignment raises an error; json.encode encodes the
+**      shared table. Custom objectmeta/arraymeta arguments take precedence
+**      over "readonly".
+**
+**  DECODING_OPTS: [BOOL]
+**   'dedup_strings' - String values longer than LUA_RAPIDJSON_DEDUP_MIN bytes
+**      that repeat within a document (URLs, identifiers, descriptions) are
+**      decoded into a single Lua string rather than one allocation each.
+**      Shorter strings are already interned by Lua.
+**
+**  DECODING_OPTS: [BOOL]
+**   'preserve_order' - Each decoded object is given its own metatable that
+**      lists its keys in parse order and is its own __jsonorder. The encoder
+**      writes such objects in that order without sorting or searching for
+**      keys, so documents round-trip with a stable key order. Keys added after
+**      decoding are written last. Ignored if an objectmeta is supplied.
 **
 **  DECODING_OPTS: [NUMBERS]
-**   'decoder_preset' - ["default", "extended"] - Preset parsing configuration.
-**      "extended" enables all fields (see rapidjson::ParseFlag).
+**   'parse_cache' - Maximum number of json.decode results kept in a least
+**      recently used cache keyed by a hash of the input string (0 = disabled).
+**      Only calls without position/null/objectmeta/arraymeta arguments are
+**      cached, and not with 'typed_arrays'. Cached results are shared by all
+**      hits as read-only proxies (see 'hash_cons' "readonly"), nested tables
+**      included: assignments raise an error. Setting any option flushes the
+**      cache. See json.cachestats().
+**   'parse_cache_bytes' - Upper bound of the total input length of all cached
+**      results. Longer inputs bypass the cache and are not counted as misses.
 **
 **  NUMBER_OPTS: [BOOL]
 **   'nan' - Allow writing of Infinity, -Infinity and NaN.
 **   'inf' - Alias of "nan".
 **   'unsigned' - Encode integers as unsigned integers/values.
 **   'bit32' - Encode integers as 32-bit values.
-**   'lua_format_float' - Use sprintf instead of rapidjson's native Grisu2.
-**   'lua_round_float' - Massage Grisu2 by rounding at maxDecimalsPlaces.
+**   'lua_format_float' - Use sprintf (LUA_NUMBER_FMT) instead of the shortest
+**      round-trip formatter.
+**   'lua_round_float' - Round floats at LUA_NUMBER_FMT decimal places before
+**      formatting.
 **
 **  TABLE_OPTS:
 **   'with_hole' - Allow tables to be encoded as arrays iff all keys are
@@ -163,6 +317,9 @@ LUALIB_API int rapidjson_decode(lua_State *L);
 **      Inserting nil's when encoding to satisfy the array type.
 **   'empty_table_as_array' - empty tables packed as arrays. Beware, when
 **      'always_as_map' is enabled, this flag is forced to disabled.
+**   'trust_jsontype' - Encode a table with a __jsontype metafield, e.g., a
+**      decoded table, as that type without inspecting its keys. An "array" is
+**      encoded with the length of the # operator.
 **   'sentinel' - Replace 'nil' values with a 'sentinel' value during decoding.
 **      The encoder will always replace sentinel's with null during encoding.
 **   'null' - Alias of 'sentinel'.
@@ -179,6 +336,38 @@ LUALIB_API int rapidjson_isobject (lua_State *L);
 LUALIB_API int rapidjson_array (lua_State *L);
 LUALIB_API int rapidjson_isarray (lua_State *L);
 
+/*
+** json.cachestats()
+**
+** Return a table of parse cache statistics: "hits", "misses", "evictions",
+** the current number of "entries", and their total input length "bytes".
+*/
+LUALIB_API int rapidjson_cachestats (lua_State *L);
+
+/*
+** json.query(file, jsonpath [, callback])
+**
+** Evaluate a JSONPath expression over a JSON file without decoding it: the file
+** is read through a LUA_RAPIDJSON_QUERY_BUFFER sized buffer and only values
+** matched by the expression are decoded.
+**
+**  @PARAM "file": a file name or an open file handle.
+**
+**  @PARAM "jsonpath": an expression beginning with "$" followed by child
+**   (".name", "['name']"), index ("[0]"), wildcard (".*", "[*]"), and recursive
+**   descent ("..name", "..*", "..[0]") segments.
+**
+**  @PARAM "callback": an optional function invoked with each matched value, in
+**   document order, once it has been decoded; values nested within another
+**   match are held until it is complete and then passed after it. Returning
+**   false stops the query.
+**
+** Returns an array of the matched values in document order, or the number of
+** matches if a callback is given. In case of parse errors: nil, the offset of
+** the error, and an error message.
+*/
+LUALIB_API int rapidjson_query (lua_State *L);
+
 /* }================================================================== */
 
 #if defined(__cplusplus)
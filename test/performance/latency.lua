@@ -0,0 +1,66 @@
+--[[
+    Per-call latency of json.decode/json.encode on tiny documents.
+
+    Each sample times a batch of calls and is reported in nanoseconds per call
+    (p50/p99 over all samples). The "general" rows pass arguments that bypass
+    the fast path for tiny documents (LUA_RAPIDJSON_TINY_SIZE) for comparison.
+
+    lua test/performance/latency.lua [samples [batch]]
+--]]
+local rapidjson = require('rapidjson')
+
+local samples = tonumber(arg and arg[1]) or 2000
+local batch = tonumber(arg and arg[2]) or 100
+
+local gettime = os.clock
+local ok, socket = pcall(require, 'socket')
+if ok then
+    gettime = socket.gettime
+end
+
+local documents = {
+    { 'scalar', '42' },
+    { 'small object', '{"id":12345,"ok":true,"name":"rapidjson"}' },
+    { 'message', '{"type":"update","seq":1024,"ts":1700000000.125,"tags":["a","b","c"],'
+        .. '"payload":{"user":"someone","status":"online","score":98.5,"flags":[1,2,3,4]}}' },
+}
+
+local function percentile(sorted, p)
+    local i = math.max(1, math.ceil(#sorted * p))
+    return sorted[i]
+end
+
+local function measure(f)
+    local times = {}
+    for _=1,10 do f() end  -- warmup
+
+    collectgarbage()
+    collectgarbage()
+    for s=1,samples do
+        local start = gettime()
+        for _=1,batch do f() end
+        times[s] = (gettime() - start) * 1e9 / batch
+    end
+
+    table.sort(times)
+    return percentile(times, 0.50), percentile(times, 0.99)
+end
+
+local function report(name, f)
+    local p50, p99 = measure(f)
+    print(string.format('%-28s %12.1f %12.1f', name, p50, p99))
+end
+
+print(string.format('%-28s %12s %12s', 'ns/call', 'p50', 'p99'))
+for _,doc in ipairs(documents) do
+    local name, str = doc[1], doc[2]
+    local value = rapidjson.decode(str)
+    local state = { }
+
+    report(name .. ' decode', function() rapidjson.decode(str) end)
+    report(name .. ' decode (general)', function() rapidjson.decode(str, 1) end)
+    report(name .. ' encode', function() rapidjson.encode(value) end)
+    report(name .. ' encode (general)', function() rapidjson.encode(value, state) end)
+end
+
+return 0
@@ -15,18 +15,22 @@ get_file_content = function(file)
 end
 
 --[[ Compatibility Load --]]
-rapidjson.load = function(file)
-    return rapidjson.decode(get_file_content(file))
+if not rapidjson.load then
+    rapidjson.load = function(file)
+        return rapidjson.decode(get_file_content(file))
+    end
 end
 
 --[[ Compatibility Dump --]]
-rapidjson.dump = function(json, output, ...)
-    local f = io.open(output, "w")
-    if f then
-        f:write(rapidjson.encode(json, ...))
-        f:close()
-    else
-        error("Invalid file for writing")
+if not rapidjson.dump then
+    rapidjson.dump = function(json, output, ...)
+        local f = io.open(output, "w")
+        if f then
+            f:write(rapidjson.encode(json, ...))
+            f:close()
+        else
+            error("Invalid file for writing")
+        end
     end
 end
 
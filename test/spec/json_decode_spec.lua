@@ -171,4 +171,288 @@ describe('rapidjson.decode()', function()
       assert.are.same(e, a)
     end)
   end)
+
+  describe('typed_arrays option', function()
+    setup(function() rapidjson.setoption('typed_arrays', true) end)
+    teardown(function() rapidjson.setoption('typed_arrays', false) end)
+
+    it('should decode numeric arrays into userdata', function()
+      local a = rapidjson.decode('[1, 2, 3]')
+      assert.are.equal('userdata', type(a))
+      assert.are.equal(3, #a)
+      assert.are.equal(2, a[2])
+      assert.are.equal(nil, a[4])
+      assert.are.equal(true, rapidjson.isarray(a))
+
+      a = rapidjson.decode('{"m": [[1, 2.5], [3, 4]], "s": [1, "a"], "e": []}')
+      assert.are.equal('table', type(a.m))
+      assert.are.equal(2.5, a.m[1][2])
+      assert.are.equal(4, a.m[2][2])
+      assert.are.same({1, "a"}, a.s)
+      assert.are.same({}, a.e)
+    end)
+
+    it('should encode typed arrays as JSON arrays', function()
+      local a = rapidjson.decode('{"v": [1, 2.5, -3]}')
+      a.v[3] = 7
+      assert.are.equal('{"v":[1.0,2.5,7.0]}', rapidjson.encode(a))
+      assert.are.equal('[[1,2],[3]]', rapidjson.encode((rapidjson.decode('[[1,2],[3]]'))))
+    end)
+  end)
+
+  describe('columnar option', function()
+    teardown(function() rapidjson.setoption('columnar', false) end)
+
+    it('should decode arrays of objects into columns', function()
+      rapidjson.setoption('columnar', true)
+      assert.are.equal(true, rapidjson.getoption('columnar'))
+      local a = rapidjson.decode('[{"id": 1, "ts": "a"}, {"id": 2, "ts": "b"}, {"id": 3, "v": [1]}]')
+      assert.are.same({1, 2, 3}, a.id)
+      assert.are.same({"a", "b"}, a.ts)
+      assert.are.same({[3] = {1}}, a.v)
+      assert.are.equal(3, a.n)
+
+      a = rapidjson.decode('[{"id": 1}, 2]')
+      assert.are.same({{id = 1}, 2}, a)
+      assert.are.same({}, rapidjson.decode('[]'))
+    end)
+
+    it('should keep the number of rows', function()
+      rapidjson.setoption('columnar', true)
+      assert.are.same({n = 2}, rapidjson.decode('[{}, {}]'))
+      assert.are.same({x = {1}, n = 3}, rapidjson.decode('[{"x": 1}, {}, {}]'))
+      assert.are.same({{n = 1}, {x = 2}}, rapidjson.decode('[{"n": 1}, {"x": 2}]'))
+    end)
+
+    it('should decode the array referenced by a JSON pointer', function()
+      rapidjson.setoption('columnar', '/data/0/r~1ows')
+      assert.are.equal('/data/0/r~1ows', rapidjson.getoption('columnar'))
+      local a = rapidjson.decode('{"data": [{"r/ows": [{"x": 1}, {"x": 2}], "rows": [{"x": 1}]}], "r/ows": [{"x": 3}]}')
+      assert.are.same({x = {1, 2}, n = 2}, a.data[1]["r/ows"])
+      assert.are.same({{x = 1}}, a.data[1].rows)
+      assert.are.same({{x = 3}}, a["r/ows"])
+    end)
+  end)
+
+  describe('hash_cons option', function()
+    teardown(function()
+      rapidjson.setoption('hash_cons', false)
+    end)
+
+    it('should share structurally identical subtrees', function()
+      rapidjson.setoption('hash_cons', true)
+      assert.are.equal(true, rapidjson.getoption('hash_cons'))
+      local a = rapidjson.decode('[{"x": 0, "y": [1, 2]}, {"y": [1, 2], "x": 0}, {"x": 0.0, "y": [1, 2]}, [1, 2]]')
+      assert.are.equal(a[1], a[2])
+      assert.are.equal(a[1].y, a[4])
+      assert.are_not.equal(a[1], a[3])
+      assert.are.equal(rapidjson.encode(a[1]), rapidjson.encode(a[2]))
+      assert.are.same({}, rapidjson.decode('[]'))
+      assert.are.equal(true, rapidjson.isobject(rapidjson.decode('[{}, []]')[1]))
+    end)
+
+    it('should guard shared tables in readonly mode', function()
+      rapidjson.setoption('hash_cons', 'readonly')
+      assert.are.equal('readonly', rapidjson.getoption('hash_cons'))
+      local a = rapidjson.decode('[{"x": 1}, {"x": 1}, [1, 2]]')
+      assert.are.equal(a[1], a[2])
+      assert.has.errors(function() a[1].y = 2 end)
+      assert.has.errors(function() a[1].x = 2 end)
+      assert.has.errors(function() a[3][1] = 3 end)
+      assert.are.equal(1, a[1].x)
+      assert.are.equal(2, #a[3])
+      assert.are.equal('readonly', getmetatable(a[1]))
+      if _VERSION ~= 'Lua 5.1' then
+        local keys = {}
+        for k, v in pairs(a[1]) do keys[#keys + 1] = k .. '=' .. v end
+        assert.are.same({ 'x=1' }, keys)
+      end
+      assert.are.equal('[{"x":1},{"x":1},[1,2]]', rapidjson.encode(a))
+      assert.are.equal(true, rapidjson.isobject(a[1]))
+      assert.has.errors(function() rapidjson.setoption('hash_cons', 'mutable') end)
+    end)
+  end)
+
+  describe('dedup_strings option', function()
+    teardown(function()
+      rapidjson.setoption('dedup_strings', false)
+    end)
+
+    it('should decode repeated long strings', function()
+      rapidjson.setoption('dedup_strings', true)
+      assert.are.equal(true, rapidjson.getoption('dedup_strings'))
+      local url = 'https://example.com/' .. string.rep('abcdefgh', 8)
+      local a = rapidjson.decode('["' .. url .. '", "' .. url .. '", "' .. url .. 'x", "short", "short"]')
+      assert.are.same({url, url, url .. 'x', 'short', 'short'}, a)
+    end)
+
+    it('should share the repeated strings', function()
+      rapidjson.setoption('dedup_strings', true)
+      local url = 'https://example.com/' .. string.rep('abcdefgh', 128)
+      local s = '[' .. string.rep('"' .. url .. '",', 999) .. '"' .. url .. '"]'
+      collectgarbage()
+      collectgarbage('stop')
+      local before = collectgarbage('count')
+      local a = rapidjson.decode(s)
+      local kbytes = collectgarbage('count') - before
+      collectgarbage('restart')
+      assert.are.equal(1000, #a)
+      assert.are.equal(true, kbytes < 256)  -- 1000 copies would take about 1 MB
+
+      if _VERSION == 'Lua 5.4' then
+        assert.are.equal(string.format('%p', a[1]), string.format('%p', a[1000]))
+      end
+    end)
+  end)
+
+  describe('preserve_order option', function()
+    teardown(function()
+      rapidjson.setoption('preserve_order', false)
+    end)
+
+    it('should re-encode objects in parse order', function()
+      rapidjson.setoption('preserve_order', true)
+      assert.are.equal(true, rapidjson.getoption('preserve_order'))
+      local s = '{"z":1,"a":{"y":[true],"b":2,"x":"x"},"m":{}}'
+      local a = rapidjson.decode(s)
+      assert.are.equal(s, rapidjson.encode(a))
+      assert.are.equal(s, rapidjson.encode(a, {sort_keys = true}))
+
+      a.a.b = nil
+      a.c = 2
+      assert.are.equal('{"z":1,"a":{"y":[true],"x":"x"},"m":{},"c":2}', rapidjson.encode(a))
+      assert.are.equal('{"b":1,"a":3}', rapidjson.encode((rapidjson.decode('{"b":1,"a":2,"a":3}'))))
+    end)
+  end)
+
+  describe('parse_cache option', function()
+    teardown(function()
+      rapidjson.setoption('parse_cache', 0)
+      rapidjson.setoption('parse_cache_bytes', 1048576)
+    end)
+
+    it('should return cached values for repeated inputs', function()
+      rapidjson.setoption('parse_cache', 2)
+      assert.are.equal(2, rapidjson.getoption('parse_cache'))
+      local stats = rapidjson.cachestats()
+      local a, pos = rapidjson.decode('{"a": [1, 2]}')
+      local b, pos2 = rapidjson.decode('{"a": [1, 2]}')
+      assert.are.equal(a, b)
+      assert.are.equal(pos, pos2)
+      assert.are_not.equal(a, rapidjson.decode('{"a": [1, 2]}', 1, nil))
+
+      rapidjson.decode('[1]')
+      rapidjson.decode('[2]')
+      local after = rapidjson.cachestats()
+      assert.are.equal(stats.hits + 1, after.hits)
+      assert.are.equal(stats.misses + 3, after.misses)
+      assert.are.equal(2, after.entries)
+      assert.are.equal(6, after.bytes)
+      assert.are.equal(stats.evictions + 1, after.evictions)
+    end)
+
+    it('should return read-only values', function()
+      rapidjson.setoption('parse_cache', 2)
+      local a = rapidjson.decode('{"a": [1, 2], "b": {"c": "d"}}')
+      assert.are.equal(false, (pcall(function() a.a[1] = 'changed' end)))
+      assert.are.equal(false, (pcall(function() a.b.c = nil end)))
+      assert.are.equal(false, (pcall(function() a.e = true end)))
+      assert.are.equal(2, a.a[2])
+      assert.are.equal('d', a.b.c)
+      assert.are.equal('readonly', getmetatable(a))
+      assert.are.equal('{"a":[1,2],"b":{"c":"d"}}', rapidjson.encode(a, { sort_keys = true }))
+      assert.are.equal(a, rapidjson.decode('{"a": [1, 2], "b": {"c": "d"}}'))
+      if _VERSION ~= 'Lua 5.1' then
+        assert.are.equal(2, #a.a)
+      end
+    end)
+
+    it('should evict the least recently used entry', function()
+      rapidjson.setoption('parse_cache', 2)
+      rapidjson.decode('[1]')
+      rapidjson.decode('[2]')
+      rapidjson.decode('[1]')
+      rapidjson.decode('[3]')
+      local stats = rapidjson.cachestats()
+      rapidjson.decode('[1]')
+      assert.are.equal(stats.hits + 1, rapidjson.cachestats().hits)
+      rapidjson.decode('[2]')
+      assert.are.equal(stats.misses + 1, rapidjson.cachestats().misses)
+    end)
+
+    it('should bound the cached input length', function()
+      rapidjson.setoption('parse_cache', 8)
+      rapidjson.setoption('parse_cache_bytes', 4)
+      assert.are.equal(0, rapidjson.cachestats().entries)
+      local misses = rapidjson.cachestats().misses
+      rapidjson.decode('[12345]')
+      rapidjson.decode('[1]')
+      assert.are.equal(1, rapidjson.cachestats().entries)
+      assert.are.equal(3, rapidjson.cachestats().bytes)
+      assert.are.equal(misses + 1, rapidjson.cachestats().misses)
+    end)
+  end)
+
+  describe('structural decoder_preset', function()
+    teardown(function()
+      rapidjson.setoption('decoder_preset', 'default')
+    end)
+
+    local docs = {
+      '{"a":[1,-2,3.5,1e300,-0.0,18446744073709551615,-9223372036854775808],"b":{"c":null,"d":true,"e":false}}',
+      '[ "plain", "esc\\"aped\\n", "\\u00e9\\ud83d\\ude00", "0123456789abcdef0123456789abcdef" ]',
+      '  [[], {}, [[1]], {"x": {"y": []}}, 0.1, 123456789012345678901234567890, 2.2250738585072014e-308]  ',
+      '[1, 2,]',
+      '42',
+    }
+
+    it('should decode documents as the default preset does', function()
+      for _, s in ipairs(docs) do
+        local a, pos = rapidjson.decode(s)
+        rapidjson.setoption('decoder_preset', 'structural')
+        assert.are.equal('structural', rapidjson.getoption('decoder_preset'))
+        local b, pos2 = rapidjson.decode(s)
+        rapidjson.setoption('decoder_preset', 'default')
+        assert.are.same(a, b)
+        assert.are.equal(pos, pos2)
+      end
+    end)
+
+    it('should stop after the root value', function()
+      rapidjson.setoption('decoder_preset', 'structural')
+      local a, pos = rapidjson.decode('x [1, 2] [3]', 2)
+      assert.are.same({1, 2}, a)
+      assert.are.equal(8, pos)
+    end)
+
+    it('should decode NaN and infinities as the default preset does', function()
+      for _, preset in ipairs({ 'default', 'structural' }) do
+        rapidjson.setoption('decoder_preset', preset)
+        local a = rapidjson.decode('[NaN, -NaN, Infinity, -Inf]')
+        assert.are_not.equal(a[1], a[1])
+        assert.are_not.equal(a[2], a[2])
+        assert.are.equal(math.huge, a[3])
+        assert.are.equal(-math.huge, a[4])
+      end
+    end)
+
+    it('should decode deeply nested documents', function()
+      rapidjson.setoption('decoder_preset', 'structural')
+      local depth = 20000
+      local a, pos = rapidjson.decode(string.rep('[', depth) .. string.rep(']', depth))
+      assert.are.equal(2 * depth + 1, pos)
+      for _ = 1, depth - 1 do a = a[1] end
+      assert.are.same({}, a)
+      assert.are.equal(nil, (rapidjson.decode(string.rep('[', depth) .. string.rep(']', depth - 1))))
+    end)
+
+    it('should report malformed documents', function()
+      rapidjson.setoption('decoder_preset', 'structural')
+      for _, s in ipairs({ '', '[1, 2', '{"a" 1}', '{"a":1 "b":2}', '[tru]', '[1.]', '["\\x"]', '["abc', '[01]' }) do
+        local a, pos, msg = rapidjson.decode(s)
+        assert.are.equal(nil, a)
+        assert.are.equal('string', type(msg))
+      end
+    end)
+  end)
 end)
@@ -138,4 +138,28 @@ describe('rapidjson.dump()', function()
     )
   end)
 
+  it('should write to an open file handle and leave it open', function()
+    local f = io.open("dump.json", "wb")
+    f:write("[")
+    assert.are.equal(true, rapidjson.dump({1, 2, 3}, f))
+    f:write("]")
+    f:close()
+    assert.are.equal('[[1,2,3]]', get_file_content("dump.json"))
+  end)
+
+  it('should write outputs larger than the file buffer', function()
+    local t = {}
+    for i = 1, 20000 do
+      t[i] = { id = i, name = "item" .. i }
+    end
+    rapidjson.dump(t, "dump.json", {sort_keys=true})
+    assert.are.equal(rapidjson.encode(t, {sort_keys=true}), get_file_content("dump.json"))
+  end)
+
+  it('should raise encoding errors', function()
+    assert.has.errors(function()
+      rapidjson.dump({ f = function() end }, "dump.json")
+    end)
+  end)
+
 end)
@@ -93,6 +93,27 @@ describe('rapidjson.encode()', function()
     )
   end)
 
+  it('should escape long strings with sparse and dense escapes', function()
+    local named = { ['"']='\\"', ['\\']='\\\\', ['\b']='\\b', ['\f']='\\f', ['\n']='\\n', ['\r']='\\r', ['\t']='\\t' }
+    local function escape(s)
+      return (s:gsub('[%z\1-\31"\\]', function(c) return named[c] or string.format('\\u%04X', c:byte()) end))
+    end
+
+    local strings = {
+      string.rep('plain ascii text, ', 20),
+      string.rep('x', 40) .. '"' .. string.rep('y', 40) .. '\n',
+      string.rep('"\\\n\t\1\31', 20),
+      string.rep('a\0b\127\128\255 "c"\r\n', 12),
+    }
+    for i=0,63 do strings[#strings + 1] = string.rep('-', i) .. string.char(i % 32) .. '\\' .. string.rep('-', 63 - i) end
+
+    for _, s in ipairs(strings) do
+      assert.are.equal('"' .. escape(s) .. '"', rapidjson.encode(s))
+      assert.are.equal(s, rapidjson.decode(rapidjson.encode({ s }))[1])
+    end
+    assert.are.equal('{"k":["' .. escape(strings[3]) .. '"]}', rapidjson.encode({ k = { strings[3] } }, { nan=false }))
+  end)
+
   it('should encode all number formats', function()
     assert.are.same(
       '[1000,-1000,23.4,-23.4,1990,-10000000,-0.001,10000000,1990,1990,-0.00199,-1990,100000000000000000000.0]',
@@ -106,6 +127,51 @@ describe('rapidjson.encode()', function()
     end
   end)
 
+  it('should encode floats in the shortest form that round-trips', function()
+    if rapidjson.getoption("lua_format_float") or rapidjson.getoption("lua_round_float") then
+      return
+    end
+
+    local values = {
+      0.1, 0.1 + 0.2, 1/3, -2/3, 5e-324, 2.2250738585072014e-308, 1.7976931348623157e308,
+      9007199254740993.0, 123456.789, 1e23, 8.41e21, 4.35, 2^-1074 * 3, 0.3 * 3,
+    }
+    local opts = {decimal_count=324}
+    assert.are.equal('[0.1,0.30000000000000004,1e23,4.35]',
+      rapidjson.encode({0.1, 0.1 + 0.2, 1e23, 4.35}, opts))
+    assert.are.equal('{"0.30000000000000004":true}', rapidjson.encode({[0.1 + 0.2]=true}, opts))
+    for _, v in ipairs(values) do
+      local s = rapidjson.encode({v}, opts)
+      assert.are.equal(v, rapidjson.decode(s)[1])
+      assert.are.equal(v, tonumber(s:sub(2, -2)))
+    end
+    assert.are.equal('[0.33]', rapidjson.encode({1/3}, {decimal_count=2}))
+    assert.are.equal('[-0.0]', rapidjson.encode({-0.0}))
+  end)
+
+  it('should support fixed_decimals options', function()
+    local opts = {fixed_decimals=3}
+    assert.are.equal('[1.0,2.5,0.125,-0.0,1.235,-1.234,1000000000000.0,3]',
+      rapidjson.encode({1.0004, 2.5, 0.125, -0.0001, 1.2345678, -1.2344, 1e12, 3}, opts))
+    assert.are.equal('{"0.333":true}', rapidjson.encode({[1/3]=true}, opts))
+    assert.are.equal('[0.12]', rapidjson.encode({0.125}, {fixed_decimals=2}))  -- ties to even
+    assert.are.equal('[1e300]', rapidjson.encode({1e300}, opts))
+    assert.are.equal('[0.3333333333333333]', rapidjson.encode({1/3}, {fixed_decimals=false, decimal_count=324}))
+    assert.has.errors(function() rapidjson.encode({1.5}, {fixed_decimals=16}) end)
+
+    for _ = 1, 100 do
+      local v = (math.random() - 0.5) * 10^math.random(-3, 9)
+      local s = rapidjson.encode(v, {fixed_decimals=4})
+      assert.are.equal(tonumber(string.format('%.4f', v)), tonumber(s))
+    end
+
+    rapidjson.setoption('fixed_decimals', 2)
+    assert.are.equal(2, rapidjson.getoption('fixed_decimals'))
+    assert.are.equal('[0.33]', rapidjson.encode({1/3}))
+    rapidjson.setoption('fixed_decimals', 0)
+    assert.are.equal('[0.3333333333333333]', rapidjson.encode({1/3}, {decimal_count=324}))
+  end)
+
   it('should support pretty options', function()
     assert.are.same(
 [[{
@@ -172,4 +238,259 @@ describe('rapidjson.encode()', function()
       rapidjson.encode( {id=7} )
     )
   end)
+
+  it('should encode short and long outputs without a state', function()
+    local values = { 0, 'x', { 1, 2.5, true }, { name = 'a', list = { {}, { 1 } } } }
+    local long = {}
+    for i=1,1000 do long[i] = 'element ' .. i end
+    values[#values + 1] = long
+
+    for _,v in ipairs(values) do
+      assert.are.equal(rapidjson.encode(v, {}), rapidjson.encode(v))
+    end
+    assert.are.same(long, rapidjson.decode(rapidjson.encode(long)))
+
+    local calls = 0
+    local meta = { __tojson = function() calls = calls + 1; return string.rep('1', 300) end }
+    assert.are.equal(302, #rapidjson.encode({ setmetatable({}, meta) }))
+    assert.are.equal(1, calls)
+
+    local co = coroutine.create(function() end)
+    local previous = debug.getmetatable(co)
+    debug.setmetatable(co, meta)
+    local ok, top, nested = pcall(function() return rapidjson.encode(co), rapidjson.encode({ co }) end)
+    debug.setmetatable(co, previous)
+    assert.are.equal(true, ok)
+    assert.are.equal(300, #top)
+    assert.are.equal(302, #nested)
+    assert.are.equal(3, calls)
+  end)
+
+  it('should encode nested calls and calls after errors', function()
+    local state = {}
+    local inner = setmetatable({}, { __tojson = function() return rapidjson.encode({ x = { 1, 2 } }, {}) end })
+    assert.are.equal('{"a":{"x":[1,2]},"b":"z"}', rapidjson.encode({ a = inner, b = 'z' }, { sort_keys = true }))
+
+    local failing = setmetatable({}, { __tojson = function() error('failed') end })
+    assert.are.equal(false, (pcall(rapidjson.encode, { failing }, state)))
+    assert.are.equal('[1,2,3]', rapidjson.encode({ 1, 2, 3 }, state))
+  end)
+
+  it('should classify mixed and sparse tables', function()
+    local mixed = { 1, 2, 3, x = 1 }
+    assert.are.equal('{"1":1,"2":2,"3":3,"x":1}', rapidjson.encode(mixed, { sort_keys = true }))
+    assert.are.equal('[1,2,null,4]', rapidjson.encode({ 1, 2, [4] = 4 }, { with_hole = true }))
+    assert.are.equal('{"1":1,"2":2,"4":4}', rapidjson.encode({ 1, 2, [4] = 4 }, { with_hole = false, sort_keys = true }))
+  end)
+
+  it('should trust __jsontype with trust_jsontype', function()
+    local decoded = rapidjson.decode('[1,2,3]')
+    decoded.extra = true
+    assert.are.equal('[1,2,3]', rapidjson.encode(decoded, { trust_jsontype = true }))
+    assert.are.equal('{"1":1,"2":2,"3":3,"extra":true}', rapidjson.encode(decoded, { sort_keys = true }))
+    assert.are.equal('{}', rapidjson.encode(rapidjson.object(), { trust_jsontype = true }))
+    assert.are.equal('[]', rapidjson.encode(rapidjson.array(), { trust_jsontype = true }))
+  end)
+
+  it('should encode repeated, escaped, and colliding object keys', function()
+    local records = {}
+    for i=1,3 do records[i] = { id = i, ['a"b'] = i, ['c\\d'] = i, ['e\nf'] = i } end
+    local expected = '{"a\\"b":1,"c\\\\d":1,"e\\nf":1,"id":1}'
+    assert.are.equal(expected, rapidjson.encode(records[1], { sort_keys = true }))
+    assert.are.same(records, rapidjson.decode(rapidjson.encode(records)))
+
+    local wide = {}
+    for i=1,2000 do wide['key' .. i] = i end
+    assert.are.same(wide, rapidjson.decode(rapidjson.encode(wide)))
+    assert.are.same(wide, rapidjson.decode(rapidjson.encode(wide, { pretty = true })))
+  end)
+
+  it('should encode tables sharing and differing in metatables', function()
+    local values = {}
+    for i=1,20 do
+      local meta = (i % 2 == 0) and { __tojson = function() return tostring(i) end }
+        or { __jsonorder = { 'b', 'a' } }
+      values[i] = setmetatable({ a = i, b = i }, meta)
+      values[i + 20] = rapidjson.decode('[' .. i .. ']')
+    end
+    local decoded = rapidjson.decode(rapidjson.encode(values))
+    assert.are.same({ b = 1, a = 1 }, decoded[1])
+    assert.are.equal(2, decoded[2])
+    assert.are.same({ 20 }, decoded[40])
+    assert.are.equal('{"b":19,"a":19}', rapidjson.encode(values[19]))
+  end)
+
+  it('should not confuse collected metatables with new ones', function()
+    local items, expected = {}, {}
+    for i=1,200 do
+      local jsontype = (i % 2 == 0) and 'array' or 'object'
+      items[i] = setmetatable({}, { __tojson = function()
+        collectgarbage()
+        return setmetatable({}, { __jsontype = jsontype })
+      end })
+      expected[i] = (jsontype == 'array') and '[]' or '{}'
+    end
+    assert.are.equal('[' .. table.concat(expected, ',') .. ']', rapidjson.encode(items))
+  end)
+
+  it('should order keys with compiled keyorders and cached sorts', function()
+    local order = rapidjson.keyorder({ 'c', 'a', 1 })
+    local value = { a = 1, b = 2, c = 3, [1] = 4 }
+    assert.are.equal('{"c":3,"a":1,"1":4,"b":2}', rapidjson.encode(value, { keyorder = order }))
+    assert.are.equal(rapidjson.encode(value, { keyorder = { 'c', 'a', 1 } }), rapidjson.encode(value, { keyorder = order }))
+
+    local meta = { __jsonorder = function() return rapidjson.keyorder({ 'b', 'z' }) end }
+    local nested = { setmetatable({ a = 1, b = 2 }, meta), setmetatable({ a = 1, b = 2 }, { __jsonorder = { 'b' } }) }
+    assert.are.equal('[{"b":2,"a":1},{"b":2,"a":1}]', rapidjson.encode(nested))
+
+    local records = {}
+    for i=1,50 do
+      records[i] = { delta = i, alpha = i, charlie = i, bravo = i, [10] = i, [2] = -i }
+    end
+    records[25] = { bravo = 0, delta = 0, [2] = 0, charlie = 0, alpha = 0, [10] = 0 }
+    local encoded = rapidjson.encode(records, { sort_keys = true })
+    local decoded = rapidjson.decode(encoded)
+    for i=1,50 do
+      local r = decoded[i]
+      assert.are.equal(string.format('{"2":%d,"10":%d,"alpha":%d,"bravo":%d,"charlie":%d,"delta":%d}',
+        r['2'], r['10'], r.alpha, r.bravo, r.charlie, r.delta), rapidjson.encode(records[i], { sort_keys = true }))
+    end
+    assert.are.equal(-7, decoded[7]['2'])
+    assert.has.errors(function() rapidjson.keyorder('a') end)
+  end)
+
+  it('should splice raw fragments and encode __tojson values', function()
+    local raw = rapidjson.raw('{"cached":[1,2,3]}')
+    assert.are.equal(raw, rapidjson.raw(raw))
+    assert.are.equal('{"cached":[1,2,3]}', tostring(raw))
+    assert.are.equal('[{"cached":[1,2,3]},{"cached":[1,2,3]}]', rapidjson.encode({ raw, raw }))
+    assert.are.equal('{"a":{"cached":[1,2,3]}}', rapidjson.encode({ a = raw }))
+
+    local point = { __tojson = function(self) return { self.x, self.y } end }
+    local fragment = { __tojson = function() return raw end }
+    assert.are.equal('[[1,2],{"cached":[1,2,3]},null]', rapidjson.encode({
+      setmetatable({ x = 1, y = 2 }, point),
+      setmetatable({}, fragment),
+      setmetatable({}, { __tojson = function() return rapidjson.null end }),
+    }))
+
+    local recursive = setmetatable({}, {})
+    getmetatable(recursive).__tojson = function(self) return self end
+    assert.has.errors(function() rapidjson.encode(recursive) end)
+    assert.has.errors(function() rapidjson.raw({}) end)
+  end)
+
+  it('should reuse memoized encodings until versions change', function()
+    local versioned = { __jsonversion = function(self) return self.version end }
+    local leaf = setmetatable({ version = 1, name = 'leaf' }, versioned)
+    local root = setmetatable({ version = 1, items = { leaf } }, versioned)
+    local state = { sort_keys = true }
+    assert.are.equal('{"items":[{"name":"leaf","version":1}],"version":1}', rapidjson.encode(root, state))
+
+    leaf.name = 'stale'  -- Unchanged version
+    assert.are.equal('{"items":[{"name":"leaf","version":1}],"version":1}', rapidjson.encode(root, state))
+    leaf.version = 2  -- Invalidates the root
+    assert.are.equal('{"items":[{"name":"stale","version":2}],"version":1}', rapidjson.encode(root, state))
+    assert.are.equal('{\n    "version": 1\n}', rapidjson.encode(setmetatable({ version = 1 }, versioned), { pretty = true }))
+
+    local constant = setmetatable({ a = 1 }, { __jsonversion = true })
+    assert.are.equal('[{"a":1},{"a":1}]', rapidjson.encode({ constant, constant }))
+    constant.a = 2
+    assert.are.equal('{"a":1}', rapidjson.encode(constant))
+    rapidjson.invalidate(constant)
+    assert.are.equal('{"a":2}', rapidjson.encode(constant))
+    constant.a = 3
+    rapidjson.invalidate()
+    assert.are.equal('{"a":3}', rapidjson.encode(constant))
+  end)
+
+  it('should encode alike whether or not flags are fixed at compile time', function()
+    local shared = setmetatable({ n = -1, f = 0.5 }, { __jsonversion = true })
+    local value = { id = 7, name = 'x', tags = { 'a', 2, -3.5 }, pos = { x = 1/3, y = -2 }, shared = shared }
+
+    local sorted = rapidjson.encode(value, { sort_keys = true })
+    assert.are.same(value, rapidjson.decode(rapidjson.encode(value)))
+    assert.are.equal('{"f":0.5,"n":-1}', rapidjson.encode(shared, { sort_keys = true }))
+
+    rapidjson.setoption('ignore_invalid', true)  -- Flags tested per value
+    assert.are.equal(sorted, rapidjson.encode(value, { sort_keys = true }))
+    -- The memoized encoding of "shared" is not reused across flags
+    assert.are.equal('[{"f":0.5,"n":4294967295},null]', rapidjson.encode({ shared, coroutine.create(print) }, { sort_keys = true, unsigned = true, bit32 = true }))
+    rapidjson.setoption('ignore_invalid', false)
+    assert.are.equal('[{"f":0.5,"n":-1}]', rapidjson.encode({ shared }, { sort_keys = true }))
+    assert.has.errors(function() rapidjson.encode({ coroutine.create(print) }) end)
+  end)
+
+  it('should encode numeric arrays in batches', function()
+    local values, parts = {}, {}
+    for i=1,5000 do
+      values[i] = (i % 3 == 0) and i / 4 or -i
+      parts[i] = (i % 3 == 0) and rapidjson.encode(i / 4) or tostring(-i)
+    end
+    assert.are.equal('[' .. table.concat(parts, ',') .. ']', rapidjson.encode(values))
+    assert.are.same(values, rapidjson.decode(rapidjson.encode(values)))
+
+    assert.are.equal('[1,2,"x",3.5,true,4,{"a":5},6,7]', rapidjson.encode({1, 2, 'x', 3.5, true, 4, {a=5}, 6, 7}))
+    assert.are.equal('[1,2,3,Infinity,NaN,5]', rapidjson.encode({1, 2, 3, math.huge, 0/0, 5}):gsub('%-?nan', 'NaN'))
+    assert.has.errors(function() rapidjson.encode({1, 2, 3, math.huge, 5}, {nan=false}) end)
+    assert.are.equal('[1,2,4294967295,1.5]', rapidjson.encode({1, 2, -1, 1.5}, {bit32=true, unsigned=true}))
+    assert.are.equal('[0.333,0.667,1,2]', rapidjson.encode({1/3, 2/3, 1, 2}, {fixed_decimals=3}))
+    assert.are.equal('[\n    1,\n    2,\n    3,\n    4\n]', rapidjson.encode({1, 2, 3, 4}, {pretty=true}))
+  end)
+
+  it('should pass chunks of the output to an encode_to sink', function()
+    local long = {}
+    for i=1,1000 do long[i] = 'element ' .. i end
+
+    local chunks = {}
+    rapidjson.encode_to(function(chunk) chunks[#chunks + 1] = chunk end, long, { chunk_size = 1024 })
+    assert.are.equal(rapidjson.encode(long), table.concat(chunks))
+    for i=1,#chunks - 1 do
+      assert.are.equal(1024, #chunks[i])
+    end
+
+    local nested = {}
+    rapidjson.encode_to(function(chunk)
+      nested[#nested + 1] = rapidjson.encode(chunk)
+    end, { 1, 2 })
+    assert.are.same({ '"[1,2]"' }, nested)
+
+    assert.has_error(function() rapidjson.setoption('chunk_size', 1024) end)
+    assert.has_error(function() rapidjson.setoption('compress', false) end)
+    assert.has_error(function() rapidjson.setoption('threads', 1) end)
+  end)
+
+  it('should encode alike with threads when available', function()
+    local long = string.rep('long "string"\n', 40)
+    local value = { rows = {}, index = {}, empty = {}, [1.5] = 'float key' }
+    for i=1,4000 do
+      value.rows[i] = { id = i, score = i / 7, name = 'row ' .. i, text = (i % 50 == 0) and long or nil, tags = { i, -i, i * 0.25 } }
+      value.index['k' .. i] = { i, i % 2 == 0, { nested = { 'x', i / 3 } } }
+    end
+    value.rows[10].tags[2] = math.huge
+
+    for _,option in ipairs({ {}, { sort_keys = true }, { fixed_decimals = 2 }, { bit32 = true, unsigned = true } }) do
+      local serial = rapidjson.encode(value, option)
+      option.threads = 4
+      local ok, parallel = pcall(rapidjson.encode, value, option)
+      if ok then
+        assert.are.equal(serial, parallel)
+        option.threads = true
+        assert.are.equal(serial, rapidjson.encode(value, option))
+      end
+    end
+
+    assert.are.equal('[1,2]', rapidjson.encode({ 1, 2 }, { threads = false }))
+    assert.has.errors(function() rapidjson.encode({}, { threads = 0 }) end)
+    assert.has.errors(function() rapidjson.encode({ print }, { threads = 1 }) end)
+    assert.has.errors(function() rapidjson.encode({ 0/0 }, { threads = 2, nan = false }) end)
+  end)
+
+  it('should propagate encode_to sink errors', function()
+    local ok, err = pcall(rapidjson.encode_to, function() error('closed') end, { 1, 2, 3 })
+    assert.are.equal(false, ok)
+    assert.are.equal(true, string.find(err, 'closed', 1, true) ~= nil)
+    assert.are.equal('[1,2,3]', rapidjson.encode({ 1, 2, 3 }, {}))
+    assert.has.errors(function() rapidjson.encode_to(nil, {}) end)
+  end)
 end)
@@ -257,4 +257,33 @@ describe('rapidjson.load()', function()
       end)
     end)
   end)
+
+  describe('should load', function()
+    it('an open file handle', function()
+      local f = io.open('test/spec/query.json', 'rb')
+      local a = rapidjson.load(f)
+      f:close()
+      assert.are.same(rapidjson.decode(get_file_content('test/spec/query.json')), a)
+    end)
+
+    it('compressed contents when available', function()
+      local v = { name = 'rapidjson', list = { 1, 2, 3 }, text = string.rep('abc', 100) }
+      for _,format in ipairs({ 'gzip', 'zlib' }) do
+        local ok, z = pcall(rapidjson.encode, v, { compress = format })
+        if ok then
+          assert.are_not.equal(rapidjson.encode(v), z)
+          assert.are.same(v, rapidjson.decode(z))
+          assert.are.equal(nil, rapidjson.decode(z:sub(1, math.floor(#z / 2))))
+        end
+      end
+    end)
+
+    it('plain contents that resemble a compression header', function()
+      assert.are.equal(80, rapidjson.decode('80', 1))
+      local s = '[' .. string.rep('8, ', 100) .. '8]'
+      local v = rapidjson.decode(s)
+      assert.are.equal(101, #v)
+      assert.are.equal(8, v[101])
+    end)
+  end)
 end)
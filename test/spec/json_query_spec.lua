@@ -0,0 +1,52 @@
+--luacheck: ignore describe it
+describe('rapidjson.query()', function()
+  local file = 'test/spec/query.json'
+
+  it('should return matched values in document order', function()
+    assert.are.same({1, 2, {id = 3}}, rapidjson.query(file, '$.items[*].id'))
+    assert.are.same({1, 10, 2, {id = 3}, 3}, rapidjson.query(file, '$..id'))
+    assert.are.same({3}, rapidjson.query(file, '$.arr[1][0]'))
+    assert.are.same({3}, rapidjson.query(file, "$['meta']['count']"))
+    assert.are.same({{'a', 'b'}}, rapidjson.query(file, '$.items.*.tags'))
+    assert.are.same({}, rapidjson.query(file, '$.missing[0]'))
+  end)
+
+  it('should accept open file handles', function()
+    local f = io.open(file, 'rb')
+    assert.are.same({{count = 3}}, rapidjson.query(f, '$.meta'))
+    f:close()
+  end)
+
+  it('should pass values to the callback until it returns false', function()
+    local values = {}
+    local n = rapidjson.query(file, '$..id', function(v)
+      values[#values + 1] = v
+      return v ~= 2
+    end)
+    assert.are.equal(3, n)
+    assert.are.same({1, 10, 2}, values)
+  end)
+
+  it('should pass values to the callback in document order', function()
+    for _, path in ipairs({ '$..id', '$.items..*', '$..*' }) do
+      local values = {}
+      local n = rapidjson.query(file, path, function(v) values[#values + 1] = v end)
+      assert.are.equal(#values, n)
+      assert.are.same(rapidjson.query(file, path), values)
+    end
+
+    local values = {}
+    rapidjson.query(file, '$..id', function(v) values[#values + 1] = v; return type(v) ~= 'table' end)
+    assert.are.same({1, 10, 2, {id = 3}}, values)
+  end)
+
+  it('should report errors', function()
+    assert.has_error(function() rapidjson.query('not-exist-file.json', '$') end)
+    assert.has_error(function() rapidjson.query(file, 'items') end)
+    assert.has_error(function() rapidjson.query(file, '$.items[-1]') end)
+
+    local r, offset, msg = rapidjson.query('test/spec/empty-file.json', '$')
+    assert.are.equal(nil, r)
+    assert.are.equal('string', type(msg))
+  end)
+end)